@@ -20,8 +20,12 @@
  * MT-Unsafe
  */
 
+#define _GNU_SOURCE  // ppoll(), sendmmsg(), recvmmsg(), pthread_setaffinity_np()
+
 #include "microtcp.h"
 #include "../utils/crc32.h"
+#include "../utils/uring.h"
+#include "../utils/slab.h"
 #include "../utils/log.h"
 
 #include <string.h>
@@ -29,26 +33,305 @@
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>  // struct sock_txtime
+
+#ifndef UDP_SEGMENT  // older C libraries, Linux 4.18 and 5.0
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SO_TXTIME  // Linux 4.19
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+#endif
 
 
 #define MICROTCP_HEADER_SIZE sizeof(microtcp_header_t)
 #define MIN2(x, y) ( (x > y) ? y : x )
-#define _ntoh_recvd_tcph(microtcp_header)  \
+#define MAX2(x, y) ( (x > y) ? x : y )
+#define SEQ_LT(a, b)  ( (int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0 )
+#define SEQ_LEQ(a, b) ( (int32_t)((uint32_t)(a) - (uint32_t)(b)) <= 0 )
+#define SENDQ_AT(sock, i) ( &(sock)->sendq[((sock)->sendq_head + (i)) % (sock)->sendq_cap] )
+#define RECVBUF_IDX(sock, seq) ( ((sock)->recv_head + (uint32_t)((seq) - (sock)->recv_seq)) & ((sock)->recvbuf_len - 1UL) )
+#define BITMAP_LEN(bits) ( ((bits) + 7U) / 8U )
+#define BIT_SET(map, i) ( (map)[(i) >> 3] |= (uint8_t)(1U << ((i) & 7U)) )
+#define BIT_CLR(map, i) ( (map)[(i) >> 3] &= (uint8_t)~(1U << ((i) & 7U)) )
+#define BIT_GET(map, i) ( ((map)[(i) >> 3] >> ((i) & 7U)) & 1U )
+#define _ntoh_recvd_tcph(microtcp_header, tcph)  \
 								{\
 									microtcp_header.seq_number = ntohl(tcph.seq_number);\
 									microtcp_header.ack_number = ntohl(tcph.ack_number);\
 									microtcp_header.control    = ntohs(tcph.control);\
 									microtcp_header.window     = ntohs(tcph.window);\
 									microtcp_header.data_len   = ntohl(tcph.data_len);\
+									microtcp_header.future_use0 = ntohl(tcph.future_use0);\
+									microtcp_header.future_use1 = ntohl(tcph.future_use1);\
+									microtcp_header.future_use2 = ntohl(tcph.future_use2);\
 									microtcp_header.checksum   = ntohl(tcph.checksum);\
 								}
 
-#define TIOUT_DISABLE  0
-#define TIOUT_ENABLE   1
+#define US_TO_TICKS(us) ( ((us) + MICROTCP_TIMER_TICK_US - 1U) / MICROTCP_TIMER_TICK_US )
+#define SENDQ_IDX(sock, seg) ( ((size_t)((seg) - (sock)->sendq) + (sock)->sendq_cap - (sock)->sendq_head) % (sock)->sendq_cap )
+#define DGRAM_LEN(b, i) ( (b)->iov[2 * (i)].iov_len + (b)->iov[2 * (i) + 1].iov_len )  // of a queued datagram
+#define GSO_MAX_LEN 65507U  // UDP payload of a super-datagram (IPv4)
+#define GRO_DGRAM_LEN 65536U
+#define SLOT_LEN ( MICROTCP_HEADER_SIZE + MICROTCP_MSS )  // a segment slot of the pool holds a full segment
+
+
+/* Every datagram of a batch owns a slot of the segment pool and a pair of iovecs.
+ * Received datagrams land in the slot, sent ones are gathered from the header in the
+ * slot and the payload in 'sndbuf' */
+struct microtcp_batch
+{
+	struct mmsghdr msgs[MICROTCP_BATCH_LEN];
+	struct iovec iov[2 * MICROTCP_BATCH_LEN];
+	uint8_t * slot[MICROTCP_BATCH_LEN];
+	unsigned int cnt;  // tx: datagrams queued, rx: datagrams received
+	unsigned int pos;  // rx: next datagram to be consumed
+
+	/* MICROTCP_SO_GSO: runs of queued datagrams are packed in 'gso' as one super-datagram each,
+	 * received datagrams may be coalesced segments of 'seg' bytes, consumed from 'off' on */
+	struct mmsghdr gso[MICROTCP_BATCH_LEN];
+	uint8_t ctl[MICROTCP_BATCH_LEN][CMSG_SPACE(sizeof(uint64_t))];  // tx: UDP_SEGMENT or SCM_TXTIME, rx: UDP_GRO
+	unsigned int seg[MICROTCP_BATCH_LEN];                           // tx: datagrams packed, rx: segment size
+	unsigned int off;
+
+	/* The batch of a connection of a listener is a single-producer/single-consumer
+	 * ring instead, filled by the thread of the listener */
+	unsigned int head;  // datagrams enqueued (written by the listener only)
+	unsigned int tail;  // datagrams released (written by the connection only)
+	unsigned int held;  // the datagram at 'tail' is handed out and not released yet
+};
+
+enum { FLOW_SYN_RCVD, FLOW_QUEUED, FLOW_ACCEPTED };
+
+/* A connection of a listener, keyed by the address of the peer (the local
+ * half of the 4-tuple is the one of the bound socket). Only the listener
+ * thread looks flows up and enqueues into 'q', under the lock of the listener */
+struct microtcp_flow
+{
+	struct microtcp_flow * next;        // chain of the hash bucket
+	struct microtcp_flow * syn_next;    // half-open flows, oldest first
+	struct microtcp_flow ** syn_pprev;
+	struct microtcp_flow * aq_next;     // accept queue
+	struct microtcp_listener * listener;
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+	uint64_t hash;
+	int state;
+	int evfd;                           // signaled when 'q' gets datagrams
+	int notify;                         // 'evfd' has to be signaled after the current batch
+	struct microtcp_batch * q;          // datagrams of the flow
+
+	/* 3-way handshake, handled by the listener */
+	uint32_t iss;                       // sequence number of our SYN-ACK
+	uint32_t irs;                       // sequence number of the SYN of the peer
+	uint32_t opts;
+	uint16_t peer_win;
+	uint8_t peer_wscale;
+	uint64_t synack_us;
+	uint32_t rtt;
+};
+
+struct microtcp_listener
+{
+	int sd;
+	int closing;
+	int draining;                       // microtcp_listener_accept() fails, accepted flows are still served
+	int nonblock;                       // microtcp_listener_accept() fails with EAGAIN instead of blocking
+	int aq_evfd;                        // signaled when connections enter the accept queue
+	int aq_notify;                      // 'aq_evfd' has to be signaled after the current batch
+	pthread_t thread;
+	pthread_mutex_t lock;               // flows, accept queue and counters
+	pthread_cond_t acceptable;
+	uint64_t seed;                      // of the hash function (keeps chains short against crafted peers)
+	struct microtcp_flow ** buckets;
+	size_t nbuckets;
+	size_t nflows;
+	struct microtcp_flow * syn_head;
+	struct microtcp_flow ** syn_tail;
+	size_t syn_len;
+	struct microtcp_flow * aq_head;
+	struct microtcp_flow ** aq_tail;
+	size_t aq_len;
+	size_t backlog;
+	struct microtcp_batch * rxb;
+	struct sockaddr_storage names[MICROTCP_BATCH_LEN];
+	struct microtcp_flow * touched[MICROTCP_BATCH_LEN];  // flows that got datagrams from 'rxb'
+	unsigned int ntouched;
+	uint64_t dropped;
+};
+
+/* A worker of a sharded server: a thread pinned to a CPU that owns a listener
+ * of its own on a SO_REUSEPORT socket. The kernel steers every peer to one of
+ * the sockets of the port, so the flows of a shard never meet another CPU */
+struct microtcp_shard
+{
+	struct microtcp_server * server;
+	int idx;
+	int cpu;                            // -1 if not pinned
+	pthread_t thread;
+	microtcp_listener_t * listener;
+	int err;                            // errno of the start up of the shard
+	uint64_t served;                    // connections handed to the handler
+};
+
+struct microtcp_server
+{
+	int domain;
+	const struct sockaddr * address;    // valid while the shards start up
+	socklen_t address_len;
+	microtcp_handler_t handler;
+	void * arg;
+	pthread_mutex_t lock;               // start up only
+	pthread_cond_t started;
+	int nstarted;
+	int nshards;
+	struct microtcp_shard * shards;
+};
+
+/* A socket or a listener registered in a loop. Removed watches stay linked (callbacks
+ * may remove any watch while the loop walks the list) until the end of microtcp_poll() */
+struct microtcp_watch
+{
+	struct microtcp_watch * next;
+	struct microtcp_loop * loop;
+	microtcp_sock_t * sock;
+	microtcp_listener_t * listener;
+	int fd;                             // polled by epoll: the UDP socket or an eventfd
+	int removed;
+	int io;                             // 'fd' got ready in the last epoll_wait()
+	int closed;                         // MICROTCP_EV_CLOSED was reported
+	uint32_t events;                    // MICROTCP_EV_* of interest
+	microtcp_event_cb_t cb;
+	microtcp_accept_cb_t accept_cb;
+	void * arg;
+};
+
+struct microtcp_loop
+{
+	int epfd;
+	struct microtcp_watch * watches;
+	int removed;                        // some watches wait to be freed
+	int busy;                           // callbacks ran in the last microtcp_poll(), more may be due
+	struct epoll_event evs[MICROTCP_LOOP_EVENTS];
+};
+
+#ifdef URING_AVAILABLE
+
+enum { URING_TX, URING_RX };  // 'user_data' of the requests
+
+/* The io_uring backend of a plain socket. A multishot recvmsg() stays posted and
+ * lands the datagrams in provided buffers, the datagrams of 'txb' are sent with a
+ * single io_uring_enter() per batch, which also reaps the received ones */
+struct microtcp_uring
+{
+	uring_t ring;
+	uring_bufs_t bufs;
+	struct msghdr rx_msg;               // template of the multishot recvmsg(), no address nor control data
+	int armed;                          // the multishot recvmsg() is posted
+	int error;                          // error of the receive, reported by _recv_timed()
+	unsigned int tx_inflight;           // sends that did not complete, their 'txb' slots are in use
+	uint16_t rx[MICROTCP_URING_BUFS];   // buffers holding a received datagram, in arrival order
+	unsigned int rx_head;
+	unsigned int rx_tail;
+	int held;                           // the buffer of the last datagram handed out is not released yet
+	uint16_t held_bid;
+};
+
+#endif
+
+
+/**
+ * @brief Reports (up to) the first two ranges of out-of-order data held in 'recvbuf'
+ * as SACK blocks. Block #1 is sent as absolute [left, right) edges, block #2 is
+ * packed relative to block #1 and is omitted if it does not fit in 16+16 bits.
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param tcph header of an outgoing ACK (network-byte-order)
+ */
+static void _sack_blocks(const microtcp_sock_t * __restrict__ sock, microtcp_header_t * __restrict__ tcph)
+{
+	uint32_t left[2], right[2];
+	uint32_t limit;
+	uint32_t off;
+	size_t idx;
+	int n;
+
+
+	limit = sock->recvbuf_len - (uint32_t)(sock->ack_number - sock->recv_seq);
+	limit = ( SEQ_LT(sock->ack_number, sock->recv_high) ) ? MIN2(limit, (uint32_t)(sock->recv_high - sock->ack_number)) : 0U;
+
+	for ( n = 0, off = 1U; (off < limit) && (n < 2); ) {
+
+		idx = RECVBUF_IDX(sock, sock->ack_number + off);
+
+		if ( !BIT_GET(sock->recvmap, idx) ) {
+
+			off += ( !(idx & 7U) && !sock->recvmap[idx >> 3] && (off + 8U <= limit) ) ? 8U : 1U;
+			continue;
+		}
+
+		left[n] = sock->ack_number + off;
+
+		while ( (off < limit) && BIT_GET(sock->recvmap, RECVBUF_IDX(sock, sock->ack_number + off)) )
+			++off;
+
+		right[n++] = sock->ack_number + off;
+	}
+
+	tcph->future_use0 = htonl( (n) ? left[0] : 0U );
+	tcph->future_use1 = htonl( (n) ? right[0] : 0U );
+	tcph->future_use2 = 0U;
+
+	if ( (n == 2) && (left[1] - right[0] <= UINT16_MAX) && (right[1] - left[1] <= UINT16_MAX) )
+		tcph->future_use2 = htonl( ((left[1] - right[0]) << 16) | (right[1] - left[1]) );
+}
+
+/**
+ * @brief The receive window to advertise: the free space of 'recvbuf', in units of
+ * the window scale (MICROTCP_OPT_WSCALE) and rounded down so that the peer never
+ * sends more than fits. It is remembered in 'rcv_wnd' (in bytes).
+ * 
+ * @param sock a valid microTCP socket handle
+ * @return the window field of an outgoing segment (host-byte-order)
+ */
+static uint16_t _rcv_wnd(microtcp_sock_t * sock)
+{
+	size_t wnd = (sock->recvbuf_len - sock->buf_fill_level) >> sock->rcv_wscale;
+
+
+	wnd           = MIN2(wnd, (size_t)(UINT16_MAX));
+	sock->rcv_wnd = (uint32_t)(wnd) << sock->rcv_wscale;
+
+	return (uint16_t)(wnd);
+}
+
+/**
+ * @return the smallest window scale shift that lets a window of 'len' bytes (the
+ * size of a receive buffer) be advertised in the 16 bits of the window field
+ */
+static uint8_t _wscale(size_t len)
+{
+	uint8_t shift = 0U;
+
 
+	while ( (shift < MICROTCP_WSCALE_MAX) && ((len >> shift) > UINT16_MAX) )
+		++shift;
 
+	return shift;
+}
 
 /**
  * @brief Initializes the microTCP header for a packet to get send over the network. By giving FRAGMENT
@@ -86,545 +369,4518 @@ static void _preapre_send_tcph(microtcp_sock_t * __restrict__ sock, microtcp_hea
 		check(-1);
 	}
 
+	if ( ctrlb & CTRL_ACK ) {  // acknowledges everything received, a delayed ACK is no longer due
+
+		sock->delack_segs = 0U;
+		tw_del(sock->wheel, &sock->delack_timer);
+	}
+
 	tcph->seq_number = htonl(sock->seq_number);
 	tcph->ack_number = htonl(sock->ack_number);
 	tcph->control    = htons(ctrlb);
-	tcph->window     = htons(MICROTCP_RECVBUF_LEN - sock->buf_fill_level);
+	tcph->window     = htons(_rcv_wnd(sock));
 	tcph->data_len   = htonl(paysz);
 	tcph->checksum   = htonl( (paysz) ? crc32(payld, paysz) : 0U );
+
+	if ( (sock->opts & MICROTCP_OPT_SACK) && (ctrlb & CTRL_ACK) && (sock->ack_number != sock->recv_seq + sock->recvbuf_len) )
+		_sack_blocks(sock, tcph);
+	else
+		tcph->future_use0 = tcph->future_use1 = tcph->future_use2 = 0U;
 }
 
 /**
- * @brief ENABLE or DISABLE the timeout socket option
- * @param sockfd A valid socket
- * @param too timeout-option (TIOUT_ENABLE, TIOUT_DISABLE)
- * @return int 
+ * @return current time of the monotonic clock in us
  */
-static int _timeout(int sockfd, int too)
+static uint64_t _now_us(void)
 {
+	struct timespec ts;
 
-	struct timeval to;  // timeout
 
-	to.tv_sec = 0L;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	if ( too == TIOUT_ENABLE )
-		to.tv_usec = MICROTCP_ACK_TIMEOUT_US;
-	else  // timeout disabled
-		to.tv_usec = 0L;
-	
-	check( setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &to, sizeof(to)) );
-
-	return EXIT_SUCCESS;
-}
-
-static void _update_recv_buf(microtcp_sock_t *socket)
-{
-	
+	return (uint64_t)(ts.tv_sec) * 1000000ULL + (uint64_t)(ts.tv_nsec) / 1000ULL;
 }
 
-static void _cleanup();  /** TODO: add to at_exit() - free recvbuf() */
-
-//////////////////////////////////////////////////////////////////////////////////////
-
-/** TODO: [!] implement byte and packet statistics [!] */
-
-microtcp_sock_t microtcp_socket(int domain, int type, int protocol)
+/**
+ * @brief Feeds an RTT sample to the SRTT/RTTVAR estimator (RFC 6298) and derives
+ * a new RTO, which also drops any exponential backoff.
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param rtt the sample in us
+ */
+static void _rtt_sample(microtcp_sock_t * sock, uint32_t rtt)
 {
-	microtcp_sock_t sock;
-	int sockfd;
-
-
-	if ( type != SOCK_DGRAM )
-		LOG_DEBUG("type of socket changed to 'SOCK_DGRAM'\n");
-
-	bzero(&sock, sizeof(sock));
-	sock.recvbuf = (uint8_t *) malloc(MICROTCP_RECVBUF_LEN);
+	uint32_t delta;
+	uint64_t rto;
 
-	if ( !sock.recvbuf ) {
 
-		sock.sd    = -1;
-		sock.state = INVALID;
-		sock.state = CLOSED;
-		errno = ENOMEM;
+	if ( !sock->srtt ) {  // first measurement
 
-		return sock;
+		sock->srtt   = MAX2(rtt, 1U);
+		sock->rttvar = rtt / 2U;
 	}
+	else {
 
-	check( sockfd = socket(domain, SOCK_DGRAM, protocol ));
+		delta = ( sock->srtt > rtt ) ? sock->srtt - rtt : rtt - sock->srtt;
 
-	memset(&sock, 0, sizeof(sock));
-	srand(time(NULL) + getpid());
+		sock->rttvar = (3U * sock->rttvar + delta) / 4U;
+		sock->srtt   = (7U * sock->srtt + rtt) / 8U;
+	}
 
-	sock.sd         = sockfd;
-	sock.seq_number = rand();
-	sock.cwnd       = MICROTCP_INIT_CWND;
-	sock.ssthresh   = MICROTCP_INIT_SSTHRESH;
-	
-	#ifdef ENABLE_DEBUG_MSG
-	ackbase = sock.seq_number;
-	#endif
+	rto = (uint64_t)(sock->srtt) + MAX2(1U, 4U * sock->rttvar);
+	sock->rto = (uint32_t)( MIN2(MAX2(rto, (uint64_t)(sock->rto_min)), (uint64_t)(sock->rto_max)) );
+}
 
+/*
+ * A congestion control algorithm drives 'cwnd', 'ssthresh' and 'cc_state' through
+ * these hooks, the detection of losses and the recovery from them are common to all.
+ * Its own state lives in 'cc_priv', zeroed when the algorithm is selected.
+ */
+struct microtcp_cc
+{
+	const char * name;
+	void (*init)(microtcp_sock_t * sock);                              // optional
+	void (*on_ack)(microtcp_sock_t * sock, uint32_t acked, uint32_t rtt);  // 'acked' new bytes, 'rtt' sample in us (0 if none)
+	void (*on_loss)(microtcp_sock_t * sock);                           // 3 duplicate ACKs, fast retransmit
+	void (*on_timeout)(microtcp_sock_t * sock);                        // retransmission timeout
+	uint64_t (*pacing_rate)(const microtcp_sock_t * sock);             // bytes per second, 0 if not paced
+};
 
-	return sock;
-}
+#define CC_PRIV(sock, type) ( (type *)((sock)->cc_priv) )
 
-int microtcp_bind(microtcp_sock_t * __restrict__ socket, const struct sockaddr * __restrict__ address,
-               socklen_t address_len)
+/**
+ * @return whether cwnd limited the sender up to an ACK of 'acked' new bytes. A window
+ * that the peer or the application leaves unused is not grown further (RFC 7661).
+ */
+static int _cc_cwnd_limited(const microtcp_sock_t * sock, uint32_t acked)
 {
-	check( bind(socket->sd, address, address_len) );
-	return EXIT_SUCCESS;
+	return sock->seq_number - sock->snd_una + acked + MICROTCP_MSS > sock->cwnd;
 }
 
-int microtcp_connect(microtcp_sock_t * __restrict__ socket, const struct sockaddr * __restrict__ address,
-                  socklen_t address_len)
+/**
+ * @brief Slow start: cwnd grows by the acknowledged bytes (it doubles every RTT)
+ * until it reaches ssthresh.
+ *
+ * @return the bytes of 'acked' left over for congestion avoidance
+ */
+static uint32_t _cc_slow_start(microtcp_sock_t * sock, uint32_t acked)
 {
-	microtcp_header_t tcph;
-	int64_t sockfd;
+	size_t grow = ( sock->ssthresh > sock->cwnd ) ? sock->ssthresh - sock->cwnd : 0UL;
 
 
-	if ( !socket ) {
+	grow        = MIN2(grow, (size_t)(acked));
+	sock->cwnd += grow;
 
-		errno = EINVAL;
-		return -(EXIT_FAILURE);
-	}
+	if ( sock->cwnd >= sock->ssthresh )
+		sock->cc_state = CONG_AVOID;
 
-	check( connect(socket->sd, address, address_len) );
+	return acked - (uint32_t)(grow);
+}
 
-	tcph.seq_number = htonl(socket->seq_number);
-	tcph.window     = htons(MICROTCP_RECVBUF_LEN);
-	tcph.control    = htons(CTRL_SYN);
+/**
+ * @return a pacing rate that spreads cwnd over a smoothed RTT, twice as fast in slow
+ * start so that the window can still double (0 until the first RTT sample)
+ */
+static uint64_t _cc_cwnd_rate(const microtcp_sock_t * sock)
+{
+	uint64_t rate;
 
-	check( send(socket->sd, &tcph, sizeof(tcph), 0) );   // send SYN
-	check( recv(socket->sd, &tcph, sizeof(tcph), 0) );   // recv SYNACK
 
-	#ifdef ENABLE_DEBUG_MSG
-	seqbase = ntohl(tcph.seq_number);  // necessary for print_tcp_header()
-	print_tcp_header(socket, &tcph);
-	#endif
+	if ( !sock->srtt )
+		return 0ULL;
 
-	/** SYNACK **/
-	if ( ntohs(tcph.control) != (CTRL_SYN | CTRL_ACK) ) {
+	rate = (uint64_t)(sock->cwnd) * 1000000ULL / sock->srtt;
 
-		socket->state = INVALID;
-		errno = ECONNABORTED;
+	return ( sock->cc_state == SLOW_START ) ? 2ULL * rate : rate + rate / 5ULL;
+}
 
-		return -(EXIT_FAILURE);
-	}
+/*
+ * Reno: one MSS per RTT in congestion avoidance, cwnd halves on loss
+ */
 
-	++socket->seq_number;
-	socket->ack_number = ntohl(tcph.seq_number) + 1U;
-	socket->sendbuflen = ntohs(tcph.window);
+static void _reno_on_ack(microtcp_sock_t * sock, uint32_t acked, uint32_t rtt)
+{
+	(void)(rtt);
 
-	tcph.seq_number = htonl(socket->seq_number);
-	tcph.ack_number = htonl(socket->ack_number);
-	tcph.control    = htons(CTRL_ACK);
+	if ( !_cc_cwnd_limited(sock, acked) )
+		return;
 
-	check( send(socket->sd, &tcph, sizeof(tcph), 0) );  // send ACK
-	socket->state     = SLOW_START;
+	if ( (sock->cc_state == SLOW_START) && !(acked = _cc_slow_start(sock, acked)) )
+		return;
 
-	// _sock_enable_async(socket);
+	sock->cwnd += MIN2((size_t)(MICROTCP_MSS), ((size_t)(MICROTCP_MSS) * acked) / sock->cwnd + 1UL);
+}
 
-	LOG_DEBUG("INIT CCONTROL:s.state: %d, s.cwnd: %ld, s.ssthres: %ld\n",socket->state,socket->cwnd,socket->ssthresh);
-	return EXIT_SUCCESS;
+/**
+ * @return the ssthresh after a loss, half the data in flight but no less than 2 MSS
+ * (RFC 5681, eq. 4), so that back-to-back timeouts do not skip the next slow start
+ */
+static size_t _reno_ssthresh(const microtcp_sock_t * sock)
+{
+	return MAX2((size_t)(sock->seq_number - sock->snd_una) / 2UL, 2UL * MICROTCP_MSS);
 }
 
-int microtcp_accept(microtcp_sock_t * __restrict__ socket, struct sockaddr * __restrict__ address,
-                 socklen_t address_len)
+static void _reno_on_loss(microtcp_sock_t * sock)
 {
-	microtcp_header_t tcph;
+	sock->ssthresh = _reno_ssthresh(sock);
+	sock->cwnd     = sock->ssthresh + 3 * MICROTCP_MSS;
+}
 
+static void _reno_on_timeout(microtcp_sock_t * sock)
+{
+	sock->ssthresh = _reno_ssthresh(sock);
+	sock->cwnd     = MICROTCP_MSS;
+	sock->cc_state = SLOW_START;
+}
 
-	if ( socket->state != INVALID )
-		return -(EXIT_FAILURE);
+/*
+ * CUBIC (RFC 9438): after a reduction cwnd follows W(t) = C * (t - K)^3 + W_max, concave
+ * up to the window of the last loss (W_max), then convex to probe for more. The growth
+ * depends on the time since the loss rather than on the RTT, and it never falls below
+ * what Reno would achieve. Windows are in segments.
+ */
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
 
-	socket->state   = LISTEN;
+struct cubic
+{
+	uint64_t epoch_us;  // start of the current congestion avoidance epoch, 0 if none
+	double w_max;       // cwnd right before the last reduction
+	double origin;      // the plateau of the cubic function of the epoch
+	double k;           // seconds from the start of the epoch to the plateau
+	double w_est;       // the window Reno would have in the epoch
+};
+
+static void _cubic_on_ack(microtcp_sock_t * sock, uint32_t acked, uint32_t rtt)
+{
+	struct cubic * ca = CC_PRIV(sock, struct cubic);
+	double target;
+	double alpha;
+	double cwnd;
+	double t;
+	uint64_t now;
 
-	check( recvfrom(socket->sd, &tcph, sizeof(tcph), 0, address, &address_len) );
-	check( connect(socket->sd, address, address_len) );
 
-	#ifdef ENABLE_DEBUG_MSG
-	seqbase = ntohl(tcph.seq_number);  // necessary for print_tcp_header()
-	print_tcp_header(socket, &tcph);
-	#endif
+	(void)(rtt);
 
-	if ( ntohs(tcph.control) != CTRL_SYN ) {
+	if ( !_cc_cwnd_limited(sock, acked) )
+		return;
 
-		socket->state = INVALID;
-		errno = ECONNABORTED;
+	if ( (sock->cc_state == SLOW_START) && !(acked = _cc_slow_start(sock, acked)) )
+		return;
 
-		return -(EXIT_FAILURE);
-	}
+	now  = _now_us();
+	cwnd = (double)(sock->cwnd) / MICROTCP_MSS;
 
-	socket->sendbuflen = ntohs(tcph.window);
-	socket->ack_number = ntohl(tcph.seq_number) + 1U;
+	if ( !ca->epoch_us ) {
 
-	++socket->packets_received;
-	++socket->bytes_received;
+		ca->epoch_us = now;
+		ca->w_est    = cwnd;
 
-	tcph.seq_number = htonl(socket->seq_number);
-	tcph.ack_number = htonl(socket->ack_number);
-	tcph.control    = htons(CTRL_ACK | CTRL_SYN);
-	tcph.window     = htons(MICROTCP_RECVBUF_LEN);
+		if ( cwnd < ca->w_max ) {
 
-	check(send(socket->sd, &tcph, sizeof(tcph), 0));
-	check(recv(socket->sd, &tcph, sizeof(tcph), 0));
+			ca->k      = cbrt((ca->w_max - cwnd) / CUBIC_C);
+			ca->origin = ca->w_max;
+		}
+		else {
 
-	print_tcp_header(socket, &tcph);
+			ca->k      = 0.0;
+			ca->origin = cwnd;
+		}
+	}
 
-	if ( ( ntohs(tcph.control) ) != CTRL_ACK ) {
+	/* where the window should be one RTT from now, at most 1.5 times the current one */
+	t      = (double)(now - ca->epoch_us + sock->srtt) / 1e6;
+	target = ca->origin + CUBIC_C * (t - ca->k) * (t - ca->k) * (t - ca->k);
+	target = MIN2(MAX2(target, cwnd), 1.5 * cwnd);
 
-		socket->state = INVALID;
-		errno = ECONNABORTED;
+	/* the Reno-friendly region, where the cubic function grows slower than Reno would
+	 * (at the rate of Reno once the estimate is past W_max) */
+	alpha      = ( ca->w_est < ca->w_max ) ? 3.0 * (1.0 - CUBIC_BETA) / (1.0 + CUBIC_BETA) : 1.0;
+	ca->w_est += alpha * ((double)(acked) / MICROTCP_MSS) / cwnd;
+	target     = MAX2(target, ca->w_est);
 
-		return -(EXIT_FAILURE);
-	}
+	/* (target - cwnd) / cwnd segments per acknowledged segment */
+	sock->cwnd += (size_t)((target - cwnd) / cwnd * acked) + 1UL;
+}
 
-	++socket->seq_number;         // ghost-byte
-	socket->state = ESTABLISHED;
+/**
+ * @brief Remembers the window of the loss (lower with fast convergence, when the
+ * losses come before the window gets back to the previous W_max) and shrinks ssthresh.
+ */
+static void _cubic_reduce(microtcp_sock_t * sock)
+{
+	struct cubic * ca = CC_PRIV(sock, struct cubic);
+	double cwnd = (double)(sock->cwnd) / MICROTCP_MSS;
 
-	// _sock_enable_async(socket);
 
+	ca->w_max    = ( cwnd < ca->w_max ) ? cwnd * (1.0 + CUBIC_BETA) / 2.0 : cwnd;
+	ca->epoch_us = 0ULL;
 
-	return EXIT_SUCCESS;
+	sock->ssthresh = MAX2((size_t)(sock->cwnd * CUBIC_BETA), 2UL * MICROTCP_MSS);
 }
 
-int microtcp_shutdown(microtcp_sock_t * socket, int how)
+static void _cubic_on_loss(microtcp_sock_t * sock)
 {
-	// LOG_DEBUG("Start of SD");
-	// LOG_DEBUG("how=%d",how);
-	microtcp_header_t fin_ack, ack;
-
-	if(how==SHUTDOWN_CLIENT){//sender is shutting down the connection
-
-		fin_ack.seq_number = htonl(socket->seq_number);
-		fin_ack.ack_number = htonl(socket->ack_number);
-		fin_ack.control    = htons(CTRL_FIN | CTRL_ACK);
+	_cubic_reduce(sock);
+	sock->cwnd = sock->ssthresh + 3 * MICROTCP_MSS;
+}
 
-		/* Send FIN/ACK */
-		check(send(socket->sd, (void*)&fin_ack, sizeof(fin_ack), 0));
-		/* Receive ACK for previous FINACK */
-		check(recv(socket->sd, (void*)&ack, sizeof(ack), 0));
+static void _cubic_on_timeout(microtcp_sock_t * sock)
+{
+	_cubic_reduce(sock);
+	sock->cwnd     = MICROTCP_MSS;
+	sock->cc_state = SLOW_START;
+}
 
-		uint16_t recieved_ack = ntohs(ack.control);
+/*
+ * BBR: a model of the path, the bottleneck bandwidth (the max of the delivery rate
+ * samples over the last BBR_BW_ROUNDS round trips) and the round-trip propagation
+ * delay (the min RTT over BBR_MIN_RTT_US), sets the pacing rate and cwnd. Random
+ * losses barely move either, unlike a window that halves on every loss. The state
+ * machine is that of BBR v1: STARTUP doubles the rate every round until the bandwidth
+ * stops growing, DRAIN empties the queue that it built, PROBE_BW cycles the pacing
+ * gain to probe for more bandwidth and PROBE_RTT shrinks the window now and then to
+ * measure the min RTT again. Gains are in units of BBR_UNIT.
+ */
+#define BBR_UNIT 256U
+#define BBR_HIGH_GAIN ( BBR_UNIT * 2885U / 1000U + 1U )  // 2/ln(2), the smallest that doubles the rate every round
+#define BBR_DRAIN_GAIN ( BBR_UNIT * 1000U / 2885U )
+#define BBR_CWND_GAIN ( BBR_UNIT * 2U )
+#define BBR_CYCLE_LEN 8U
+#define BBR_BW_ROUNDS 10U
+#define BBR_FULL_BW_ROUNDS 3U                  // rounds without 25% more bandwidth that fill the pipe
+#define BBR_MIN_RTT_US 10000000ULL
+#define BBR_PROBE_RTT_US 200000ULL
+#define BBR_MIN_CWND ( 4UL * MICROTCP_MSS )
+
+enum { BBR_STARTUP, BBR_DRAIN, BBR_PROBE_BW, BBR_PROBE_RTT };
+
+static const uint32_t _bbr_pacing_gain[BBR_CYCLE_LEN] = {
+	BBR_UNIT * 5U / 4U, BBR_UNIT * 3U / 4U, BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT
+};
+
+struct bbr
+{
+	uint64_t bw[BBR_BW_ROUNDS];     // best delivery rate (bytes/s) of each of the last rounds
+	uint64_t max_bw;                // the best of 'bw', the bottleneck bandwidth
+	uint64_t bw_round;              // round of the last sample in 'bw'
+	uint64_t round_count;           // round trips so far
+	uint64_t next_round_delivered;  // 'delivered' that ends the current round
+	uint64_t full_bw;               // bandwidth that STARTUP last grew to by 25%
+	uint64_t min_rtt_us;            // time of the 'min_rtt' sample
+	uint64_t cycle_us;              // start of the current phase of the PROBE_BW gain cycle
+	uint64_t probe_rtt_done_us;     // end of PROBE_RTT, 0 until the window is down to BBR_MIN_CWND
+	size_t prior_cwnd;              // cwnd before PROBE_RTT or a timeout, restored afterwards
+	uint32_t min_rtt;               // min RTT in us, UINT32_MAX until the first sample
+	uint32_t pacing_gain;
+	uint32_t cwnd_gain;
+	uint8_t mode;
+	uint8_t cycle_idx;
+	uint8_t filled_pipe;            // STARTUP found the bottleneck bandwidth
+	uint8_t full_bw_cnt;
+	uint8_t round_start;            // the current ACK starts a new round
+	uint8_t probe_rtt_round_done;
+	uint8_t restore_cwnd;           // 'prior_cwnd' is restored by the next ACK (after a timeout)
+};
+
+static uint64_t _bbr_flight(const microtcp_sock_t * sock)
+{
+	return sock->seq_number - sock->snd_una;
+}
 
-		/* Check if the received package is an ACK (and the correct ACK)*/
-		if(!(recieved_ack & CTRL_ACK)){
-			return -(EXIT_FAILURE);
-		}
+/**
+ * @return the bandwidth-delay product scaled by 'gain', plus room for ACKs that come
+ * in bursts (the initial cwnd while the model is still empty)
+ */
+static uint64_t _bbr_inflight(const microtcp_sock_t * sock, uint32_t gain)
+{
+	const struct bbr * bbr = CC_PRIV(sock, const struct bbr);
 
-		socket->state = CLOSING_BY_HOST;
 
-		/* Wait for FIN ACK from the server*/
-		check(recv(socket->sd, (void*)&fin_ack, sizeof(ack), 0))
+	if ( (bbr->min_rtt == UINT32_MAX) || !bbr->max_bw )
+		return MICROTCP_INIT_CWND;
 
-		uint16_t recieved_finack = ntohs(fin_ack.control);
+	return bbr->max_bw * bbr->min_rtt / 1000000ULL * gain / BBR_UNIT + 3ULL * MICROTCP_MSS;
+}
 
-		if(!(recieved_finack & (CTRL_FIN | CTRL_ACK))){
-			return -(EXIT_FAILURE);
-		}
+static void _bbr_enter_probe_bw(microtcp_sock_t * sock, uint64_t now)
+{
+	struct bbr * bbr = CC_PRIV(sock, struct bbr);
 
-		/* Prepare and send back the ACK header*/
-		ack.control    = htons(CTRL_ACK);
-		ack.ack_number = htonl(socket->ack_number);
-		ack.seq_number = htonl(socket->seq_number);
-
-		check(send(socket->sd, (void*)&ack, sizeof(ack), 0));
-		
-		/** TODO: Timed wait for server FIN ACK retransmition */
-		socket->state = CLOSED;
-		return EXIT_SUCCESS;
-
-	}else if(how==SHUTDOWN_SERVER){//reciever recieved a FIN packet
-
-		socket->state=CLOSING_BY_PEER;
-		// LOG_DEBUG("SD: state:cbp");
-		ack.control    = htons(CTRL_ACK);
-		ack.ack_number = htonl(socket->ack_number);
-		check(send(socket->sd, (void*)&ack, sizeof(ack), 0));
-		
-		// LOG_DEBUG("SD: sent ACK\n");
-		fin_ack.seq_number = htonl(socket->seq_number);
-		fin_ack.ack_number = htonl(socket->ack_number);
-		fin_ack.control    = htons(CTRL_FIN | CTRL_ACK);
-		
-		/* Send FIN/ACK */
-		check(send(socket->sd, (void*)&fin_ack, sizeof(fin_ack), 0));
-		// LOG_DEBUG("SD: Sent FINACK\n");
-		// LOG_DEBUG("SD: Waiting for ACK\n");
-		/* Receive ACK for previous FINACK */
-		check(recv(socket->sd, (void*)&ack, sizeof(ack), 0));
-
-		uint16_t recieved_ack = ntohs(ack.control);
-
-		/* Check if the received package is an ACK */
-		if((recieved_ack & CTRL_ACK)) {
-			return -(EXIT_FAILURE);
-		}
-		// LOG_DEBUG("SD: recieved ACK");
 
-		/* Terminate the connection */
-		socket->state = CLOSED;
-		// LOG_DEBUG("SD: state:closed");
-		return EXIT_SUCCESS;
+	bbr->mode      = BBR_PROBE_BW;
+	bbr->cwnd_gain = BBR_CWND_GAIN;
 
-	}else{
-		errno = EINVAL;
-		return -(EXIT_FAILURE);
-	}
+	/* a random phase other than the drain one, flows that share the bottleneck probe at different times */
+	bbr->cycle_idx   = BBR_CYCLE_LEN - 1U - (uint8_t)(rand() % (BBR_CYCLE_LEN - 1U));
+	bbr->pacing_gain = _bbr_pacing_gain[bbr->cycle_idx];
+	bbr->cycle_us    = now;
+	sock->cc_state   = CONG_AVOID;
 }
 
-ssize_t microtcp_send(microtcp_sock_t * __restrict__ socket, const void * __restrict__ buffer, size_t length,
-               int flags)
+static void _bbr_init(microtcp_sock_t * sock)
 {
-	/** TODO: Congestion control --> update() ssthresh after each send() */
+	struct bbr * bbr = CC_PRIV(sock, struct bbr);
 
-	uint8_t tbuff[MICROTCP_HEADER_SIZE + MICROTCP_MSS];  // c99 and onwards --- problem for larger MSS
-	microtcp_header_t tcph;
-	int64_t ret;
 
-	int sockfd;
-	int fflag;  // fragments flag
-	size_t lengthcpy = length;
+	bbr->mode        = BBR_STARTUP;
+	bbr->pacing_gain = BBR_HIGH_GAIN;
+	bbr->cwnd_gain   = BBR_HIGH_GAIN;
+	bbr->min_rtt     = ( sock->srtt ) ? sock->srtt : UINT32_MAX;
+	bbr->min_rtt_us  = _now_us();
+	bbr->next_round_delivered = sock->delivered;
+	sock->cc_state   = SLOW_START;
+}
 
-	uint64_t bytes_to_send;
-	uint64_t chunks;
-	uint64_t index;
-	uint64_t dacks;
-	uint64_t tmp;
+/**
+ * @brief Rounds, the bandwidth filter (the best sample of each of the last BBR_BW_ROUNDS
+ * rounds, in a ring indexed by the round), and the exit from STARTUP once the bandwidth did
+ * not grow by 25% for BBR_FULL_BW_ROUNDS rounds.
+ */
+static void _bbr_update_bw(microtcp_sock_t * sock)
+{
+	struct bbr * bbr = CC_PRIV(sock, struct bbr);
+	const microtcp_rate_sample_t * rs = &sock->rs;
+	uint64_t bw, * slot;
+	size_t i;
 
 
-	if ( !socket ) {
+	bbr->round_start = 0;
 
-		errno = EINVAL;
-		return -(EXIT_FAILURE);
-	}
+	if ( !rs->delivered )
+		return;
 
-	if ( (socket->state == INVALID) || (socket->state >= CLOSING_BY_PEER) ) {
+	if ( rs->prior_delivered >= bbr->next_round_delivered ) {
 
-		errno = EINVAL;
-		return -(EXIT_FAILURE);
+		bbr->next_round_delivered = sock->delivered;
+		++bbr->round_count;
+		bbr->round_start = 1;
 	}
 
-	sockfd = socket->sd;
-	fflag  = 0;
+	/* shorter than the min RTT, the interval cannot hold a round of data (ACK compression) */
+	if ( !rs->interval_us || (rs->interval_us < bbr->min_rtt) )
+		return;
 
-sflag0:
-	if ( length > MIN2(MICROTCP_MSS, MIN2(socket->cwnd, socket->sendbuflen)) )
-		fflag = 0;
-	else
-		fflag = 1;
+	/* an application limited sample only counts if it shows more bandwidth anyway */
+	bw = rs->delivered * 1000000ULL / rs->interval_us;
 
-	_timeout(sockfd, TIOUT_ENABLE);
+	if ( !rs->app_limited || (bw >= bbr->max_bw) ) {
 
-	while ( length ) {
-send1:
-		tmp = MIN2(socket->cwnd, socket->sendbuflen);
-		bytes_to_send = MIN2(length, tmp);
-		chunks = bytes_to_send / MICROTCP_MSS;  // avoid IP-Fragmentation (break into fragments)
+		/* the rounds since the last sample leave the window, the max only expires by newer samples */
+		if ( bbr->round_count - bbr->bw_round > BBR_BW_ROUNDS )
+			bzero(bbr->bw, sizeof(bbr->bw));
+		else {
 
-		LOG_DEBUG("\n\e[1mlength = %lu\e[0m\n"
-					" > chunks = %lu\n"
-					" > bytes_to_send = %lu\n", length, chunks, bytes_to_send);
+			while ( bbr->bw_round < bbr->round_count )
+				bbr->bw[++bbr->bw_round % BBR_BW_ROUNDS] = 0ULL;
+		}
 
-		for ( index = 0UL; index < chunks; ++index ) {
+		bbr->bw_round = bbr->round_count;
+		slot  = &bbr->bw[bbr->round_count % BBR_BW_ROUNDS];
+		*slot = MAX2(*slot, bw);
 
-			tmp = (uint64_t)(buffer) + (index * MICROTCP_MSS);  // pointer arithmetic - c99 and onwards
+		for ( bbr->max_bw = 0ULL, i = 0; i < BBR_BW_ROUNDS; ++i )
+			bbr->max_bw = MAX2(bbr->max_bw, bbr->bw[i]);
+	}
 
-			_preapre_send_tcph(socket, &tcph, ( !fflag ) ? (fflag = FRAGMENT) : CTRL_XXX, (void *)(tmp), MICROTCP_MSS);
-			memcpy(tbuff, &tcph, MICROTCP_HEADER_SIZE);
-			memcpy(tbuff + MICROTCP_HEADER_SIZE, (void *)(tmp), MICROTCP_MSS);
+	if ( bbr->filled_pipe || !bbr->round_start || rs->app_limited )
+		return;
 
-			check( send(sockfd, tbuff, MICROTCP_MSS + MICROTCP_HEADER_SIZE, 0) );
-		}
+	if ( bbr->max_bw >= bbr->full_bw + bbr->full_bw / 4U ) {
 
-		length -= bytes_to_send;
-		bytes_to_send -= index * MICROTCP_MSS;
+		bbr->full_bw     = bbr->max_bw;
+		bbr->full_bw_cnt = 0;
+	}
+	else if ( ++bbr->full_bw_cnt >= BBR_FULL_BW_ROUNDS )
+		bbr->filled_pipe = 1;
+}
 
-		// semi-filled chunk
-		if ( bytes_to_send ) {
+/**
+ * @brief STARTUP -> DRAIN -> PROBE_BW, and the gain cycle of PROBE_BW: a phase lasts a
+ * min RTT, the probing one (5/4) until the extra data is in flight, the draining one
+ * (3/4) until the queue is gone.
+ */
+static void _bbr_update_mode(microtcp_sock_t * sock, uint32_t acked, uint64_t now)
+{
+	struct bbr * bbr = CC_PRIV(sock, struct bbr);
+	uint64_t flight = _bbr_flight(sock);
+	int next;
 
-			tmp = (uint64_t)(buffer) + (index * MICROTCP_MSS);  // pointer arithmetic
 
-			_preapre_send_tcph(socket, &tcph, ( !length && chunks) ? FRAGMENT : CTRL_XXX, (void *)(tmp), bytes_to_send);
-			memcpy(tbuff, &tcph, MICROTCP_HEADER_SIZE);
-			memcpy(tbuff + MICROTCP_HEADER_SIZE, (void *)(tmp), bytes_to_send);
-			++chunks;
+	/* the queue also drains through cwnd, it does not depend on the pacing of the sender */
+	if ( (bbr->mode == BBR_STARTUP) && bbr->filled_pipe ) {
 
-			check( send(sockfd, tbuff, bytes_to_send + MICROTCP_HEADER_SIZE, 0) );
-		}
+		bbr->mode        = BBR_DRAIN;
+		bbr->pacing_gain = BBR_DRAIN_GAIN;
+		bbr->cwnd_gain   = BBR_UNIT;
+		sock->cc_state   = CONG_AVOID;
+	}
 
-		for ( dacks = 0UL, index = 0UL; index < chunks; ++index ) {	
+	if ( (bbr->mode == BBR_DRAIN) && (flight <= _bbr_inflight(sock, BBR_UNIT)) )
+		_bbr_enter_probe_bw(sock, now);
 
-sflag1:
-			ret = recv(sockfd, &tcph, MICROTCP_HEADER_SIZE, 0);
+	if ( bbr->mode != BBR_PROBE_BW )
+		return;
 
-			LOG_DEBUG("s.state: %d, s.cwnd: %ld, s.ssthres: %ld\n",socket->state,socket->cwnd,socket->ssthresh);
+	next = ( now - bbr->cycle_us > bbr->min_rtt );
 
-			if ( ret < 0 ) {
+	if ( bbr->pacing_gain > BBR_UNIT )
+		next = next && (flight + acked >= _bbr_inflight(sock, bbr->pacing_gain));
+	else if ( bbr->pacing_gain < BBR_UNIT )
+		next = next || (flight <= _bbr_inflight(sock, BBR_UNIT));
 
-				if ( errno == EAGAIN ) {
+	if ( next ) {
 
-					socket->ssthresh  = socket->cwnd / 2; 
-					socket->cwnd      = MICROTCP_MSS;
-					socket->state     = SLOW_START;
+		bbr->cycle_idx   = (bbr->cycle_idx + 1U) % BBR_CYCLE_LEN;
+		bbr->pacing_gain = _bbr_pacing_gain[bbr->cycle_idx];
+		bbr->cycle_us    = now;
+	}
+}
 
-					LOG_DEBUG("timeout-occured, retransmiting packet\n");
+/**
+ * @brief The min RTT filter, and PROBE_RTT when it expires: at most BBR_MIN_CWND in flight
+ * for BBR_PROBE_RTT_US and a round, so that the queue drains and the RTT shows the path.
+ */
+static void _bbr_update_min_rtt(microtcp_sock_t * sock, uint64_t now)
+{
+	struct bbr * bbr = CC_PRIV(sock, struct bbr);
+	int expired = ( now - bbr->min_rtt_us > BBR_MIN_RTT_US );
 
-					length = lengthcpy;
-					goto send1;
-				}
-				else
-					check( ret );
-			}
-			else {
 
-				print_tcp_header(socket, &tcph);
-				_ntoh_recvd_tcph(tcph);
+	if ( sock->rs.rtt && ((sock->rs.rtt <= bbr->min_rtt) || expired) ) {
 
-				if ( tcph.ack_number < socket->seq_number ) {  // retransmit
+		bbr->min_rtt    = sock->rs.rtt;
+		bbr->min_rtt_us = now;
+	}
 
-					LOG_DEBUG("!ack < seq!");
-					
-					/** TODO: Fast Retransmit */
+	if ( expired && (bbr->mode != BBR_PROBE_RTT) ) {
 
-					if ( ++dacks == 3UL ) {
+		bbr->mode        = BBR_PROBE_RTT;
+		bbr->pacing_gain = bbr->cwnd_gain = BBR_UNIT;
+		bbr->prior_cwnd  = MAX2(bbr->prior_cwnd, sock->cwnd);
+		bbr->probe_rtt_done_us = 0ULL;
+	}
 
-						socket->ssthresh   = socket->cwnd / 2;
-						socket->cwnd       = socket->ssthresh + 3 * MICROTCP_MSS;
-						socket->seq_number = tcph.ack_number;
+	if ( bbr->mode != BBR_PROBE_RTT )
+		return;
 
-						// tmp = (index != chunks - 1UL) ? MICROTCP_MSS : bytes_to_send;
-						// buffer += (index - 1UL) * tmp;
-						length = lengthcpy;
-					}
-					else if ( dacks > 3UL )
-						socket->cwnd = socket->cwnd + MICROTCP_MSS;
+	sock->app_limited = MAX2(sock->delivered + _bbr_flight(sock), 1ULL);  // the samples of the probe understate the path
 
-					goto send1;
-				}
-				else {  // everything is normal
+	if ( !bbr->probe_rtt_done_us && (_bbr_flight(sock) <= BBR_MIN_CWND) ) {
 
-					socket->seq_number += (index != chunks - 1UL) ? MICROTCP_MSS : bytes_to_send;
-					dacks = 0UL;
+		bbr->probe_rtt_done_us    = now + BBR_PROBE_RTT_US;
+		bbr->probe_rtt_round_done = 0;
+		bbr->next_round_delivered = sock->delivered;
+	}
+	else if ( bbr->probe_rtt_done_us ) {
 
-					if ( socket->state == SLOW_START ) {
+		if ( bbr->round_start )
+			bbr->probe_rtt_round_done = 1;
 
-						socket->cwnd = socket->cwnd * 2;  // in SLOW_START increment cwnd exponentially
+		if ( bbr->probe_rtt_round_done && (now > bbr->probe_rtt_done_us) ) {
 
-						if ( socket->cwnd >= socket->ssthresh )  // if SLOW_START & cwnd>=ssthresh -> CONG_AVOID
-							socket->state = CONG_AVOID;
-					}
-					else
-						socket->cwnd += MICROTCP_MSS;  // in CONG_AVOID increment cwnd additively
+			bbr->min_rtt_us = now;
+			sock->cwnd      = MAX2(sock->cwnd, bbr->prior_cwnd);
+			bbr->prior_cwnd = 0UL;
+
+			if ( bbr->filled_pipe )
+				_bbr_enter_probe_bw(sock, now);
+			else {
+
+				bbr->mode        = BBR_STARTUP;
+				bbr->pacing_gain = bbr->cwnd_gain = BBR_HIGH_GAIN;
+			}
+		}
+	}
+}
+
+static void _bbr_on_ack(microtcp_sock_t * sock, uint32_t acked, uint32_t rtt)
+{
+	struct bbr * bbr = CC_PRIV(sock, struct bbr);
+	uint64_t now = _now_us();
+	size_t target;
+
+
+	(void)(rtt);
+
+	_bbr_update_bw(sock);
+	_bbr_update_mode(sock, acked, now);
+	_bbr_update_min_rtt(sock, now);
+
+	/* cwnd heads for the BDP scaled by the cwnd gain */
+	target = (size_t)(_bbr_inflight(sock, bbr->cwnd_gain));
+
+	if ( bbr->restore_cwnd ) {
+
+		sock->cwnd        = MAX2(sock->cwnd, bbr->prior_cwnd);
+		bbr->prior_cwnd   = 0UL;
+		bbr->restore_cwnd = 0;
+	}
+
+	if ( bbr->filled_pipe )
+		sock->cwnd = MIN2(sock->cwnd + acked, target);
+	else if ( (sock->cwnd < target) || (sock->delivered < MICROTCP_INIT_CWND) )
+		sock->cwnd += acked;
+
+	sock->cwnd = MAX2(sock->cwnd, BBR_MIN_CWND);
+
+	if ( bbr->mode == BBR_PROBE_RTT )
+		sock->cwnd = MIN2(sock->cwnd, BBR_MIN_CWND);
+}
+
+/**
+ * @brief A loss is no sign of congestion for the model, cwnd is kept (the recovery
+ * deflates the window back to ssthresh).
+ */
+static void _bbr_on_loss(microtcp_sock_t * sock)
+{
+	sock->ssthresh = sock->cwnd;
+	sock->cwnd     = sock->ssthresh + 3 * MICROTCP_MSS;
+}
+
+/**
+ * @brief Everything in flight is presumed lost, the retransmission starts with a single
+ * segment and the next ACK brings the window back.
+ */
+static void _bbr_on_timeout(microtcp_sock_t * sock)
+{
+	struct bbr * bbr = CC_PRIV(sock, struct bbr);
+
+
+	bbr->prior_cwnd   = MAX2(bbr->prior_cwnd, sock->cwnd);
+	bbr->restore_cwnd = 1;
+	sock->ssthresh    = sock->cwnd;
+	sock->cwnd        = MICROTCP_MSS;
+}
+
+/**
+ * @return the bottleneck bandwidth scaled by the pacing gain, while there is no
+ * sample the initial window over the RTT
+ */
+static uint64_t _bbr_pacing_rate(const microtcp_sock_t * sock)
+{
+	const struct bbr * bbr = CC_PRIV(sock, const struct bbr);
+
+
+	if ( !bbr->max_bw )
+		return ( sock->srtt ) ? (uint64_t)(MICROTCP_INIT_CWND) * 1000000ULL / sock->srtt * bbr->pacing_gain / BBR_UNIT : 0ULL;
+
+	return bbr->max_bw * bbr->pacing_gain / BBR_UNIT;
+}
+
+/* indexed by MICROTCP_CC_* */
+static const struct microtcp_cc _cc_algs[] = {
+	[MICROTCP_CC_RENO]  = { "reno", NULL, _reno_on_ack, _reno_on_loss, _reno_on_timeout, _cc_cwnd_rate },
+	[MICROTCP_CC_CUBIC] = { "cubic", NULL, _cubic_on_ack, _cubic_on_loss, _cubic_on_timeout, _cc_cwnd_rate },
+	[MICROTCP_CC_BBR]   = { "bbr", _bbr_init, _bbr_on_ack, _bbr_on_loss, _bbr_on_timeout, _bbr_pacing_rate },
+};
+
+_Static_assert(sizeof(struct cubic) <= sizeof(((microtcp_sock_t *)(0))->cc_priv), "cc_priv is too small for CUBIC");
+_Static_assert(sizeof(struct bbr) <= sizeof(((microtcp_sock_t *)(0))->cc_priv), "cc_priv is too small for BBR");
+
+/**
+ * @brief Switches the socket to the congestion control algorithm 'alg' (MICROTCP_CC_*),
+ * which takes over the current cwnd and ssthresh.
+ */
+static void _cc_select(microtcp_sock_t * sock, uint32_t alg)
+{
+	sock->cc = &_cc_algs[alg];
+	bzero(sock->cc_priv, sizeof(sock->cc_priv));
+
+	if ( sock->cc->init )
+		sock->cc->init(sock);
+}
+
+/**
+ * @brief Arms (or re-arms) a timer of the socket's wheel to expire 'us' from now.
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param timer the timer
+ * @param us relative deadline in us
+ */
+static void _timer_arm(microtcp_sock_t * __restrict__ sock, tw_timer_t * __restrict__ timer, uint64_t us)
+{
+	uint64_t now = _now_us();
+
+
+	if ( !sock->wheel->count )  // idle wheel, catch up with the clock
+		tw_advance(sock->wheel, US_TO_TICKS(now));
+
+	timer->arg = sock;
+	tw_add(sock->wheel, timer, US_TO_TICKS(now + us));
+}
+
+/* The segment slots of the batches of every socket and listener. A thread takes
+ * them from its own cache, only refills and overflows go through the lock */
+static slab_t _seg_pool = SLAB_INITIALIZER(SLOT_LEN, MICROTCP_POOL_CHUNK);
+static __thread slab_cache_t _seg_tcache;
+static __thread uint8_t _seg_tcache_reg;
+static pthread_key_t _seg_key;
+static pthread_once_t _seg_once = PTHREAD_ONCE_INIT;
+
+static void _seg_cache_exit(void * cache)
+{
+	slab_cache_drain(&_seg_pool, (slab_cache_t *)(cache));
+}
+
+static void _seg_key_init(void)
+{
+	(void)(pthread_key_create(&_seg_key, _seg_cache_exit));
+}
+
+/**
+ * @return the cache of segment slots of the calling thread, handed back to the pool
+ * when the thread exits
+ */
+static slab_cache_t * _seg_cache(void)
+{
+	if ( !_seg_tcache_reg ) {
+
+		pthread_once(&_seg_once, _seg_key_init);
+		(void)(pthread_setspecific(_seg_key, &_seg_tcache));
+		_seg_tcache_reg = 1;
+	}
+
+	return &_seg_tcache;
+}
+
+/**
+ * @brief Allocates a batch of MICROTCP_BATCH_LEN slots of the segment pool.
+ * 
+ * @param tx non-zero for a batch of sendmmsg(), zero for one of recvmmsg()
+ * @return the batch, or NULL if no memory is left
+ */
+static struct microtcp_batch * _batch_new(int tx)
+{
+	struct microtcp_batch * b;
+	unsigned int i;
+
+
+	if ( !(b = (struct microtcp_batch *) malloc(sizeof(*b))) )
+		return NULL;
+
+	if ( slab_alloc_bulk(&_seg_pool, _seg_cache(), (void **)(b->slot), MICROTCP_BATCH_LEN) ) {
+
+		free(b);
+		return NULL;
+	}
+
+	bzero(b->msgs, sizeof(b->msgs));
+
+	for ( i = 0U; i < MICROTCP_BATCH_LEN; ++i ) {
+
+		b->iov[2 * i].iov_base     = b->slot[i];
+		b->iov[2 * i].iov_len      = ( tx ) ? MICROTCP_HEADER_SIZE : SLOT_LEN;
+		b->iov[2 * i + 1].iov_base = NULL;
+		b->iov[2 * i + 1].iov_len  = 0UL;
+		b->msgs[i].msg_hdr.msg_iov    = &b->iov[2 * i];
+		b->msgs[i].msg_hdr.msg_iovlen = ( tx ) ? 2 : 1;
+		b->seg[i] = UINT32_MAX;  // rx: whole datagrams unless GRO coalesces them
+	}
+
+	b->cnt  = b->pos = b->off = 0U;
+	b->head = b->tail = b->held = 0U;
+
+	return b;
+}
+
+/**
+ * @brief Releases a batch of _batch_new(), its slots go back to the pool (NULL is ignored).
+ */
+static void _batch_free(struct microtcp_batch * b)
+{
+	if ( !b )
+		return;
+
+	slab_free_bulk(&_seg_pool, _seg_cache(), (void * const *)(b->slot), MICROTCP_BATCH_LEN);
+	free(b);
+}
+
+#ifdef URING_AVAILABLE
+
+#define URING_BUF_LEN ( (sizeof(struct io_uring_recvmsg_out) + MICROTCP_HEADER_SIZE + MICROTCP_MSS + 63UL) & ~63UL )
+
+/**
+ * @brief Posts the multishot recvmsg() (submitted by the next io_uring_enter()), unless
+ * it is posted or the kernel has no buffer to receive into.
+ */
+static void _uring_arm(microtcp_sock_t * sock)
+{
+	struct microtcp_uring * u = sock->uring;
+	struct io_uring_sqe * sqe;
+
+
+	if ( u->armed || ((u->rx_head - u->rx_tail) + u->held >= MICROTCP_URING_BUFS) )
+		return;
+
+	if ( !(sqe = uring_get_sqe(&u->ring)) )
+		return;
+
+	uring_prep_recvmsg_multishot(sqe, sock->sd, &u->rx_msg, u->bufs.bgid, URING_RX);
+	u->armed = 1;
+}
+
+/**
+ * @brief Takes the completions out of the ring, without a syscall: the sent datagrams
+ * release their slots and the received ones are queued in 'rx'.
+ */
+static void _uring_reap(microtcp_sock_t * sock)
+{
+	struct microtcp_uring * u = sock->uring;
+	struct io_uring_cqe * cqe;
+	uint32_t n = 0U;
+	uint16_t bid;
+
+
+	while ( (cqe = uring_cqe_peek(&u->ring)) ) {
+
+		if ( cqe->user_data == URING_TX ) {
+
+			--u->tx_inflight;
+
+			if ( cqe->res < 0 )  // as if it got lost, it is retransmitted
+				LOG_DEBUG("io_uring sendmsg(): %s\n", strerror(-cqe->res));
+		}
+		else {
+
+			if ( cqe->flags & IORING_CQE_F_BUFFER ) {
+
+				bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+				if ( cqe->res >= 0 ) {
+
+					u->rx[u->rx_head++ % MICROTCP_URING_BUFS] = bid;
+					++n;
+				}
+				else {
+
+					uring_bufs_add(&u->bufs, bid);
+					uring_bufs_publish(&u->bufs);
 				}
 			}
+			else if ( (cqe->res < 0) && (cqe->res != -ENOBUFS) )  // out of buffers: posted again once some are released
+				u->error = -cqe->res;
+
+			if ( !(cqe->flags & IORING_CQE_F_MORE) )
+				u->armed = 0;
+		}
+
+		uring_cqe_seen(&u->ring);
+	}
+
+	if ( n ) {
+
+		++sock->rx_batches;
+		sock->rx_batched  += n;
+		sock->rx_batch_max = MAX2(sock->rx_batch_max, n);
+	}
+
+	_uring_arm(sock);
+}
+
+/**
+ * @brief Releases the buffer of the previous datagram and hands out the next one.
+ * 
+ * @return the size of the datagram, 0 if none is received or -1 on a receive error
+ */
+static ssize_t _uring_next(microtcp_sock_t * __restrict__ sock, const uint8_t ** __restrict__ dgram)
+{
+	struct microtcp_uring * u = sock->uring;
+	struct io_uring_recvmsg_out * out;
+
+
+	if ( u->held ) {  // the previous datagram is consumed
+
+		uring_bufs_add(&u->bufs, u->held_bid);
+		uring_bufs_publish(&u->bufs);
+		u->held = 0;
+	}
+
+	for ( ;; ) {
+
+		if ( u->rx_tail == u->rx_head ) {
+
+			_uring_reap(sock);
+
+			if ( u->error ) {
+
+				errno    = u->error;
+				u->error = 0;
+				return -1L;
+			}
+
+			if ( u->rx_tail == u->rx_head )
+				return 0L;
+		}
+
+		u->held_bid = u->rx[u->rx_tail++ % MICROTCP_URING_BUFS];
+		u->held     = 1;
+
+		out = (struct io_uring_recvmsg_out *) uring_bufs_at(&u->bufs, u->held_bid);
+
+		if ( out->payloadlen ) {
+
+			*dgram = (const uint8_t *)(out + 1);  // no address nor control data in front of the payload
+			return MIN2(out->payloadlen, URING_BUF_LEN - sizeof(*out));
+		}
+
+		uring_bufs_add(&u->bufs, u->held_bid);  // empty datagram, not a segment
+		uring_bufs_publish(&u->bufs);
+		u->held = 0;
+	}
+}
+
+/**
+ * @brief Sends the datagrams of 'txb' with a single io_uring_enter(), which reaps the
+ * received datagrams as well. UDP sends complete inline, the ones that cannot (full
+ * socket buffer) are waited for since their slots are reused by the next batch.
+ */
+static void _uring_tx(microtcp_sock_t * sock)
+{
+	struct microtcp_batch * txb = sock->txb;
+	struct microtcp_uring * u = sock->uring;
+	struct io_uring_sqe * sqe;
+	unsigned int i;
+
+
+	for ( i = 0U; i < txb->cnt; ++i ) {
+
+		while ( !(sqe = uring_get_sqe(&u->ring)) )
+			check( uring_enter(&u->ring, 0U, NULL) );
+
+		uring_prep_sendmsg(sqe, sock->sd, &txb->msgs[i].msg_hdr, 0U, URING_TX);
+		++u->tx_inflight;
+	}
+
+	check( uring_enter(&u->ring, 0U, NULL) );
+	_uring_reap(sock);
+
+	while ( u->tx_inflight ) {
+
+		check( uring_enter(&u->ring, 1U, NULL) );
+		_uring_reap(sock);
+	}
+
+	++sock->tx_batches;
+	sock->tx_batched  += txb->cnt;
+	sock->tx_batch_max = MAX2(sock->tx_batch_max, txb->cnt);
+}
+
+/**
+ * @brief Submits the pending requests and runs the completions of the kernel, then
+ * waits for a datagram up to 'ts' (forever if NULL) if 'block' is set.
+ * 
+ * @return 0 on success (or timeout) or -1 on failure
+ */
+static int _uring_wait(microtcp_sock_t * __restrict__ sock, int block, const struct timespec * __restrict__ ts)
+{
+	struct __kernel_timespec kts;
+
+
+	if ( ts ) {
+
+		kts.tv_sec  = ts->tv_sec;
+		kts.tv_nsec = ts->tv_nsec;
+	}
+
+	return ( uring_enter(&sock->uring->ring, ( block ) ? 1U : 0U, ( ts ) ? &kts : NULL) < 0 ) ? -1 : 0;
+}
+
+static int _uring_fd(const microtcp_sock_t * sock)
+{
+	return sock->uring->ring.fd;
+}
+
+static void _uring_free(microtcp_sock_t * sock)
+{
+	struct microtcp_uring * u = sock->uring;
+
+
+	if ( !u )
+		return;
+
+	uring_free(&u->ring);  // cancels the receive
+	uring_bufs_free(&u->ring, &u->bufs);
+	free(u);
+
+	sock->uring = NULL;
+}
+
+/**
+ * @brief Moves the datagram I/O of a socket to io_uring.
+ * 
+ * @return 0 on success or -1 if io_uring is not usable (errno is set), the socket
+ * keeps using sendmmsg()/recvmmsg() then
+ */
+static int _uring_new(microtcp_sock_t * sock)
+{
+	struct microtcp_uring * u;
+	struct io_uring_cqe * cqe;
+	int err;
+
+
+	if ( !(u = (struct microtcp_uring *) calloc(1UL, sizeof(*u))) ) {
+
+		errno = ENOMEM;
+		return -(EXIT_FAILURE);
+	}
+
+	/* a batch of sends along with the receive, a CQE for every buffer */
+	if ( uring_init(&u->ring, 2U * MICROTCP_BATCH_LEN, 2U * MICROTCP_URING_BUFS) < 0 ) {
+
+		free(u);
+		return -(EXIT_FAILURE);
+	}
+
+	sock->uring = u;
+
+	if ( uring_bufs_init(&u->ring, &u->bufs, 0U, MICROTCP_URING_BUFS, URING_BUF_LEN) < 0 )
+		goto fail;
+
+	_uring_arm(sock);
+
+	if ( uring_enter(&u->ring, 0U, NULL) < 0 )
+		goto fail;
+
+	/* kernels without multishot recvmsg() (before 6.0) reject it right away */
+	if ( (cqe = uring_cqe_peek(&u->ring)) && (cqe->res == -EINVAL) ) {
+
+		errno = EOPNOTSUPP;
+		goto fail;
+	}
+
+	return EXIT_SUCCESS;
+
+fail:
+	err = errno;
+	_uring_free(sock);
+	errno = err;
+
+	return -(EXIT_FAILURE);
+}
+
+#else  /* sockets only, 'uring' stays NULL */
+
+#define _uring_next(sock, dgram) ( 0L )
+#define _uring_tx(sock) do { } while ( 0 )
+#define _uring_wait(sock, block, ts) ( 0 )
+#define _uring_fd(sock) ( -1 )
+#define _uring_free(sock) do { } while ( 0 )
+#define _uring_new(sock) ( errno = ENOSYS, -(EXIT_FAILURE) )
+
+#endif /* URING_AVAILABLE */
+
+/**
+ * @brief Packs the queued datagrams in 'gso': a run of equally sized datagrams (the last
+ * one may be shorter) becomes a single super-datagram that the kernel splits at 'seg'
+ * bytes (UDP_SEGMENT). The iovecs of consecutive slots are adjacent, the super-datagram
+ * gathers them as they are, headers included.
+ * 
+ * @return the number of messages in 'gso'
+ */
+static unsigned int _gso_pack(struct microtcp_batch * txb)
+{
+	struct cmsghdr * cmsg;
+	struct msghdr * msg;
+	unsigned int n = 0U;
+	unsigned int i, j;
+	size_t total;
+	size_t len;
+
+
+	for ( i = 0U; i < txb->cnt; i = j, ++n ) {
+
+		len   = DGRAM_LEN(txb, i);
+		total = len;
+
+		for ( j = i + 1U; j < txb->cnt; ++j ) {
+
+			if ( (DGRAM_LEN(txb, j - 1U) != len) || (DGRAM_LEN(txb, j) > len) || (total + DGRAM_LEN(txb, j) > GSO_MAX_LEN) )
+				break;
+
+			total += DGRAM_LEN(txb, j);
+		}
+
+		msg  = &txb->gso[n].msg_hdr;
+		*msg = txb->msgs[i].msg_hdr;
+		msg->msg_iovlen = 2 * (j - i);
+		txb->seg[n]     = j - i;
+
+		if ( j - i > 1U ) {
+
+			msg->msg_control    = txb->ctl[n];
+			msg->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+			cmsg = CMSG_FIRSTHDR(msg);
+			cmsg->cmsg_level = SOL_UDP;
+			cmsg->cmsg_type  = UDP_SEGMENT;
+			cmsg->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+			*(uint16_t *) CMSG_DATA(cmsg) = (uint16_t)(len);
+		}
+	}
+
+	return n;
+}
+
+/**
+ * @brief Sends the queued datagrams packed by _gso_pack().
+ * 
+ * @return the number of queued datagrams sent, less than all if the route cannot
+ * segment (EIO), in which case MICROTCP_SO_GSO is turned off
+ */
+static unsigned int _gso_flush(microtcp_sock_t * sock)
+{
+	struct microtcp_batch * txb = sock->txb;
+	unsigned int sent = 0U;
+	unsigned int off;
+	unsigned int cnt;
+	unsigned int i;
+	int ret;
+
+
+	cnt = _gso_pack(txb);
+
+	for ( off = 0U; off < cnt; off += ret ) {
+
+		if ( (ret = sendmmsg(sock->sd, txb->gso + off, cnt - off, sock->tx_flags)) < 0 ) {
+
+			if ( errno != EIO )  // e.g. no checksum offload on the device
+				check( ret );
+
+			LOG_DEBUG("UDP_SEGMENT is not supported on the route, MICROTCP_SO_GSO turned off\n");
+			sock->gso = 0U;
+			break;
+		}
+
+		if ( sock->tx_flags & MSG_ZEROCOPY )
+			sock->zc_sent += ret;
+
+		for ( i = off; i < off + (unsigned int)(ret); ++i ) {
+
+			sent += txb->seg[i];
+			sock->gso_sent += ( txb->seg[i] > 1U ) ? 1U : 0U;
+		}
+
+		++sock->tx_batches;
+	}
+
+	sock->tx_batched  += sent;
+	sock->tx_batch_max = MAX2(sock->tx_batch_max, sent);
+
+	return sent;
+}
+
+/**
+ * @brief Puts every queued datagram on the wire with as few sendmmsg() calls as possible
+ * (a single io_uring_enter() with the io_uring backend), in super-datagrams with GSO.
+ * 
+ * @param sock a valid microTCP socket handle
+ */
+static void _tx_flush(microtcp_sock_t * sock)
+{
+	struct microtcp_batch * txb = sock->txb;
+	unsigned int off;
+	int ret;
+
+
+	if ( !txb->cnt )
+		return;
+
+	if ( sock->uring ) {
+
+		_uring_tx(sock);
+		txb->cnt = 0U;
+		return;
+	}
+
+	off = ( sock->gso ) ? _gso_flush(sock) : 0U;  // the rest one by one if GSO got turned off
+
+	for ( ; off < txb->cnt; off += ret ) {
+
+		check( ret = sendmmsg(sock->sd, txb->msgs + off, txb->cnt - off, sock->tx_flags) );
+
+		if ( sock->tx_flags & MSG_ZEROCOPY )
+			sock->zc_sent += ret;
+
+		++sock->tx_batches;
+		sock->tx_batched  += ret;
+		sock->tx_batch_max = MAX2(sock->tx_batch_max, (uint32_t)(ret));
+	}
+
+	txb->cnt = 0U;
+}
+
+/**
+ * @brief Queues a datagram for the next sendmmsg(), the batch is flushed when it
+ * gets full or before the socket blocks waiting for the peer. The payload is not
+ * copied, it has to stay intact until the batch is flushed.
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param tcph header of the datagram (network-byte-order)
+ * @param payld payload of the datagram
+ * @param paysz size of 'payld'
+ */
+static void _tx_queue(microtcp_sock_t * __restrict__ sock, const microtcp_header_t * __restrict__ tcph,
+						const uint8_t * __restrict__ payld, uint32_t paysz)
+{
+	struct microtcp_batch * txb = sock->txb;
+
+
+	if ( txb->cnt == MICROTCP_BATCH_LEN )
+		_tx_flush(sock);
+
+	memcpy(txb->slot[txb->cnt], tcph, MICROTCP_HEADER_SIZE);
+	txb->iov[2 * txb->cnt + 1].iov_base = (void *)(payld);
+	txb->iov[2 * txb->cnt + 1].iov_len  = paysz;
+	txb->msgs[txb->cnt].msg_hdr.msg_control    = NULL;
+	txb->msgs[txb->cnt].msg_hdr.msg_controllen = 0UL;
+	++txb->cnt;
+}
+
+/**
+ * @brief Attaches a departure time (SCM_TXTIME) to the datagram queued last, the
+ * qdisc of the route (fq) holds it back until then.
+ * 
+ * @param txb the batch of a socket
+ * @param us departure time (monotonic, us)
+ */
+static void _tx_txtime(struct microtcp_batch * txb, uint64_t us)
+{
+	struct msghdr * msg = &txb->msgs[txb->cnt - 1U].msg_hdr;
+	struct cmsghdr * cmsg;
+
+
+	msg->msg_control    = txb->ctl[txb->cnt - 1U];
+	msg->msg_controllen = CMSG_SPACE(sizeof(uint64_t));
+
+	cmsg = CMSG_FIRSTHDR(msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_TXTIME;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(uint64_t));
+	*(uint64_t *) CMSG_DATA(cmsg) = us * 1000ULL;
+}
+
+/**
+ * @brief Collects the MSG_ZEROCOPY completion notifications from the error queue
+ * of the socket.
+ * 
+ * @param sock a valid microTCP socket handle
+ */
+static void _zc_reap(microtcp_sock_t * sock)
+{
+	uint8_t control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_storage))];
+	struct sock_extended_err * serr;
+	struct cmsghdr * cmsg;
+	struct msghdr msg;
+
+
+	for ( ;; ) {
+
+		bzero(&msg, sizeof(msg));
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+
+		if ( recvmsg(sock->sd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0 )
+			return;
+
+		for ( cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg) ) {
+
+			serr = (struct sock_extended_err *) CMSG_DATA(cmsg);
+
+			if ( (serr->ee_errno != 0) || (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) )
+				continue;
+
+			/* the notification covers the range of send calls [ee_info, ee_data] */
+			sock->zc_done += serr->ee_data - serr->ee_info + 1U;
+
+			if ( serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED )
+				sock->zc_copied += serr->ee_data - serr->ee_info + 1U;
+		}
+	}
+}
+
+/**
+ * @brief Receives into the buffers of 'gro_buf' and notes the size of the segments of
+ * every coalesced datagram, as UDP_GRO reports it.
+ * 
+ * @return the number of datagrams received, as recvmmsg()
+ */
+static int _gro_recv(microtcp_sock_t * sock)
+{
+	struct microtcp_batch * rxb = sock->rxb;
+	struct cmsghdr * cmsg;
+	struct msghdr * msg;
+	uint32_t segs = 0U;
+	int gso_size;
+	int ret;
+	int i;
+
+
+	for ( i = 0; i < MICROTCP_GRO_BATCH; ++i )
+		rxb->msgs[i].msg_hdr.msg_controllen = sizeof(rxb->ctl[i]);
+
+	if ( (ret = recvmmsg(sock->sd, rxb->msgs, MICROTCP_GRO_BATCH, MSG_DONTWAIT, NULL)) <= 0 )
+		return ret;
+
+	for ( i = 0; i < ret; ++i ) {
+
+		msg = &rxb->msgs[i].msg_hdr;
+		rxb->seg[i] = UINT32_MAX;
+
+		for ( cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg) ) {
+
+			if ( (cmsg->cmsg_level != SOL_UDP) || (cmsg->cmsg_type != UDP_GRO) )
+				continue;
+
+			memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+
+			if ( gso_size > 0 )
+				rxb->seg[i] = gso_size;
+		}
+
+		if ( rxb->msgs[i].msg_len > rxb->seg[i] ) {
+
+			segs += (rxb->msgs[i].msg_len + rxb->seg[i] - 1U) / rxb->seg[i];
+			++sock->gro_rcvd;
+		}
+		else
+			++segs;
+	}
+
+	++sock->rx_batches;
+	sock->rx_batched  += segs;
+	sock->rx_batch_max = MAX2(sock->rx_batch_max, segs);
+
+	return ret;
+}
+
+/**
+ * @brief Turns MICROTCP_SO_GSO on or off. Sending needs nothing but UDP_SEGMENT on every
+ * super-datagram, receiving needs UDP_GRO and buffers that fit a coalesced datagram.
+ * 
+ * @return 0 on success or -1 if the kernel knows neither (errno is set)
+ */
+static int _gso_set(microtcp_sock_t * sock, int on)
+{
+	struct microtcp_batch * rxb = sock->rxb;
+	socklen_t len = sizeof(int);
+	unsigned int i;
+	int val;
+
+
+	if ( on && !sock->gro_buf ) {
+
+		/* UDP_SEGMENT is there since Linux 4.18, UDP_GRO since 5.0 */
+		if ( getsockopt(sock->sd, SOL_UDP, UDP_SEGMENT, &val, &len) < 0 )
+			return -(EXIT_FAILURE);
+
+		if ( !(sock->gro_buf = (uint8_t *) malloc(MICROTCP_GRO_BATCH * GRO_DGRAM_LEN)) ) {
+
+			errno = ENOMEM;
+			return -(EXIT_FAILURE);
+		}
+
+		val = 1;
+
+		if ( setsockopt(sock->sd, SOL_UDP, UDP_GRO, &val, sizeof(val)) < 0 ) {
+
+			free(sock->gro_buf);
+			sock->gro_buf = NULL;
+			return -(EXIT_FAILURE);
+		}
+
+		for ( i = 0U; i < MICROTCP_GRO_BATCH; ++i ) {
+
+			rxb->iov[2 * i].iov_base = sock->gro_buf + i * GRO_DGRAM_LEN;
+			rxb->iov[2 * i].iov_len  = GRO_DGRAM_LEN;
+			rxb->msgs[i].msg_hdr.msg_control = rxb->ctl[i];
+		}
+	}
+	else if ( !on && sock->gro_buf ) {
+
+		val = 0;
+		check( setsockopt(sock->sd, SOL_UDP, UDP_GRO, &val, sizeof(val)) );
+
+		for ( i = 0U; i < MICROTCP_GRO_BATCH; ++i ) {
+
+			rxb->iov[2 * i].iov_base = rxb->slot[i];
+			rxb->iov[2 * i].iov_len  = SLOT_LEN;
+			rxb->msgs[i].msg_hdr.msg_control    = NULL;
+			rxb->msgs[i].msg_hdr.msg_controllen = 0UL;
+			rxb->seg[i] = UINT32_MAX;
+		}
+
+		free(sock->gro_buf);
+		sock->gro_buf = NULL;
+	}
+
+	sock->gso = on;
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Hands out the next received datagram. Datagrams are drained from the socket
+ * with recvmmsg() and consumed one at a time. Before blocking, the queued datagrams are
+ * flushed and the socket waits for data or for the next timer of the wheel, whichever comes first.
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param dgram set to the datagram, valid until the next call
+ * @return the length of the datagram, 0 if timers expired, -1 on error
+ */
+static ssize_t _recv_timed(microtcp_sock_t * __restrict__ sock, const uint8_t ** __restrict__ dgram)
+{
+	struct microtcp_batch * rxb = sock->rxb;
+	struct pollfd pfd;
+	struct timespec ts;
+	uint64_t next;
+	uint64_t now;
+	uint64_t ev;
+	ssize_t len;
+	int drained = 0;
+	int ret;
+
+
+	pfd.fd     = ( sock->flow ) ? sock->flow->evfd : sock->sd;
+	pfd.events = POLLIN;
+
+	for ( ;; ) {
+
+		if ( sock->flow ) {  // connection of a listener, the listener fills 'rxb'
+
+			if ( rxb->held ) {  // the previous datagram is consumed
+
+				__atomic_store_n(&rxb->tail, rxb->tail + 1U, __ATOMIC_RELEASE);
+				rxb->held = 0U;
+			}
+
+			if ( __atomic_load_n(&rxb->head, __ATOMIC_ACQUIRE) != rxb->tail ) {
+
+				rxb->held = 1U;
+				*dgram = rxb->slot[rxb->tail % MICROTCP_BATCH_LEN];
+				return rxb->msgs[rxb->tail % MICROTCP_BATCH_LEN].msg_len;
+			}
+		}
+		else if ( rxb->pos < rxb->cnt ) {
+
+			*dgram = (const uint8_t *)(rxb->iov[2 * rxb->pos].iov_base) + rxb->off;
+			len    = rxb->msgs[rxb->pos].msg_len - rxb->off;
+
+			if ( (size_t)(len) > rxb->seg[rxb->pos] ) {  // a segment of a coalesced datagram
+
+				len       = rxb->seg[rxb->pos];
+				rxb->off += len;
+			}
+			else {
+
+				rxb->off = 0U;
+				++rxb->pos;
+			}
+
+			return len;
+		}
+		else if ( sock->uring && (len = _uring_next(sock, dgram)) )
+			return len;
+
+		_tx_flush(sock);
+
+		if ( sock->uring ) {  // the completions that the sends reaped
+
+			if ( (len = _uring_next(sock, dgram)) )
+				return len;
+		}
+		else if ( !sock->flow ) {
+
+			if ( sock->gro_buf )
+				ret = _gro_recv(sock);
+			else
+				ret = recvmmsg(sock->sd, rxb->msgs, MICROTCP_BATCH_LEN, MSG_DONTWAIT, NULL);
+
+			if ( ret > 0 ) {
+
+				rxb->cnt = ret;
+				rxb->pos = 0U;
+
+				if ( !sock->gro_buf ) {
+
+					++sock->rx_batches;
+					sock->rx_batched  += ret;
+					sock->rx_batch_max = MAX2(sock->rx_batch_max, (uint32_t)(ret));
+				}
+
+				continue;
+			}
+
+			if ( (ret < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) )
+				return -1L;
+		}
+
+		now  = US_TO_TICKS(_now_us());
+		next = tw_next(sock->wheel);
+
+		if ( next <= now ) {
+
+			if ( tw_advance(sock->wheel, now) )
+				return 0L;
+
+			continue;  // only cascaded, look again
+		}
+
+		if ( sock->nonblock ) {
+
+			if ( sock->flow && !drained ) {
+
+				/* cleared before the ring is looked at again, a later enqueue signals it anew */
+				if ( (read(pfd.fd, &ev, sizeof(ev)) < 0) && (errno != EAGAIN) )
+					return -1L;
+
+				drained = 1;
+				continue;
+			}
+
+			if ( sock->uring && !drained ) {  // completions the kernel has not posted yet
+
+				if ( _uring_wait(sock, 0, NULL) < 0 )
+					return -1L;
+
+				drained = 1;
+				continue;
+			}
+
+			errno = EAGAIN;
+			return -1L;
+		}
+
+		if ( next != TW_NEVER ) {
+
+			next = (next - now) * MICROTCP_TIMER_TICK_US;
+			ts.tv_sec  = next / 1000000UL;
+			ts.tv_nsec = (next % 1000000UL) * 1000UL;
+		}
+
+		if ( sock->uring ) {
+
+			if ( _uring_wait(sock, 1, ( next != TW_NEVER ) ? &ts : NULL) < 0 )
+				return -1L;
+
+			continue;
+		}
+
+		if ( (ppoll(&pfd, 1, ( next != TW_NEVER ) ? &ts : NULL, NULL) < 0) && (errno != EINTR) )
+			return -1L;
+
+		if ( sock->flow ) {
+
+			if ( (pfd.revents & POLLIN) && (read(pfd.fd, &ev, sizeof(ev)) < 0) && (errno != EAGAIN) )
+				return -1L;
+		}
+		else if ( pfd.revents & POLLERR )  // MSG_ZEROCOPY completions
+			_zc_reap(sock);
+	}
+}
+
+/**
+ * @brief Expiration of a segment's retransmission timer. The segment (and the
+ * rest of the unsacked window behind it) is retransmitted by _output(),
+ * the window collapses and the RTO backs off. Segments that are already queued
+ * for retransmission are ignored. During a fast recovery only the oldest segment
+ * times out, the partial ACKs repair the holes behind it one by one and the
+ * timers of the other segments are restarted.
+ * 
+ * @param timer the 'rtx' timer of a segment of the send queue
+ */
+static void _rtx_expired(tw_timer_t * timer)
+{
+	microtcp_sock_t * sock = (microtcp_sock_t *)(timer->arg);
+	microtcp_segment_t * seg = (microtcp_segment_t *)((uint8_t *)(timer) - offsetof(microtcp_segment_t, rtx));
+
+
+	if ( SENDQ_IDX(sock, seg) >= sock->sendq_sent )
+		return;
+
+	if ( sock->in_recovery && SENDQ_IDX(sock, seg) ) {
+
+		_timer_arm(sock, timer, sock->rto);
+		return;
+	}
+
+	sock->cc->on_timeout(sock);
+	sock->rto     = MIN2(2U * sock->rto, sock->rto_max);  // exponential backoff
+	sock->dupacks = 0U;
+
+	/* the duplicate ACKs that the go-back retransmission provokes are no new loss */
+	sock->in_recovery = 0;
+	sock->recover     = sock->seq_number;
+
+	LOG_DEBUG("timeout-occured (rto = %u us), retransmiting window\n", sock->rto);
+
+	++sock->packets_lost;
+	sock->bytes_lost += seg->data_len;
+	sock->sendq_sent = 0UL;  // go back to the oldest unacked segment
+}
+
+/**
+ * @brief Sends a segment without payload (e.g. ACK, FIN) with sequence number 'seq'.
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param ctrlb control bits
+ * @param seq sequence number of the segment
+ */
+static void _send_ctrl(microtcp_sock_t * sock, uint16_t ctrlb, uint32_t seq)
+{
+	microtcp_header_t tcph;
+
+
+	_preapre_send_tcph(sock, &tcph, ctrlb, NULL, 0U);
+	tcph.seq_number = htonl(seq);
+
+	_tx_queue(sock, &tcph, NULL, 0U);
+
+	sock->acks_sent += ( ctrlb == CTRL_ACK ) ? 1U : 0U;
+}
+
+/**
+ * @brief Expiration of 'delack_timer': an in-order segment waited MICROTCP_DELACK_US
+ * for a second one to be acknowledged with.
+ * 
+ * @param timer the 'delack_timer' of a socket
+ */
+static void _delack_expired(tw_timer_t * timer)
+{
+	microtcp_sock_t * sock = (microtcp_sock_t *)(timer->arg);
+
+
+	++sock->acks_delayed;
+	_send_ctrl(sock, CTRL_ACK, sock->seq_number);
+}
+
+/**
+ * @brief Acknowledges a received segment. An in-order segment is acknowledged with
+ * the next one (every MICROTCP_DELACK_SEGS segments) or by 'delack_timer', whichever
+ * comes first. A segment out of order, one that fills a hole, or the last segment of
+ * a send (CTRL_PSH) that the peer waits for is acknowledged right away, as are the
+ * duplicates. Data that we send carry the ACK as well (_send_segment()).
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param now acknowledge without delay
+ */
+static void _ack_segment(microtcp_sock_t * sock, int now)
+{
+	if ( now || (++sock->delack_segs >= MICROTCP_DELACK_SEGS) ) {
+
+		_send_ctrl(sock, CTRL_ACK, sock->seq_number);
+		return;
+	}
+
+	if ( !tw_pending(&sock->delack_timer) )
+		_timer_arm(sock, &sock->delack_timer, MICROTCP_DELACK_US);
+}
+
+/**
+ * @brief Expiration of 'ctl_timer'. In TIME_WAIT the connection is closed, otherwise
+ * an unacknowledged FIN is retransmitted (with backoff) until MICROTCP_FIN_RETRIES
+ * expirations, after which the peer is considered gone.
+ * 
+ * @param timer the 'ctl_timer' of a socket
+ */
+static void _ctl_expired(tw_timer_t * timer)
+{
+	microtcp_sock_t * sock = (microtcp_sock_t *)(timer->arg);
+
+
+	if ( (sock->state == TIME_WAIT) || (++sock->ctl_retries > MICROTCP_FIN_RETRIES) ) {
+
+		sock->state = CLOSED;
+		return;
+	}
+
+	if ( sock->snd_una != sock->seq_number ) {  // FIN not acknowledged yet
+
+		LOG_DEBUG("retransmiting FIN\n");
+
+		sock->rto = MIN2(2U * sock->rto, sock->rto_max);
+		_send_ctrl(sock, CTRL_FIN | CTRL_ACK, sock->seq_number - 1U);
+	}
+
+	_timer_arm(sock, timer, sock->rto);
+}
+
+/**
+ * @brief Expiration of 'persist_timer': the window of the peer is still too small for
+ * the next segment. The probe, an ACK for a byte that the peer already holds, makes it
+ * repeat its window in case the update got lost. _output() re-arms the timer with
+ * exponential backoff as long as the window stays closed.
+ * 
+ * @param timer the 'persist_timer' of a socket
+ */
+static void _persist_expired(tw_timer_t * timer)
+{
+	microtcp_sock_t * sock = (microtcp_sock_t *)(timer->arg);
+
+
+	LOG_DEBUG("zero window probe (window = %u)\n", sock->sendbuflen);
+
+	_send_ctrl(sock, CTRL_ACK, sock->snd_una - 1U);
+
+	++sock->probes;
+	++sock->zwp_sent;
+}
+
+/**
+ * @brief Appends a new (unsent) segment at the tail of the send queue. The queue
+ * doubles in size when it is full.
+ * 
+ * @param sock a valid microTCP socket handle
+ * @return the new segment or NULL if the queue could not grow
+ */
+static microtcp_segment_t * _sendq_push(microtcp_sock_t * sock)
+{
+	microtcp_segment_t * nq;
+	size_t i;
+
+
+	if ( sock->sendq_len == sock->sendq_cap ) {
+
+		if ( !(nq = (microtcp_segment_t *) malloc(2 * sock->sendq_cap * sizeof(*nq))) ) {
+
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		for ( i = 0UL; i < sock->sendq_len; ++i ) {
+
+			nq[i] = *SENDQ_AT(sock, i);
+
+			/* the timers are linked in the wheel by address */
+			if ( tw_pending(&SENDQ_AT(sock, i)->rtx) ) {
+
+				tw_del(sock->wheel, &SENDQ_AT(sock, i)->rtx);
+				nq[i].rtx.pprev = NULL;
+				tw_add(sock->wheel, &nq[i].rtx, nq[i].rtx.expires);
+			}
+		}
+
+		free(sock->sendq);
+		sock->sendq       = nq;
+		sock->sendq_head  = 0UL;
+		sock->sendq_cap  *= 2;
+	}
+
+	return SENDQ_AT(sock, sock->sendq_len++);
+}
+
+/**
+ * @brief Stamps a segment with the delivery state of the socket as it goes on the
+ * wire. Sending into an empty pipe starts a new delivery interval.
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param seg segment to be sent
+ * @param now the time of the transmission in us
+ */
+static void _rate_on_send(microtcp_sock_t * __restrict__ sock, microtcp_segment_t * __restrict__ seg, uint64_t now)
+{
+	if ( !sock->sendq_sent ) {
+
+		sock->first_sent_us = now;
+		sock->delivered_us  = now;
+	}
+
+	seg->tx_delivered     = sock->delivered;
+	seg->tx_delivered_us  = sock->delivered_us;
+	seg->tx_first_sent_us = sock->first_sent_us;
+	seg->tx_app_limited   = ( sock->app_limited != 0ULL );
+}
+
+/**
+ * @brief Counts a segment that the peer got (cumulatively or selectively acknowledged for
+ * the first time). The most recently sent of them delimits the interval of the rate sample.
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param seg the delivered segment
+ * @param now the time of the ACK in us
+ */
+static void _rate_delivered(microtcp_sock_t * __restrict__ sock, const microtcp_segment_t * __restrict__ seg, uint64_t now)
+{
+	microtcp_rate_sample_t * rs = &sock->rs;
+
+
+	sock->delivered   += seg->data_len;
+	sock->delivered_us = now;
+
+	if ( !rs->prior_delivered || (seg->tx_delivered > rs->prior_delivered) ) {
+
+		rs->prior_delivered = seg->tx_delivered;
+		rs->prior_us        = seg->tx_delivered_us;
+		rs->app_limited     = seg->tx_app_limited;
+		rs->send_elapsed    = seg->sent_us - seg->tx_first_sent_us;
+		sock->first_sent_us = seg->sent_us;
+	}
+}
+
+/**
+ * @brief Completes the rate sample of an ACK: the bytes delivered since the newest
+ * delivered segment was sent, over the longer of its send and ACK phases (an ACK
+ * compressed on the way back cannot inflate the rate).
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param rtt the RTT sample of the ACK in us, 0 if there is none
+ */
+static void _rate_sample(microtcp_sock_t * sock, uint32_t rtt)
+{
+	microtcp_rate_sample_t * rs = &sock->rs;
+
+
+	if ( sock->app_limited && (sock->delivered > sock->app_limited) )  // the bubble is acknowledged
+		sock->app_limited = 0ULL;
+
+	rs->rtt = rtt;
+
+	if ( !rs->prior_us ) {  // nothing new was delivered
+
+		rs->delivered = rs->interval_us = 0ULL;
+		return;
+	}
+
+	rs->delivered   = sock->delivered - rs->prior_delivered;
+	rs->interval_us = MAX2(rs->send_elapsed, sock->delivered_us - rs->prior_us);
+}
+
+/**
+ * @brief Releases every segment that is fully covered by the cumulative 'ack' and
+ * takes an RTT sample from the newest of them, unless it was retransmitted.
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param ack cumulative ACK number (host-byte-order)
+ * @param rtt the RTT sample in us, 0 if there is none
+ * @return number of payload bytes that got acknowledged
+ */
+static uint32_t _sendq_ack(microtcp_sock_t * __restrict__ sock, uint32_t ack, uint32_t * __restrict__ rtt)
+{
+	microtcp_segment_t * seg;
+	uint64_t sent_us = 0ULL;  // transmission time of the newest acked segment
+	uint64_t now = _now_us();
+	uint32_t acked = 0U;
+
+
+	while ( sock->sendq_len ) {
+
+		seg = SENDQ_AT(sock, 0UL);
+
+		if ( SEQ_LT(ack, seg->seq_number + seg->data_len) )
+			break;
+
+		sent_us = ( seg->retrans ) ? 0ULL : seg->sent_us;
+
+		if ( !seg->sacked )
+			_rate_delivered(sock, seg, now);
+
+		tw_del(sock->wheel, &seg->rtx);
+
+		acked += seg->data_len;
+		sock->sendq_head = (sock->sendq_head + 1UL) % sock->sendq_cap;
+		--sock->sendq_len;
+
+		if ( sock->sendq_sent )
+			--sock->sendq_sent;
+	}
+
+	*rtt = ( sent_us ) ? (uint32_t)(now - sent_us) : 0U;
+
+	if ( *rtt )  // Karn's rule, retransmitted segments give ambiguous samples
+		_rtt_sample(sock, *rtt);
+
+	return acked;
+}
+
+/**
+ * @brief Marks the segments of the send queue that the peer reported in the SACK
+ * blocks of an ACK, so that they are skipped by retransmissions.
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param tcph the received ACK (host-byte-order)
+ */
+static void _sendq_sack(microtcp_sock_t * __restrict__ sock, const microtcp_header_t * __restrict__ tcph)
+{
+	microtcp_segment_t * seg;
+	uint32_t left[2], right[2];
+	uint64_t now;
+	size_t i;
+	int n, b;
+
+
+	if ( !(sock->opts & MICROTCP_OPT_SACK) || (tcph->future_use0 == tcph->future_use1) )
+		return;
+
+	n = 1;
+	left[0]  = tcph->future_use0;
+	right[0] = tcph->future_use1;
+
+	if ( tcph->future_use2 ) {
+
+		left[1]  = right[0] + (tcph->future_use2 >> 16);
+		right[1] = left[1] + (tcph->future_use2 & UINT16_MAX);
+		++n;
+	}
+
+	now = _now_us();
+
+	for ( i = 0UL; i < sock->sendq_len; ++i ) {
+
+		seg = SENDQ_AT(sock, i);
+
+		for ( b = 0; b < n; ++b )
+			if ( !seg->sacked && SEQ_LEQ(left[b], seg->seq_number) && SEQ_LEQ(seg->seq_number + seg->data_len, right[b]) ) {
+
+				seg->sacked = 1;
+				tw_del(sock->wheel, &seg->rtx);
+				_rate_delivered(sock, seg, now);
+			}
+	}
+}
+
+/**
+ * @brief Expiration of the pacing timer. It has nothing to do, the sender that sleeps
+ * on the timers of the socket wakes up and sends the segment that is due.
+ */
+static void _pace_expired(tw_timer_t * timer)
+{
+	(void)(timer);
+}
+
+/**
+ * @brief Departure time of a segment of 'len' bytes that is sent now, the one of the
+ * next segment moves on by the time 'len' takes at the pacing rate of the congestion
+ * control. An idle sender earns no credit, the schedule restarts from 'now'.
+ * 
+ * @return the departure time of the segment (monotonic, us)
+ */
+static uint64_t _pace_sent(microtcp_sock_t * sock, uint32_t len, uint64_t now)
+{
+	uint64_t departure;
+	uint64_t rate;
+
+
+	departure = sock->pace_next_us = MAX2(sock->pace_next_us, now);
+
+	if ( sock->pacing && (rate = sock->cc->pacing_rate(sock)) )
+		sock->pace_next_us += (uint64_t)(len) * 1000000ULL / rate;
+
+	return departure;
+}
+
+/**
+ * @brief With MICROTCP_PACING_TIMER, holds the next segment back until its departure
+ * time, on the timers of the socket. Segments leave up to a tick of the timers early,
+ * the ones of the same tick go out as a burst.
+ * 
+ * @return whether the next segment has to wait
+ */
+static int _pace_hold(microtcp_sock_t * sock)
+{
+	uint64_t now;
+
+
+	if ( sock->pacing != MICROTCP_PACING_TIMER )
+		return 0;
+
+	now = _now_us();
+
+	if ( sock->pace_next_us <= now + MICROTCP_TIMER_TICK_US )
+		return 0;
+
+	if ( !tw_pending(&sock->pace_timer) ) {
+
+		++sock->paced;
+		_timer_arm(sock, &sock->pace_timer, sock->pace_next_us - now - MICROTCP_TIMER_TICK_US);
+	}
+
+	return 1;
+}
+
+/**
+ * @brief Puts a segment of the send queue on the wire (first transmission or
+ * retransmission).
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param seg segment to be sent
+ */
+static void _send_segment(microtcp_sock_t * __restrict__ sock, microtcp_segment_t * __restrict__ seg)
+{
+	microtcp_header_t tcph;
+	uint64_t departure;
+
+
+	_preapre_send_tcph(sock, &tcph, seg->control | CTRL_ACK, seg->payld, seg->data_len);  // piggybacked ACK
+	tcph.seq_number = htonl(seg->seq_number);
+
+	_tx_queue(sock, &tcph, seg->payld, seg->data_len);
+
+	seg->sent_us = _now_us();
+	departure    = _pace_sent(sock, seg->data_len, seg->sent_us);
+
+	if ( sock->pacing == MICROTCP_PACING_TXTIME ) {
+
+		_tx_txtime(sock->txb, departure);
+		sock->paced += ( departure > seg->sent_us ) ? 1U : 0U;
+	}
+
+	_rate_on_send(sock, seg, seg->sent_us);
+	_timer_arm(sock, &seg->rtx, sock->rto);
+
+	++sock->packets_send;
+	sock->bytes_send += seg->data_len;
+}
+
+/**
+ * @brief Stores an out-of-order segment in the reassembly buffer ('recvbuf'). The
+ * position of every byte in the ring is given by its distance from 'recv_seq'.
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param tcph the header of the segment (host-byte-order)
+ * @param payld the payload of the segment
+ * @return 0 on success, -1 if the segment does not fit in the receive window
+ */
+static int _recvbuf_store(microtcp_sock_t * __restrict__ sock, const microtcp_header_t * __restrict__ tcph,
+						const uint8_t * __restrict__ payld)
+{
+	uint32_t crc;
+	size_t idx;
+	size_t first;
+	size_t i;
+
+
+	if ( !tcph->data_len || ((uint32_t)(tcph->seq_number - sock->recv_seq) + tcph->data_len > sock->recvbuf_len) )
+		return -(EXIT_FAILURE);
+
+	idx   = RECVBUF_IDX(sock, tcph->seq_number);
+	first = MIN2(tcph->data_len, sock->recvbuf_len - idx);
+
+	if ( BIT_GET(sock->recvmap, idx) )  // already buffered, segments are always resent whole
+		return -(EXIT_FAILURE);
+
+	/* the bytes are not marked in 'recvmap' until the checksum is verified */
+	crc = update_crc32_copy(0xffffffff, sock->recvbuf + idx, payld, first);
+	crc = update_crc32_copy(crc, sock->recvbuf, payld + first, tcph->data_len - first) ^ 0xffffffff;
+
+	if ( crc != tcph->checksum ) {
+
+		LOG_DEBUG("Corrupted segment dropped\n");
+		++sock->packets_corrupted;
+		return -(EXIT_FAILURE);
+	}
+
+	for ( i = 0UL; i < tcph->data_len; ++i )
+		BIT_SET(sock->recvmap, (idx + i) & (sock->recvbuf_len - 1UL));
+
+	if ( SEQ_LT(sock->recv_high, tcph->seq_number + tcph->data_len) )
+		sock->recv_high = tcph->seq_number + tcph->data_len;
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Clears 'n' bits of a bitmap from bit 'idx' on, whole bytes at a time.
+ */
+static void _bits_clr(uint8_t * map, size_t idx, size_t n)
+{
+	for ( ; n && (idx & 7U); --n, ++idx )
+		BIT_CLR(map, idx);
+
+	memset(map + (idx >> 3), 0, n >> 3);
+	idx += n & ~7UL;
+
+	for ( n &= 7U; n; --n, ++idx )
+		BIT_CLR(map, idx);
+}
+
+/**
+ * @brief Moves up to 'max' bytes of the in-order data of 'recvbuf' to 'buffer'.
+ * The receive queue is a byte stream, a read may end in the middle of a segment
+ * or span many of them.
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param buffer destination buffer
+ * @param max the most bytes to move
+ * @return the number of bytes moved
+ */
+static size_t _recvbuf_pop(microtcp_sock_t * __restrict__ sock, uint8_t * __restrict__ buffer, size_t max)
+{
+	size_t len = (uint32_t)(sock->ack_number - sock->recv_seq) - sock->fin_rcvd;  // the FIN holds no data
+	size_t first;
+
+
+	len   = MIN2(len, max);
+	first = MIN2(len, sock->recvbuf_len - sock->recv_head);
+
+	memcpy(buffer, sock->recvbuf + sock->recv_head, first);
+	memcpy(buffer + first, sock->recvbuf, len - first);
+	_bits_clr(sock->recvmap, sock->recv_head, first);
+	_bits_clr(sock->recvmap, 0UL, len - first);
+
+	sock->recv_head       = (sock->recv_head + len) & (sock->recvbuf_len - 1UL);
+	sock->recv_seq       += len;
+	sock->buf_fill_level -= len;
+
+	return len;
+}
+
+/**
+ * @brief Advances 'ack_number' over the out-of-order data that became contiguous
+ * and updates the fill level (and therefore the advertised window) of 'recvbuf'.
+ * 
+ * @param socket a valid microTCP socket handle
+ */
+static void _update_recv_buf(microtcp_sock_t *socket)
+{
+	size_t idx;
+
+
+	while ( (uint32_t)(socket->ack_number - socket->recv_seq) < socket->recvbuf_len ) {
+
+		idx = RECVBUF_IDX(socket, socket->ack_number);
+
+		if ( !BIT_GET(socket->recvmap, idx) )
+			break;
+
+		++socket->ack_number;
+	}
+
+	socket->buf_fill_level = (uint32_t)(socket->ack_number - socket->recv_seq);
+}
+
+/**
+ * @brief Announces the space that the application freed in 'recvbuf' once the window
+ * can open by a segment (half the buffer if it is smaller), so that a sender that
+ * stopped at the edge of the window resumes without waiting for a probe. Smaller
+ * openings are left for the next ACK (receiver side silly window avoidance).
+ * 
+ * @param sock a valid microTCP socket handle
+ */
+static void _rcv_wnd_update(microtcp_sock_t * sock)
+{
+	size_t avail = sock->recvbuf_len - sock->buf_fill_level;
+
+
+	if ( (avail <= sock->rcv_wnd) || (avail - sock->rcv_wnd < MIN2((size_t)(MICROTCP_MSS), sock->recvbuf_len / 2UL)) )
+		return;
+
+	_send_ctrl(sock, CTRL_ACK, sock->seq_number);
+	_tx_flush(sock);
+}
+
+/**
+ * @brief Fast retransmit: resends the oldest unacknowledged segment, which the
+ * duplicate or partial ACKs report as lost, without waiting for its timer.
+ * 
+ * @param sock a valid microTCP socket handle
+ */
+static void _fast_retransmit(microtcp_sock_t * sock)
+{
+	microtcp_segment_t * seg;
+
+
+	if ( !sock->sendq_sent )  // a timeout already queued the whole window again
+		return;
+
+	seg = SENDQ_AT(sock, 0UL);
+	seg->retrans = 1;
+	_send_segment(sock, seg);
+
+	++sock->fast_retrans;
+	++sock->packets_lost;
+	sock->bytes_lost += seg->data_len;
+}
+
+/**
+ * @brief Sender side of an incoming ACK: slides the send queue and hands the
+ * acknowledged bytes to the congestion control. Losses are repaired by NewReno
+ * (RFC 6582): 3 duplicate ACKs retransmit the segment at the hole and start a
+ * fast recovery, in which every further duplicate ACK inflates cwnd by a segment
+ * that left the network. A partial ACK (below 'recover') points at the next hole
+ * of the same window, which is retransmitted right away, the recovery ends once
+ * everything that was in flight at the loss is acknowledged.
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param tcph the header of the ACK (host-byte-order)
+ */
+static void _ack_input(microtcp_sock_t * __restrict__ sock, const microtcp_header_t * __restrict__ tcph)
+{
+	uint32_t wnd = (uint32_t)(tcph->window) << sock->snd_wscale;
+	int wnd_update = 0;
+	uint32_t acked;
+	uint32_t rtt;
+
+
+	if ( !(tcph->control & CTRL_ACK) || SEQ_LT(sock->seq_number, tcph->ack_number) )
+		return;
+
+	/* the window of an ACK that is not older than the latest one is the current one */
+	if ( SEQ_LEQ(sock->snd_una, tcph->ack_number) && (wnd != sock->sendbuflen) ) {
+
+		if ( wnd > sock->sendbuflen ) {  // _output() probes again if it is still too small
+
+			sock->probes = 0U;
+			tw_del(sock->wheel, &sock->persist_timer);
+		}
+
+		sock->sendbuflen = wnd;
+		wnd_update       = 1;
+	}
+
+	if ( sock->snd_una == sock->seq_number )  // nothing in flight
+		return;
+
+	bzero(&sock->rs, sizeof(sock->rs));
+	_sendq_sack(sock, tcph);
+
+	if ( SEQ_LEQ(tcph->ack_number, sock->snd_una) ) {  // duplicate ACK
+
+		if ( tcph->data_len || wnd_update )  // data of the peer or a window update, not a sign of loss
+			return;
+
+		LOG_DEBUG("!ack <= snd_una!");
+
+		if ( sock->in_recovery ) {  // window inflation
+
+			sock->cwnd += MICROTCP_MSS;
+			return;
+		}
+
+		/* the duplicates of a window that a timeout already retransmits are no new loss */
+		if ( (++sock->dupacks != 3U) || SEQ_LT(tcph->ack_number, sock->recover) )
+			return;
+
+		sock->in_recovery = 1;
+		sock->recover     = sock->seq_number;
+
+		sock->cc->on_loss(sock);  // ssthresh and cwnd = ssthresh + 3 MSS
+		_fast_retransmit(sock);
+
+		return;
+	}
+
+	// new cumulative ACK, slide the window
+	sock->dupacks = 0U;
+	acked = _sendq_ack(sock, tcph->ack_number, &rtt);
+	sock->snd_una = tcph->ack_number;
+
+	_rate_sample(sock, rtt);
+
+	if ( sock->in_recovery ) {
+
+		if ( SEQ_LT(tcph->ack_number, sock->recover) ) {  // partial ACK
+
+			_fast_retransmit(sock);
+
+			/* deflate by the data that left the network, the retransmission takes a segment */
+			sock->cwnd -= MIN2(sock->cwnd, (size_t)(acked));
+			sock->cwnd += MICROTCP_MSS;
+			return;
+		}
+
+		sock->in_recovery = 0;
+		sock->cwnd        = sock->ssthresh;  // deflate after recovery
+		return;
+	}
+
+	sock->cc->on_ack(sock, acked, rtt);
+}
+
+/**
+ * @brief Puts on the wire as much as MIN(cwnd, peer window) and pacing allow: the
+ * queued segments that are not in flight first (retransmissions), then new segments
+ * cut from the unsent bytes of 'sndbuf'. Small writes are coalesced into full segments
+ * unless MICROTCP_SO_NODELAY is set. A new segment never goes past
+ * the window of the peer, it waits for a segment's worth of it (sender side silly
+ * window avoidance) and the peer is probed while nothing is in flight.
+ * 
+ * @param sock a valid microTCP socket handle
+ * @return 0 on success or -1 if the send queue could not grow
+ */
+static int _output(microtcp_sock_t * sock)
+{
+	microtcp_segment_t * seg;
+	uint32_t seglen;
+	size_t idx;
+	size_t wnd = MIN2(sock->cwnd, sock->sendbuflen);
+
+
+	/* (re)transmit segments that were queued but are not on the wire */
+	while ( sock->sendq_sent < sock->sendq_len ) {
+
+		seg = SENDQ_AT(sock, sock->sendq_sent);
+
+		if ( seg->sacked ) {  // the peer already holds it, retransmit only the holes
+
+			++sock->sendq_sent;
+			continue;
+		}
+
+		if ( sock->sendq_sent && (seg->seq_number + seg->data_len - sock->snd_una > wnd) )
+			break;
+
+		if ( _pace_hold(sock) )
+			break;
+
+		seg->retrans = 1;
+		_send_segment(sock, seg);
+		++sock->sendq_sent;
+	}
+
+	/* keep the pipe full with new segments */
+	while ( (sock->sendq_sent == sock->sendq_len) && (sock->snd_end != sock->seq_number) ) {
+
+		/* a segment does not wrap around the end of 'sndbuf' */
+		idx    = sock->seq_number & (sock->sndbuf_len - 1UL);
+		seglen = MIN2(MIN2(sock->snd_end - sock->seq_number, MICROTCP_MSS), sock->sndbuf_len - idx);
+
+		if ( sock->seq_number + seglen - sock->snd_una > sock->sendbuflen ) {
+
+			if ( !sock->sendq_len && !tw_pending(&sock->persist_timer) )
+				_timer_arm(sock, &sock->persist_timer, MIN2(((uint64_t)(sock->rto) << MIN2(sock->probes, 16U)), (uint64_t)(sock->rto_max)));
+
+			break;
+		}
+
+		if ( sock->sendq_len && (sock->seq_number + seglen - sock->snd_una > sock->cwnd) )
+			break;
+
+		/* Nagle: the partial segment at the tail waits while data is in flight, the next
+		 * microtcp_send() fills it up or the ACK lets it go */
+		if ( !sock->nodelay && (seglen < MICROTCP_MSS) && (seglen == sock->snd_end - sock->seq_number)
+			&& (sock->snd_una != sock->seq_number) )
+			break;
+
+		if ( _pace_hold(sock) )
+			break;
+
+		if ( !(seg = _sendq_push(sock)) )
+			return -(EXIT_FAILURE);
+
+		seg->seq_number = sock->seq_number;
+		seg->data_len   = seglen;
+		seg->sacked     = 0;
+		seg->retrans    = 0;
+		seg->payld      = sock->sndbuf + idx;
+		tw_timer_init(&seg->rtx, _rtx_expired, sock);
+
+		// the segment that empties the buffer is acknowledged right away
+		sock->seq_number += seglen;
+		seg->control      = ( sock->snd_end == sock->seq_number ) ? CTRL_PSH : CTRL_XXX;
+
+		_send_segment(sock, seg);
+		++sock->sendq_sent;
+	}
+
+	/* out of data with room in cwnd, the rate samples until this is delivered understate the path */
+	if ( (sock->snd_end == sock->seq_number) && (sock->seq_number - sock->snd_una < sock->cwnd) )
+		sock->app_limited = MAX2(sock->delivered + (sock->seq_number - sock->snd_una), 1ULL);
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @return whether every byte of 'sndbuf' is acknowledged
+ */
+static int _send_done(const microtcp_sock_t * sock)
+{
+	return (sock->snd_end == sock->seq_number) && (sock->snd_una == sock->seq_number);
+}
+
+/**
+ * @return the bytes that microtcp_send() can copy into 'sndbuf' right away
+ */
+static size_t _sndbuf_room(const microtcp_sock_t * sock)
+{
+	return sock->sndbuf_len - (uint32_t)(sock->snd_end - sock->snd_una);
+}
+
+/**
+ * @brief Appends 'len' bytes (at most _sndbuf_room()) to 'sndbuf', wrapping around its end.
+ */
+static void _sndbuf_write(microtcp_sock_t * __restrict__ sock, const uint8_t * __restrict__ data, size_t len)
+{
+	size_t idx   = sock->snd_end & (sock->sndbuf_len - 1UL);
+	size_t first = MIN2(len, sock->sndbuf_len - idx);
+
+
+	memcpy(sock->sndbuf + idx, data, first);
+	memcpy(sock->sndbuf, data + first, len - first);
+
+	sock->snd_end += len;
+}
+
+/**
+ * @brief Forgets the data of 'sndbuf', queued or in flight: the peer closed the
+ * connection, nothing is retransmitted or probed after our FIN.
+ */
+static void _sndbuf_drop(microtcp_sock_t * sock)
+{
+	size_t i;
+
+
+	for ( i = 0UL; i < sock->sendq_len; ++i )
+		tw_del(sock->wheel, &SENDQ_AT(sock, i)->rtx);
+
+	tw_del(sock->wheel, &sock->persist_timer);
+
+	sock->sendq_head = 0UL;
+	sock->sendq_len  = 0UL;
+	sock->sendq_sent = 0UL;
+	sock->snd_end    = sock->seq_number;
+}
+
+/**
+ * @brief Starts the termination: SHUTDOWN_CLIENT sends our FIN, SHUTDOWN_SERVER
+ * acknowledges the FIN of the peer ('ack_number' already covers it) and sends ours.
+ */
+static void _fin_send(microtcp_sock_t * sock, int how)
+{
+	tw_timer_init(&sock->ctl_timer, _ctl_expired, sock);
+	sock->ctl_retries = 0U;
+
+	if ( how == SHUTDOWN_CLIENT ) {  // sender is shutting down the connection
+
+		sock->state = CLOSING_BY_HOST;
+	}
+	else {  // reciever recieved a FIN packet
+
+		sock->state = CLOSING_BY_PEER;
+		_send_ctrl(sock, CTRL_ACK, sock->seq_number);
+	}
+
+	/* Send FIN/ACK, the FIN consumes one sequence number (the bytes of 'sndbuf' that
+	 * are not acknowledged yet are dropped, the peer closed the connection) */
+	_sndbuf_drop(sock);
+	_send_ctrl(sock, CTRL_FIN | CTRL_ACK, sock->seq_number);
+	sock->snd_una = sock->seq_number++;
+	_timer_arm(sock, &sock->ctl_timer, sock->rto);
+}
+
+/**
+ * @brief Termination handshake after _fin_send(): the ACK of our FIN, the FIN of
+ * the peer (or a retransmission of it). The connection ends up CLOSED, directly
+ * or through TIME_WAIT.
+ */
+static void _fin_input(microtcp_sock_t * __restrict__ sock, const microtcp_header_t * __restrict__ tcph)
+{
+	if ( (tcph->control & CTRL_ACK) && (tcph->ack_number == sock->seq_number) ) {
+
+		sock->snd_una = sock->seq_number;  // our FIN got acknowledged
+
+		if ( sock->state == CLOSING_BY_PEER ) {
+
+			sock->state = CLOSED;
+			return;
+		}
+	}
+
+	if ( tcph->control & CTRL_FIN ) {
+
+		if ( sock->state == CLOSING_BY_PEER ) {  // our ACK got lost
+
+			_send_ctrl(sock, CTRL_ACK, sock->seq_number);
+			return;
+		}
+
+		/* FIN of the peer (or a retransmission of it), linger in TIME_WAIT in
+		 * case our ACK gets lost */
+		sock->ack_number = tcph->seq_number + 1U;
+		sock->state      = TIME_WAIT;
+
+		_send_ctrl(sock, CTRL_ACK, sock->seq_number);
+		_timer_arm(sock, &sock->ctl_timer, MICROTCP_TIME_WAIT_US);
+	}
+}
+
+/**
+ * @brief Places an in-order segment straight in the buffer of a blocking microtcp_recv(),
+ * verifying the checksum in the same pass, when 'recvbuf' holds nothing in front of it
+ * and the whole payload fits. Anything else is left to _input(), which goes through
+ * 'recvbuf'.
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param dgram the datagram
+ * @param len its size
+ * @param dst destination of the payload
+ * @param room the bytes that 'dst' holds
+ * @return the bytes placed in 'dst', 0 if the datagram is left to _input()
+ */
+static size_t _recv_direct(microtcp_sock_t * __restrict__ sock, const uint8_t * __restrict__ dgram, size_t len,
+						uint8_t * __restrict__ dst, size_t room)
+{
+	microtcp_header_t tcph;
+
+
+	if ( (len <= MICROTCP_HEADER_SIZE) || (sock->state != ESTABLISHED) || (sock->recv_seq != sock->ack_number) )
+		return 0UL;
+
+	memcpy(&tcph, dgram, MICROTCP_HEADER_SIZE);
+	_ntoh_recvd_tcph(tcph, tcph);
+
+	if ( (tcph.data_len != len - MICROTCP_HEADER_SIZE) || (tcph.data_len > room) || (tcph.seq_number != sock->ack_number)
+		|| (tcph.control & (CTRL_FIN | CTRL_SYN | CTRL_RST)) )
+		return 0UL;
+
+	/* 'dst' is left with garbage that the next segment overwrites, _input() drops it */
+	if ( crc32_copy(dst, dgram + MICROTCP_HEADER_SIZE, tcph.data_len) != tcph.checksum )
+		return 0UL;
+
+	++sock->packets_received;
+	_ack_input(sock, &tcph);
+
+	sock->bytes_received += tcph.data_len;
+	sock->bytes_direct   += tcph.data_len;
+	sock->ack_number     += tcph.data_len;
+	sock->recv_seq       += tcph.data_len;
+	sock->recv_head       = (sock->recv_head + tcph.data_len) & (sock->recvbuf_len - 1UL);
+
+	_update_recv_buf(sock);  // the hole may have been filled
+
+	/* not held back until the batch is drained, the ACKs clock out the next window */
+	_ack_segment(sock, (tcph.control & CTRL_PSH) || (sock->ack_number != sock->recv_seq));
+	_tx_flush(sock);
+
+	return tcph.data_len;
+}
+
+/**
+ * @return whether datagrams that were already received wait to be handled (without
+ * a syscall)
+ */
+static int _rx_queued(const microtcp_sock_t * sock)
+{
+	if ( sock->flow )
+		return __atomic_load_n(&sock->rxb->head, __ATOMIC_ACQUIRE) - sock->rxb->tail > sock->rxb->held;
+
+	return !sock->uring && (sock->rxb->pos < sock->rxb->cnt);
+}
+
+/**
+ * @brief Handles a datagram of a connection: ACKs feed the sender, data is reassembled
+ * in 'recvbuf' until microtcp_recv() picks it up, the FIN of the peer is answered
+ * and marks the end of the stream once the data in front of it is delivered.
+ */
+static void _input(microtcp_sock_t * __restrict__ sock, const uint8_t * __restrict__ dgram, size_t len)
+{
+	microtcp_header_t tcph;
+
+
+	if ( len < MICROTCP_HEADER_SIZE )
+		return;
+
+	memcpy(&tcph, dgram, MICROTCP_HEADER_SIZE);
+	_ntoh_recvd_tcph(tcph, tcph);
+
+	++sock->packets_received;
+
+	if ( len - MICROTCP_HEADER_SIZE != tcph.data_len ) {  // mangled header
+
+		++sock->packets_corrupted;
+		return;
+	}
+
+	if ( sock->state == CLOSED )
+		return;
+
+	if ( sock->state >= CLOSING_BY_PEER ) {
+
+		_fin_input(sock, &tcph);
+		return;
+	}
+
+	_ack_input(sock, &tcph);
+
+	if ( tcph.data_len ) {
+
+		/* in-order or not, the segment waits in 'recvbuf' (the checksum is verified there) */
+		if ( SEQ_LEQ(sock->ack_number, tcph.seq_number) && !_recvbuf_store(sock, &tcph, dgram + MICROTCP_HEADER_SIZE) ) {
+
+			sock->bytes_received += tcph.data_len;
+			_update_recv_buf(sock);
+
+			/* delayed only if it just extends the in-order data */
+			_ack_segment(sock, (tcph.control & CTRL_PSH) || (sock->ack_number != tcph.seq_number + tcph.data_len));
+		}
+		else
+			_send_ctrl(sock, CTRL_ACK, sock->seq_number);
+	}
+	else if ( (tcph.control & CTRL_FIN) && (tcph.seq_number == sock->ack_number) ) {  // end of the stream
+
+		sock->ack_number = tcph.seq_number + 1U;
+		sock->fin_rcvd   = 1;
+		_fin_send(sock, SHUTDOWN_SERVER);
+	}
+	else if ( SEQ_LT(tcph.seq_number, sock->ack_number) )  // a zero-window probe, repeat the window
+		_send_ctrl(sock, CTRL_ACK, sock->seq_number);
+}
+
+/**
+ * @brief Does all the work of a socket that does not need the application, without
+ * blocking: handles the datagrams that arrived and the expired timers, transmits what
+ * the window allows and the FIN of a pending shutdown once 'sndbuf' is acknowledged.
+ * 
+ * @return 0 on success or -1 on failure
+ */
+static int _pump(microtcp_sock_t * sock)
+{
+	const uint8_t * dgram;
+	uint8_t nonblock = sock->nonblock;
+	ssize_t ret;
+
+
+	sock->nonblock = 1;  // _recv_timed() fails with EAGAIN once nothing is left
+
+	for ( ;; ) {
+
+		if ( sock->fin_pending && ((sock->state != ESTABLISHED) || _send_done(sock)) ) {
+
+			sock->fin_pending = 0;
+
+			if ( sock->state == ESTABLISHED )  // not if the FIN of the peer came first
+				_fin_send(sock, SHUTDOWN_CLIENT);
+		}
+
+		if ( (ret = _output(sock)) )  // errno is ENOMEM
+			break;
+
+		if ( (ret = _recv_timed(sock, &dgram)) < 0 )
+			break;
+
+		if ( ret )
+			_input(sock, dgram, ret);
+	}
+
+	sock->nonblock = nonblock;
+
+	if ( (errno != EAGAIN) && (errno != EWOULDBLOCK) )
+		return -(EXIT_FAILURE);
+
+	if ( sock->zerocopy )
+		_zc_reap(sock);
+
+	_tx_flush(sock);
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @return the number of bytes that microtcp_recv() would return right away
+ */
+static size_t _recv_avail(const microtcp_sock_t * sock)
+{
+	return (uint32_t)(sock->ack_number - sock->recv_seq) - sock->fin_rcvd;
+}
+
+static void _cleanup();  /** TODO: add to at_exit() - free recvbuf() */
+
+/**
+ * @brief (Re)allocates the receive buffer of a socket with room for 'len' bytes (a
+ * power of 2). 'recvbuf' is followed by the bitmaps of the reassembly buffer. The
+ * window scale that the socket offers follows the size.
+ * 
+ * @param sock a microTCP socket handle, 'recvbuf' is either NULL or empty
+ * @param len size of the buffer in bytes
+ * @return 0 on success, -1 if the memory could not be allocated
+ */
+static int _recvbuf_alloc(microtcp_sock_t * sock, size_t len)
+{
+	uint8_t * buf;
+
+
+	if ( !(buf = (uint8_t *) calloc(1UL, len + BITMAP_LEN(len))) ) {
+
+		errno = ENOMEM;
+		return -(EXIT_FAILURE);
+	}
+
+	free(sock->recvbuf);
+
+	sock->recvbuf     = buf;
+	sock->recvbuf_len = len;
+	sock->recvmap     = buf + len;
+	sock->rcv_wscale  = _wscale(len);
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Completes the negotiation of the window scale with the shift of the SYN of
+ * the peer. Unless both sides offered MICROTCP_OPT_WSCALE, the windows are plain
+ * byte counts and a larger 'recvbuf' is only advertised up to 64 KB.
+ * 
+ * @param sock a microTCP socket handle, 'opts' holds the options of both peers
+ * @param shift the shift of the peer ('future_use1' of its SYN)
+ */
+static void _wscale_negotiated(microtcp_sock_t * sock, uint32_t shift)
+{
+	if ( sock->opts & MICROTCP_OPT_WSCALE ) {
+
+		sock->snd_wscale = (uint8_t)(MIN2(shift, (uint32_t)(MICROTCP_WSCALE_MAX)));
+		return;
+	}
+
+	sock->snd_wscale = sock->rcv_wscale = 0U;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+
+/** TODO: [!] implement byte and packet statistics [!] */
+
+/**
+ * @brief Allocates the buffers of a socket and sets the defaults.
+ * 
+ * @param sock the socket, zeroed
+ * @param rx allocate the receive batch ('rxb') as well
+ * @return 0 on success, else -1 (errno is set to ENOMEM)
+ */
+static int _sock_alloc(microtcp_sock_t * sock, int rx)
+{
+	_recvbuf_alloc(sock, MICROTCP_RECVBUF_LEN);  // 'recvbuf' stays NULL on failure
+	sock->sndbuf  = (uint8_t *) malloc(MICROTCP_SNDBUF_LEN);
+	sock->sendq   = (microtcp_segment_t *) malloc(MICROTCP_SENDQ_INIT_LEN * sizeof(microtcp_segment_t));
+	sock->wheel   = (tw_wheel_t *) malloc(sizeof(tw_wheel_t));
+	sock->txb     = _batch_new(1);
+	sock->rxb     = ( rx ) ? _batch_new(0) : NULL;
+
+	if ( !sock->recvbuf || !sock->sndbuf || !sock->sendq || !sock->wheel || !sock->txb || (rx && !sock->rxb) ) {
+
+		free(sock->recvbuf);
+		free(sock->sndbuf);
+		free(sock->sendq);
+		free(sock->wheel);
+		_batch_free(sock->txb);
+		_batch_free(sock->rxb);
+		errno = ENOMEM;
+
+		return -(EXIT_FAILURE);
+	}
+
+	sock->opts       = MICROTCP_OPT_SACK | MICROTCP_OPT_WSCALE;
+	sock->seq_number = rand();
+	sock->snd_una    = sock->seq_number;
+	sock->snd_end    = sock->seq_number;
+	sock->sndbuf_len = MICROTCP_SNDBUF_LEN;
+	sock->recover    = sock->snd_una;
+	sock->cwnd       = MICROTCP_INIT_CWND;
+	sock->ssthresh   = MICROTCP_INIT_SSTHRESH;
+	sock->cc_state   = SLOW_START;
+	_cc_select(sock, MICROTCP_CC_RENO);
+	sock->rto        = MICROTCP_ACK_TIMEOUT_US;
+	sock->rto_min    = MICROTCP_RTO_MIN_US;
+	sock->rto_max    = MICROTCP_RTO_MAX_US;
+	sock->sendq_cap  = MICROTCP_SENDQ_INIT_LEN;
+
+	tw_init(sock->wheel, US_TO_TICKS(_now_us()));
+	tw_timer_init(&sock->pace_timer, _pace_expired, sock);
+	tw_timer_init(&sock->persist_timer, _persist_expired, sock);
+	tw_timer_init(&sock->delack_timer, _delack_expired, sock);
+
+	return EXIT_SUCCESS;
+}
+
+microtcp_sock_t microtcp_socket(int domain, int type, int protocol)
+{
+	microtcp_sock_t sock;
+	int sockfd;
+
+
+	if ( type != SOCK_DGRAM )
+		LOG_DEBUG("type of socket changed to 'SOCK_DGRAM'\n");
+
+	bzero(&sock, sizeof(sock));
+	srand(time(NULL) + getpid());
+
+	if ( _sock_alloc(&sock, 1) ) {
+
+		sock.sd    = -1;
+		sock.state = CLOSED;
+
+		return sock;
+	}
+
+	check( sockfd = socket(domain, SOCK_DGRAM, protocol ));
+
+	sock.sd = sockfd;
+
+	#ifdef ENABLE_DEBUG_MSG
+	ackbase = sock.seq_number;
+	#endif
+
+
+	return sock;
+}
+
+int microtcp_bind(microtcp_sock_t * __restrict__ socket, const struct sockaddr * __restrict__ address,
+               socklen_t address_len)
+{
+	check( bind(socket->sd, address, address_len) );
+	return EXIT_SUCCESS;
+}
+
+int microtcp_setsockopt(microtcp_sock_t * __restrict__ socket, int optname, const void * __restrict__ optval,
+                 socklen_t optlen)
+{
+	struct sock_txtime txtime = { CLOCK_MONOTONIC, 0U };
+	uint32_t val;
+	uint8_t * buf;
+	size_t len;
+
+
+	if ( !socket || !optval || (optlen != sizeof(uint32_t)) ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	memcpy(&val, optval, sizeof(val));
+
+	switch ( optname ) {
+
+		case MICROTCP_SO_RTO_MIN:
+
+			if ( !val || (val > socket->rto_max) )
+				goto einval;
+
+			socket->rto_min = val;
+			socket->rto     = MAX2(socket->rto, val);
+			break;
+
+		case MICROTCP_SO_RTO_MAX:
+
+			if ( val < socket->rto_min )
+				goto einval;
+
+			socket->rto_max = val;
+			socket->rto     = MIN2(socket->rto, val);
+			break;
+
+		case MICROTCP_SO_ZEROCOPY:
+
+			if ( (val > 1U) || socket->flow || socket->uring )  // the socket of a listener is shared by its connections
+				goto einval;
+
+			if ( setsockopt(socket->sd, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val)) < 0 )
+				return -(EXIT_FAILURE);
+
+			socket->zerocopy = val;
+			break;
+
+		case MICROTCP_SO_NONBLOCK:
+
+			/* connect and accept block regardless, the option applies to established connections */
+			if ( (val > 1U) || (socket->state != ESTABLISHED) || (!val && (socket->watch || socket->fin_pending)) )
+				goto einval;
+
+			socket->nonblock = val;
+			break;
+
+		case MICROTCP_SO_IO_URING:
+
+			/* the handshake reads the socket directly, a loop polls the fd of the backend */
+			if ( (val > 1U) || socket->flow || socket->zerocopy || socket->gso || socket->watch || (socket->state != ESTABLISHED)
+				|| (socket->pacing == MICROTCP_PACING_TXTIME) )
+				goto einval;
+
+			if ( val && !socket->uring )
+				return _uring_new(socket);
+
+			if ( !val )
+				_uring_free(socket);  // the datagrams it holds are lost, and retransmitted
+			break;
+
+		case MICROTCP_SO_GSO:
+
+			/* the receive buffers are switched with no received datagram pending, the handshake is not coalesced */
+			if ( (val > 1U) || socket->flow || socket->uring || (socket->rxb->pos < socket->rxb->cnt) || (socket->state != ESTABLISHED)
+				|| (socket->pacing == MICROTCP_PACING_TXTIME) )
+				goto einval;
+
+			return _gso_set(socket, val);
+
+		case MICROTCP_SO_CONG:
+
+			if ( val >= sizeof(_cc_algs) / sizeof(_cc_algs[0]) )
+				goto einval;
+
+			_cc_select(socket, val);
+			break;
+
+		case MICROTCP_SO_PACING:
+
+			/* a departure time per datagram: no super-datagrams, nor the socket of a listener that its connections share */
+			if ( (val > MICROTCP_PACING_TXTIME) || ((val == MICROTCP_PACING_TXTIME) && (socket->flow || socket->uring || socket->gso)) )
+				goto einval;
+
+			/* SO_TXTIME stays on once set, datagrams without a departure time leave right away */
+			if ( (val == MICROTCP_PACING_TXTIME) && (setsockopt(socket->sd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) < 0) )
+				return -(EXIT_FAILURE);
+
+			socket->pacing       = val;
+			socket->pace_next_us = 0ULL;
+			break;
+
+		case MICROTCP_SO_RCVBUF:
+
+			/* the window scale is offered in the SYN, a listener answers the SYN of its connections */
+			if ( (val < 2U * MICROTCP_MSS) || (val > MICROTCP_RCVBUF_MAX) || (socket->state != INVALID) || socket->flow )
+				goto einval;
+
+			for ( len = 1UL; len < val; len <<= 1 )
+				;
+
+			if ( _recvbuf_alloc(socket, len) )
+				return -(EXIT_FAILURE);
+
+			/* the kernel holds a window of datagrams while we process the previous one (capped by net.core.rmem_max) */
+			val = (uint32_t)(MIN2(2UL * len, (size_t)(INT32_MAX)));
+			(void)(setsockopt(socket->sd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val)));
+			break;
+
+		case MICROTCP_SO_NODELAY:
+
+			if ( val > 1U )
+				goto einval;
+
+			socket->nodelay = val;  // a held segment goes out with the next call on the socket
+			break;
+
+		case MICROTCP_SO_SNDBUF:
+
+			/* the segments in flight point into the buffer */
+			if ( (val < 2U * MICROTCP_MSS) || (val > MICROTCP_SNDBUF_MAX) || !_send_done(socket)
+				|| (socket->state >= CLOSING_BY_PEER) )
+				goto einval;
+
+			for ( len = 1UL; len < val; len <<= 1 )
+				;
+
+			if ( !(buf = (uint8_t *) malloc(len)) ) {
+
+				errno = ENOMEM;
+				return -(EXIT_FAILURE);
+			}
+
+			free(socket->sndbuf);
+			socket->sndbuf     = buf;
+			socket->sndbuf_len = len;
+			break;
+
+		default:
+			goto einval;
+	}
+
+	return EXIT_SUCCESS;
+
+einval:
+	errno = EINVAL;
+	return -(EXIT_FAILURE);
+}
+
+int microtcp_connect(microtcp_sock_t * __restrict__ socket, const struct sockaddr * __restrict__ address,
+                  socklen_t address_len)
+{
+	microtcp_header_t tcph;
+	microtcp_header_t syn;
+	struct pollfd pfd;
+	uint32_t retries;
+	uint64_t sent_us;
+
+
+	if ( !socket ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	check( connect(socket->sd, address, address_len) );
+
+	memset(&syn, 0, sizeof(syn));
+	syn.seq_number  = htonl(socket->seq_number);
+	syn.window      = htons(MIN2(socket->recvbuf_len, (size_t)(UINT16_MAX)));  // never scaled in a SYN
+	syn.control     = htons(CTRL_SYN);
+	syn.future_use0 = htonl(socket->opts);
+	syn.future_use1 = htonl(socket->rcv_wscale);
+
+	pfd.fd     = socket->sd;
+	pfd.events = POLLIN;
+
+	/* the SYN is retransmitted with exponential backoff, e.g. when the socket
+	 * buffer of a busy listener overflows */
+	for ( retries = 0U; ; ++retries ) {
+
+		if ( retries > MICROTCP_SYN_RETRIES ) {
+
+			socket->state = INVALID;
+			errno = ETIMEDOUT;
+
+			return -(EXIT_FAILURE);
+		}
+
+		sent_us = _now_us();
+		check( send(socket->sd, &syn, sizeof(syn), 0) );   // send SYN
+
+		if ( poll(&pfd, 1, (int)(MIN2((uint64_t)(socket->rto) << retries, socket->rto_max) / 1000UL)) > 0 )
+			break;
+	}
+
+	check( recv(socket->sd, &tcph, sizeof(tcph), 0) );   // recv SYNACK
+
+	#ifdef ENABLE_DEBUG_MSG
+	seqbase = ntohl(tcph.seq_number);  // necessary for print_tcp_header()
+	print_tcp_header(socket, &tcph);
+	#endif
+
+	/** SYNACK **/
+	if ( ntohs(tcph.control) != (CTRL_SYN | CTRL_ACK) ) {
+
+		socket->state = INVALID;
+		errno = ECONNABORTED;
+
+		return -(EXIT_FAILURE);
+	}
+
+	++socket->seq_number;
+	socket->snd_una    = socket->seq_number;
+	socket->snd_end    = socket->seq_number;
+	socket->recover    = socket->snd_una;
+	socket->ack_number = ntohl(tcph.seq_number) + 1U;
+	socket->recv_seq   = socket->ack_number;
+	socket->recv_high  = socket->ack_number;
+	socket->sendbuflen = ntohs(tcph.window);
+	socket->opts      &= ntohl(tcph.future_use0);  // keep the options that the peer accepted
+	_wscale_negotiated(socket, ntohl(tcph.future_use1));
+
+	if ( !retries )  // Karn's rule
+		_rtt_sample(socket, (uint32_t)(_now_us() - sent_us));
+
+	memset(&tcph, 0, sizeof(tcph));
+	tcph.seq_number = htonl(socket->seq_number);
+	tcph.ack_number = htonl(socket->ack_number);
+	tcph.control    = htons(CTRL_ACK);
+	tcph.window     = htons(_rcv_wnd(socket));
+
+	check( send(socket->sd, &tcph, sizeof(tcph), 0) );  // send ACK
+	socket->state     = ESTABLISHED;
+
+	// _sock_enable_async(socket);
+
+	LOG_DEBUG("INIT CCONTROL:s.cc: %s, s.cwnd: %ld, s.ssthres: %ld\n",socket->cc->name,socket->cwnd,socket->ssthresh);
+	return EXIT_SUCCESS;
+}
+
+int microtcp_accept(microtcp_sock_t * __restrict__ socket, struct sockaddr * __restrict__ address,
+                 socklen_t address_len)
+{
+	microtcp_header_t tcph;
+	microtcp_header_t synack;
+	struct pollfd pfd;
+	uint32_t retries;
+	uint64_t sent_us;
+	uint16_t ctrl;
+
+
+	if ( socket->state != INVALID )
+		return -(EXIT_FAILURE);
+
+	socket->state   = LISTEN;
+
+	check( recvfrom(socket->sd, &tcph, sizeof(tcph), 0, address, &address_len) );
+	check( connect(socket->sd, address, address_len) );
+
+	#ifdef ENABLE_DEBUG_MSG
+	seqbase = ntohl(tcph.seq_number);  // necessary for print_tcp_header()
+	print_tcp_header(socket, &tcph);
+	#endif
+
+	if ( ntohs(tcph.control) != CTRL_SYN ) {
+
+		socket->state = INVALID;
+		errno = ECONNABORTED;
+
+		return -(EXIT_FAILURE);
+	}
+
+	socket->sendbuflen = ntohs(tcph.window);
+	socket->ack_number = ntohl(tcph.seq_number) + 1U;
+	socket->recv_seq   = socket->ack_number;
+	socket->recv_high  = socket->ack_number;
+	socket->opts      &= ntohl(tcph.future_use0);  // options offered by both peers
+	_wscale_negotiated(socket, ntohl(tcph.future_use1));
+
+	++socket->packets_received;
+	++socket->bytes_received;
+
+	memset(&synack, 0, sizeof(synack));
+	synack.seq_number  = htonl(socket->seq_number);
+	synack.ack_number  = htonl(socket->ack_number);
+	synack.control     = htons(CTRL_ACK | CTRL_SYN);
+	synack.window      = htons(MIN2(socket->recvbuf_len, (size_t)(UINT16_MAX)));
+	synack.future_use0 = htonl(socket->opts);
+	synack.future_use1 = htonl(socket->rcv_wscale);
+
+	pfd.fd     = socket->sd;
+	pfd.events = POLLIN;
+
+	/* the SYN-ACK is retransmitted with exponential backoff like the SYN of
+	 * microtcp_connect(), and at once when the peer repeats its SYN */
+	for ( retries = 0U; ; ++retries ) {
+
+		if ( retries > MICROTCP_SYN_RETRIES ) {
+
+			socket->state = INVALID;
+			errno = ETIMEDOUT;
+
+			return -(EXIT_FAILURE);
+		}
+
+		sent_us = _now_us();
+		check( send(socket->sd, &synack, sizeof(synack), 0) );   // send SYNACK
+
+		if ( poll(&pfd, 1, (int)(MIN2((uint64_t)(socket->rto) << retries, socket->rto_max) / 1000UL)) <= 0 )
+			continue;
+
+		/* peeked, the first data segment may stand in for a lost ACK and is left to microtcp_recv() */
+		check( recv(socket->sd, &tcph, sizeof(tcph), MSG_PEEK) );
+		print_tcp_header(socket, &tcph);
+
+		ctrl = ntohs(tcph.control);
+		if ( ctrl != CTRL_SYN )
+			break;
+
+		check( recv(socket->sd, &tcph, sizeof(tcph), 0) );  // a repeated SYN, our SYN-ACK got lost
+	}
+
+	if ( !(ctrl & CTRL_ACK) || (ntohl(tcph.ack_number) != socket->seq_number + 1U) ) {
+
+		socket->state = INVALID;
+		errno = ECONNABORTED;
+
+		return -(EXIT_FAILURE);
+	}
+
+	if ( (ctrl == CTRL_ACK) && !tcph.data_len )  // the ACK of the handshake, nothing else in it
+		check( recv(socket->sd, &tcph, sizeof(tcph), 0) );
+
+	if ( !retries )  // Karn's rule
+		_rtt_sample(socket, (uint32_t)(_now_us() - sent_us));
+
+	++socket->seq_number;         // ghost-byte
+	socket->snd_una = socket->seq_number;
+	socket->snd_end = socket->seq_number;
+	socket->recover = socket->snd_una;
+	socket->state = ESTABLISHED;
+
+	// _sock_enable_async(socket);
+
+
+	return EXIT_SUCCESS;
+}
+
+int microtcp_shutdown(microtcp_sock_t * socket, int how)
+{
+	const uint8_t * dgram;
+	microtcp_header_t tcph;
+	int64_t ret;
+
+
+	if ( !socket || ((how != SHUTDOWN_CLIENT) && (how != SHUTDOWN_SERVER)) ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	if ( socket->nonblock ) {  // started once, then driven by _pump() until CLOSED
+
+		if ( socket->state < CLOSING_BY_PEER ) {
+
+			if ( socket->state == INVALID ) {
+
+				errno = EINVAL;
+				return -(EXIT_FAILURE);
+			}
+
+			socket->fin_pending = 1;  // sent by _pump() once 'sndbuf' is acknowledged
+		}
+
+		if ( _pump(socket) )
+			return -(EXIT_FAILURE);
+
+		if ( socket->state != CLOSED ) {
+
+			errno = EINPROGRESS;
+			return -(EXIT_FAILURE);
+		}
+	}
+	else {
+
+		/* the data of 'sndbuf' goes first */
+		while ( (socket->state == ESTABLISHED) && !_send_done(socket) ) {
+
+			if ( _output(socket) )
+				return -(EXIT_FAILURE);
+
+			check( ret = _recv_timed(socket, &dgram) );
+
+			if ( ret )
+				_input(socket, dgram, ret);
+		}
+
+		if ( socket->state < CLOSING_BY_PEER )  // microtcp_recv() answers the FIN of the peer by itself
+			_fin_send(socket, how);
+
+		while ( socket->state != CLOSED ) {
+
+			check( ret = _recv_timed(socket, &dgram) );
+
+			if ( ret < (int64_t)(MICROTCP_HEADER_SIZE) )  // timers expired (FIN retransmission, TIME_WAIT)
+				continue;
+
+			memcpy(&tcph, dgram, MICROTCP_HEADER_SIZE);
+			_ntoh_recvd_tcph(tcph, tcph);
+
+			_fin_input(socket, &tcph);
+		}
+	}
+
+	tw_del(socket->wheel, &socket->ctl_timer);
+	_tx_flush(socket);  // the last ACK
+
+	if ( socket->snd_una != socket->seq_number ) {
+
+		errno = ETIMEDOUT;
+		return -(EXIT_FAILURE);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+ssize_t microtcp_send(microtcp_sock_t * __restrict__ socket, const void * __restrict__ buffer, size_t length,
+               int flags)
+{
+	const uint8_t * dgram;
+	size_t copied;
+	size_t len;
+	int64_t ret;
+
+
+	if ( !socket ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	if ( (socket->state == INVALID) || (socket->state >= CLOSING_BY_PEER) || socket->fin_pending ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	/* 'sndbuf' outlives the datagrams that the kernel still holds, it is overwritten
+	 * only after they are acknowledged. Pinning its pages pays off only for large sends */
+	socket->tx_flags = ( socket->zerocopy && (length >= MICROTCP_ZEROCOPY_MIN_LEN) ) ? MSG_ZEROCOPY : 0;
+
+	if ( socket->nonblock && (_sndbuf_room(socket) < length) && _pump(socket) )  // the ACKs that arrived make room
+		return -(EXIT_FAILURE);
+
+	for ( copied = 0UL; ; ) {
+
+		len = MIN2(_sndbuf_room(socket), length - copied);
+		_sndbuf_write(socket, (const uint8_t *)(buffer) + copied, len);
+		copied += len;
+
+		if ( (copied == length) || socket->nonblock )
+			break;
+
+		/* the buffer is full, wait for the ACKs that make room */
+		if ( _output(socket) )
+			return -(EXIT_FAILURE);
+
+		check( ret = _recv_timed(socket, &dgram) );
+
+		if ( ret )
+			_input(socket, dgram, ret);
+
+		if ( socket->state != ESTABLISHED ) {  // the peer closed the connection
+
+			errno = EPIPE;
+			return -(EXIT_FAILURE);
+		}
+	}
+
+	/* what the window allows goes out now, the rest with the later calls */
+	if ( _pump(socket) )
+		return -(EXIT_FAILURE);
+
+	if ( !copied && length ) {
+
+		errno = EAGAIN;
+		return -(EXIT_FAILURE);
+	}
+
+	return copied;
+}
+
+ssize_t microtcp_recv(microtcp_sock_t * __restrict__ socket, void * __restrict__ buffer, size_t length, int flags)
+{
+	const uint8_t * dgram;
+	int64_t total_bytes_read;
+	int64_t ret;
+	size_t len;
+
+
+	if ( !socket ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	if ( (socket->state == INVALID) || ((socket->state >= CLOSING_BY_PEER) && !socket->fin_rcvd) ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	total_bytes_read = 0L;
+
+	if ( socket->nonblock ) {  // whatever is buffered, up to 'length'
+
+		if ( _pump(socket) )
+			return -(EXIT_FAILURE);
+
+		if ( _recv_avail(socket) ) {
+
+			total_bytes_read = _recvbuf_pop(socket, (uint8_t *)(buffer), length);
+			_rcv_wnd_update(socket);
+		}
+
+		if ( !total_bytes_read && !socket->fin_rcvd && length ) {
+
+			errno = EAGAIN;
+			return -(EXIT_FAILURE);
+		}
+
+		return total_bytes_read;  // 0 at the end of the stream
+	}
+
+	/* Blocks until some data is in order, then returns it along with whatever the
+	 * datagrams that were already received add, up to 'length' bytes. The stream
+	 * keeps no message boundaries, the rest of a segment waits for the next call */
+	for ( ;; ) {
+
+		if ( _recv_avail(socket) ) {  // reassembled in 'recvbuf'
+
+			total_bytes_read += _recvbuf_pop(socket, (uint8_t *)(buffer) + total_bytes_read, length - total_bytes_read);
+			_rcv_wnd_update(socket);
+		}
+
+		if ( (total_bytes_read == (int64_t)(length)) || (total_bytes_read && !_rx_queued(socket)) )
+			break;
+
+		if ( socket->fin_rcvd ) {  // termination, every byte in front of the FIN is delivered
+
+			if ( total_bytes_read )
+				break;
+
+			microtcp_shutdown(socket, SHUTDOWN_SERVER);
+			return -1L;
+		}
+
+		if ( !_send_done(socket) && _output(socket) )  // the data of earlier microtcp_send() calls
+			return -(EXIT_FAILURE);
+
+		check( ret = _recv_timed(socket, &dgram) );
+
+		if ( !ret )  // timers expired
+			continue;
+
+		/* in-order segment with nothing buffered in front of it, bypass 'recvbuf' */
+		if ( (len = _recv_direct(socket, dgram, ret, (uint8_t *)(buffer) + total_bytes_read, length - total_bytes_read)) )
+			total_bytes_read += len;
+		else
+			_input(socket, dgram, ret);
+	}
+
+	_tx_flush(socket);  // ACKs of out-of-order segments that are still queued
+
+
+	return total_bytes_read;
+}
+
+
+/**
+ * @brief Hashes the address of a peer (IPv4 or IPv6 address and port).
+ */
+static uint64_t _peer_hash(const struct sockaddr * peer, uint64_t seed)
+{
+	const struct sockaddr_in6 * sin6;
+	const struct sockaddr_in * sin;
+	uint64_t h = seed;
+	uint64_t w;
+	int i;
+
+
+	if ( peer->sa_family == AF_INET6 ) {
+
+		sin6 = (const struct sockaddr_in6 *) peer;
+
+		for ( i = 0; i < 2; ++i ) {
+
+			memcpy(&w, sin6->sin6_addr.s6_addr + 8 * i, sizeof(w));
+			h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+			h ^= h >> 29;
+		}
+
+		h ^= sin6->sin6_port;
+	}
+	else {
+
+		sin = (const struct sockaddr_in *) peer;
+		h ^= ((uint64_t)(sin->sin_addr.s_addr) << 16) | sin->sin_port;
+	}
+
+	h *= 0x9E3779B97F4A7C15ULL;
+
+	return h ^ (h >> 32);
+}
+
+static int _peer_eq(const struct sockaddr * a, const struct sockaddr * b)
+{
+	const struct sockaddr_in6 * a6 = (const struct sockaddr_in6 *) a;
+	const struct sockaddr_in6 * b6 = (const struct sockaddr_in6 *) b;
+	const struct sockaddr_in * a4 = (const struct sockaddr_in *) a;
+	const struct sockaddr_in * b4 = (const struct sockaddr_in *) b;
+
+
+	if ( a->sa_family != b->sa_family )
+		return 0;
+
+	if ( a->sa_family == AF_INET6 )
+		return (a6->sin6_port == b6->sin6_port) && !memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr));
+
+	return (a4->sin_port == b4->sin_port) && (a4->sin_addr.s_addr == b4->sin_addr.s_addr);
+}
+
+static struct microtcp_flow * _flow_lookup(struct microtcp_listener * l, const struct sockaddr * peer, uint64_t hash)
+{
+	struct microtcp_flow * f;
+
+
+	for ( f = l->buckets[hash & (l->nbuckets - 1UL)]; f; f = f->next )
+		if ( (f->hash == hash) && _peer_eq((const struct sockaddr *) &f->peer, peer) )
+			return f;
+
+	return NULL;
+}
+
+/**
+ * @brief Inserts a flow in the hash table, the table doubles once it holds as
+ * many flows as buckets.
+ */
+static void _flow_insert(struct microtcp_listener * l, struct microtcp_flow * f)
+{
+	struct microtcp_flow ** nb;
+	struct microtcp_flow * g;
+	size_t i;
+
+
+	if ( (l->nflows >= l->nbuckets) && (nb = (struct microtcp_flow **) calloc(2UL * l->nbuckets, sizeof(*nb))) ) {
+
+		for ( i = 0UL; i < l->nbuckets; ++i )
+			while ( (g = l->buckets[i]) ) {
+
+				l->buckets[i] = g->next;
+				g->next = nb[g->hash & (2UL * l->nbuckets - 1UL)];
+				nb[g->hash & (2UL * l->nbuckets - 1UL)] = g;
+			}
+
+		free(l->buckets);
+		l->buckets  = nb;
+		l->nbuckets = 2UL * l->nbuckets;
+	}
+
+	f->next = l->buckets[f->hash & (l->nbuckets - 1UL)];
+	l->buckets[f->hash & (l->nbuckets - 1UL)] = f;
+	++l->nflows;
+}
+
+static void _flow_syn_unlink(struct microtcp_listener * l, struct microtcp_flow * f)
+{
+	if ( !f->syn_pprev )
+		return;
+
+	if ( (*f->syn_pprev = f->syn_next) )
+		f->syn_next->syn_pprev = f->syn_pprev;
+	else
+		l->syn_tail = f->syn_pprev;
+
+	f->syn_pprev = NULL;
+	--l->syn_len;
+}
+
+static void _flow_remove(struct microtcp_listener * l, struct microtcp_flow * f)
+{
+	struct microtcp_flow ** pp;
+
+
+	for ( pp = &l->buckets[f->hash & (l->nbuckets - 1UL)]; *pp; pp = &(*pp)->next )
+		if ( *pp == f ) {
+
+			*pp = f->next;
+			--l->nflows;
+			break;
+		}
+
+	_flow_syn_unlink(l, f);
+}
+
+static void _flow_free(struct microtcp_flow * f)
+{
+	if ( f->evfd >= 0 )
+		close(f->evfd);
+
+	_batch_free(f->q);
+	free(f);
+}
+
+static struct microtcp_flow * _flow_new(struct microtcp_listener * l, const struct sockaddr * peer,
+						socklen_t peer_len, uint64_t hash)
+{
+	struct microtcp_flow * f;
+
+
+	if ( !(f = (struct microtcp_flow *) calloc(1UL, sizeof(*f))) )
+		return NULL;
+
+	f->evfd = eventfd(0U, EFD_NONBLOCK | EFD_CLOEXEC);
+	f->q    = _batch_new(0);
+
+	if ( (f->evfd < 0) || !f->q ) {
+
+		_flow_free(f);
+		return NULL;
+	}
+
+	memcpy(&f->peer, peer, peer_len);
+	f->peer_len = peer_len;
+	f->hash     = hash;
+	f->listener = l;
+	f->state    = FLOW_SYN_RCVD;
+	f->iss      = rand();
+
+	return f;
+}
+
+static void _flow_send_synack(struct microtcp_listener * l, struct microtcp_flow * f)
+{
+	microtcp_header_t tcph;
+
+
+	memset(&tcph, 0, sizeof(tcph));
+	tcph.seq_number  = htonl(f->iss);
+	tcph.ack_number  = htonl(f->irs + 1U);
+	tcph.control     = htons(CTRL_ACK | CTRL_SYN);
+	tcph.window      = htons(MIN2(MICROTCP_RECVBUF_LEN, UINT16_MAX));
+	tcph.future_use0 = htonl(f->opts);
+	tcph.future_use1 = htonl( (f->opts & MICROTCP_OPT_WSCALE) ? _wscale(MICROTCP_RECVBUF_LEN) : 0U );
+
+	f->synack_us = _now_us();
+	sendto(l->sd, &tcph, sizeof(tcph), 0, (const struct sockaddr *) &f->peer, f->peer_len);
+}
+
+/**
+ * @brief Drops the half-open flows whose handshake did not complete in time,
+ * oldest first.
+ */
+static void _listener_reap(struct microtcp_listener * l)
+{
+	struct microtcp_flow * f;
+	uint64_t now = _now_us();
+
+
+	while ( (f = l->syn_head) && (now - f->synack_us > MICROTCP_SYN_RCVD_TIMEOUT_US) ) {
+
+		_flow_remove(l, f);
+		_flow_free(f);
+	}
+}
+
+/**
+ * @brief Steers the i-th datagram of the batch of the listener: datagrams of
+ * known flows are enqueued to them, the 3-way handshake of new flows is carried
+ * out here. Called with the lock of the listener held.
+ */
+static void _listener_dispatch(struct microtcp_listener * l, unsigned int i)
+{
+	struct microtcp_batch * rxb = l->rxb;
+	const struct sockaddr * peer = (const struct sockaddr *) &l->names[i];
+	struct microtcp_flow * f;
+	microtcp_header_t tcph;
+	uint8_t * slot;
+	uint64_t hash;
+	unsigned int len = rxb->msgs[i].msg_len;
+
+
+	if ( len < MICROTCP_HEADER_SIZE )
+		goto drop;
+
+	memcpy(&tcph, rxb->slot[i], MICROTCP_HEADER_SIZE);
+	_ntoh_recvd_tcph(tcph, tcph);
+
+	hash = _peer_hash(peer, l->seed);
+
+	if ( !(f = _flow_lookup(l, peer, hash)) ) {
+
+		if ( tcph.control != CTRL_SYN )
+			goto drop;
+
+		if ( l->syn_len + l->aq_len >= l->backlog )
+			_listener_reap(l);
+
+		if ( (l->syn_len + l->aq_len >= l->backlog) || !(f = _flow_new(l, peer, rxb->msgs[i].msg_hdr.msg_namelen, hash)) )
+			goto drop;
+
+		f->irs      = tcph.seq_number;
+		f->opts        = (MICROTCP_OPT_SACK | MICROTCP_OPT_WSCALE) & tcph.future_use0;  // options offered by both peers
+		f->peer_win    = tcph.window;
+		f->peer_wscale = (uint8_t)(MIN2(tcph.future_use1, (uint32_t)(MICROTCP_WSCALE_MAX)));
+
+		_flow_insert(l, f);
+
+		f->syn_pprev = l->syn_tail;
+		*l->syn_tail = f;
+		l->syn_tail  = &f->syn_next;
+		++l->syn_len;
+
+		_flow_send_synack(l, f);
+		return;
+	}
+
+	if ( f->state == FLOW_SYN_RCVD ) {
+
+		if ( tcph.control == CTRL_SYN ) {  // our SYN-ACK got lost
+
+			_flow_send_synack(l, f);
+			return;
+		}
+
+		if ( !(tcph.control & CTRL_ACK) || (tcph.ack_number != f->iss + 1U) )
+			goto drop;
+
+		/* established, the ACK may already carry data */
+		f->rtt   = (uint32_t)(_now_us() - f->synack_us);
+		f->state = FLOW_QUEUED;
+
+		_flow_syn_unlink(l, f);
+
+		f->aq_next   = NULL;
+		*l->aq_tail  = f;
+		l->aq_tail   = &f->aq_next;
+		++l->aq_len;
+		l->aq_notify = 1;
+		pthread_cond_signal(&l->acceptable);
+
+		if ( !tcph.data_len && (tcph.control == CTRL_ACK) )
+			return;
+	}
+
+	if ( f->q->head - __atomic_load_n(&f->q->tail, __ATOMIC_ACQUIRE) >= MICROTCP_BATCH_LEN )
+		goto drop;  // the connection falls behind, as a full socket buffer would
+
+	/* the slot changes hands instead of being copied, the one that the connection
+	 * released at 'head' takes its place in our batch */
+	slot = f->q->slot[f->q->head % MICROTCP_BATCH_LEN];
+	f->q->slot[f->q->head % MICROTCP_BATCH_LEN] = rxb->slot[i];
+	f->q->msgs[f->q->head % MICROTCP_BATCH_LEN].msg_len = len;
+	rxb->slot[i]             = slot;
+	rxb->iov[2 * i].iov_base = slot;
+	__atomic_store_n(&f->q->head, f->q->head + 1U, __ATOMIC_RELEASE);
+
+	if ( !f->notify ) {
+
+		f->notify = 1;
+		l->touched[l->ntouched++] = f;
+	}
+
+	return;
+
+drop:
+	++l->dropped;
+}
+
+static void * _listener_main(void * arg)
+{
+	struct microtcp_listener * l = (struct microtcp_listener *) arg;
+	struct microtcp_flow * f;
+	uint64_t ev = 1UL;
+	unsigned int i;
+	int ret;
+
+
+	for ( ;; ) {
+
+		for ( i = 0U; i < MICROTCP_BATCH_LEN; ++i )
+			l->rxb->msgs[i].msg_hdr.msg_namelen = sizeof(l->names[i]);
+
+		ret = recvmmsg(l->sd, l->rxb->msgs, MICROTCP_BATCH_LEN, MSG_WAITFORONE, NULL);
+
+		if ( __atomic_load_n(&l->closing, __ATOMIC_ACQUIRE) )
+			break;
+
+		if ( ret <= 0 )
+			continue;  // e.g. ICMP errors of a peer that went away
+
+		pthread_mutex_lock(&l->lock);
+
+		for ( i = 0U; i < (unsigned int)(ret); ++i )
+			_listener_dispatch(l, i);
+
+		/* one wake up per flow and batch */
+		for ( i = 0U; i < l->ntouched; ++i ) {
+
+			f = l->touched[i];
+			f->notify = 0;
+
+			if ( write(f->evfd, &ev, sizeof(ev)) < 0 )
+				LOG_DEBUG("eventfd write failed\n");
+		}
+
+		l->ntouched = 0U;
+
+		if ( l->aq_notify && (write(l->aq_evfd, &ev, sizeof(ev)) < 0) )
+			LOG_DEBUG("eventfd write failed\n");
+
+		l->aq_notify = 0;
+
+		pthread_mutex_unlock(&l->lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Creates a listener, with 'reuseport' set its socket joins the
+ * SO_REUSEPORT group of the port (the shards of a server).
+ */
+static struct microtcp_listener * _listen(int domain, const struct sockaddr * __restrict__ address, socklen_t address_len,
+					int backlog, int reuseport)
+{
+	struct microtcp_listener * l;
+	unsigned int i;
+	int rcvbuf;
+
+
+	if ( !address ) {
+
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ( !(l = (struct microtcp_listener *) calloc(1UL, sizeof(*l))) ) {
+
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	srand(time(NULL) + getpid());
+
+	l->seed     = ((uint64_t)(rand()) << 32) ^ (uint64_t)(rand()) ^ _now_us();
+	l->backlog  = ( backlog > 0 ) ? (size_t)(backlog) : MICROTCP_LISTEN_BACKLOG;
+	l->nbuckets = MICROTCP_LISTEN_BUCKETS;
+	l->buckets  = (struct microtcp_flow **) calloc(l->nbuckets, sizeof(*l->buckets));
+	l->rxb      = _batch_new(0);
+	l->syn_tail = &l->syn_head;
+	l->aq_tail  = &l->aq_head;
+	l->aq_evfd  = eventfd(0U, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if ( !l->buckets || !l->rxb || (l->aq_evfd < 0) ) {
+
+		if ( l->aq_evfd >= 0 )
+			close(l->aq_evfd);
+
+		free(l->buckets);
+		_batch_free(l->rxb);
+		free(l);
+		errno = ENOMEM;
+
+		return NULL;
+	}
+
+	for ( i = 0U; i < MICROTCP_BATCH_LEN; ++i )
+		l->rxb->msgs[i].msg_hdr.msg_name = &l->names[i];
+
+	pthread_mutex_init(&l->lock, NULL);
+	pthread_cond_init(&l->acceptable, NULL);
+
+	rcvbuf = MICROTCP_LISTEN_RCVBUF;  // all the connections share it (capped by net.core.rmem_max)
+
+	if ( ((l->sd = socket(domain, SOCK_DGRAM, 0)) < 0)
+		|| (reuseport && (setsockopt(l->sd, SOL_SOCKET, SO_REUSEPORT, &reuseport, sizeof(reuseport)) < 0))
+		|| (bind(l->sd, address, address_len) < 0)
+		|| (setsockopt(l->sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0)
+		|| (errno = pthread_create(&l->thread, NULL, _listener_main, l)) ) {
+
+		if ( l->sd >= 0 )
+			close(l->sd);
+
+		close(l->aq_evfd);
+		free(l->buckets);
+		_batch_free(l->rxb);
+		free(l);
+
+		return NULL;
+	}
+
+
+	return l;
+}
+
+microtcp_listener_t * microtcp_listen(int domain, const struct sockaddr * __restrict__ address, socklen_t address_len,
+					int backlog)
+{
+	return _listen(domain, address, address_len, backlog, 0);
+}
+
+int microtcp_listener_accept(microtcp_listener_t * __restrict__ listener, microtcp_sock_t * __restrict__ socket,
+					struct sockaddr * __restrict__ address, socklen_t * __restrict__ address_len)
+{
+	struct microtcp_flow * f;
+	unsigned int i;
+	uint64_t ev;
+
+
+	if ( !listener || !socket ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	bzero(socket, sizeof(*socket));
+	socket->sd    = -1;
+	socket->state = CLOSED;
+
+	pthread_mutex_lock(&listener->lock);
+
+	while ( !listener->aq_head && !listener->closing && !listener->draining && !listener->nonblock )
+		pthread_cond_wait(&listener->acceptable, &listener->lock);
+
+	if ( listener->closing || listener->draining ) {
+
+		pthread_mutex_unlock(&listener->lock);
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	if ( !(f = listener->aq_head) ) {  // non-blocking
+
+		/* cleared under the lock, the next connection signals it anew */
+		if ( read(listener->aq_evfd, &ev, sizeof(ev)) < 0 )
+			LOG_DEBUG("eventfd read failed\n");
+
+		pthread_mutex_unlock(&listener->lock);
+		errno = EAGAIN;
+		return -(EXIT_FAILURE);
+	}
+
+	if ( !(listener->aq_head = f->aq_next) )
+		listener->aq_tail = &listener->aq_head;
+
+	--listener->aq_len;
+	f->state = FLOW_ACCEPTED;
+
+	pthread_mutex_unlock(&listener->lock);
+
+	if ( _sock_alloc(socket, 0) ) {
+
+		pthread_mutex_lock(&listener->lock);
+		_flow_remove(listener, f);
+		pthread_mutex_unlock(&listener->lock);
+		_flow_free(f);
+
+		return -(EXIT_FAILURE);
+	}
+
+	/* the socket of the listener is not connected, every datagram is addressed */
+	for ( i = 0U; i < MICROTCP_BATCH_LEN; ++i ) {
+
+		socket->txb->msgs[i].msg_hdr.msg_name    = &f->peer;
+		socket->txb->msgs[i].msg_hdr.msg_namelen = f->peer_len;
+	}
+
+	socket->sd         = listener->sd;
+	socket->flow       = f;
+	socket->rxb        = f->q;
+	socket->opts       = f->opts;
+	_wscale_negotiated(socket, f->peer_wscale);
+	socket->seq_number = f->iss + 1U;  // ghost-byte
+	socket->snd_una    = socket->seq_number;
+	socket->snd_end    = socket->seq_number;
+	socket->recover    = socket->snd_una;
+	socket->ack_number = f->irs + 1U;
+	socket->recv_seq   = socket->ack_number;
+	socket->recv_high  = socket->ack_number;
+	socket->sendbuflen = f->peer_win;
+	socket->state      = ESTABLISHED;
+
+	++socket->packets_received;
+	++socket->bytes_received;
+
+	_rtt_sample(socket, f->rtt);
+
+	if ( address && address_len ) {
+
+		memcpy(address, &f->peer, MIN2(*address_len, f->peer_len));
+		*address_len = f->peer_len;
+	}
+
+
+	return EXIT_SUCCESS;
+}
+
+int microtcp_listener_close(microtcp_listener_t * listener)
+{
+	struct microtcp_flow * f;
+	size_t i;
+
+
+	if ( !listener ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	/* wake up the thread of the listener and the threads blocked in accept */
+	__atomic_store_n(&listener->closing, 1, __ATOMIC_RELEASE);
+	shutdown(listener->sd, SHUT_RDWR);
+
+	pthread_mutex_lock(&listener->lock);
+	pthread_cond_broadcast(&listener->acceptable);
+	pthread_mutex_unlock(&listener->lock);
+
+	pthread_join(listener->thread, NULL);
+
+	/* flows that were never accepted */
+	for ( i = 0UL; i < listener->nbuckets; ++i )
+		while ( (f = listener->buckets[i]) ) {
+
+			listener->buckets[i] = f->next;
+
+			if ( f->state != FLOW_ACCEPTED )
+				_flow_free(f);
+			else
+				f->listener = NULL;
+		}
+
+	close(listener->sd);
+	close(listener->aq_evfd);
+	pthread_mutex_destroy(&listener->lock);
+	pthread_cond_destroy(&listener->acceptable);
+	free(listener->buckets);
+	_batch_free(listener->rxb);
+	free(listener);
+
+
+	return EXIT_SUCCESS;
+}
+
+int microtcp_pool_stats(microtcp_pool_stats_t * stats)
+{
+	if ( !stats ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	pthread_mutex_lock(&_seg_pool.lock);
+
+	stats->slot_len   = _seg_pool.size;
+	stats->slots      = _seg_pool.total;
+	stats->in_use     = _seg_pool.out;
+	stats->high_water = _seg_pool.out_max;
+	stats->chunks     = _seg_pool.chunks;
+
+	pthread_mutex_unlock(&_seg_pool.lock);
+
+
+	return EXIT_SUCCESS;
+}
+
+int microtcp_close(microtcp_sock_t * socket)
+{
+	struct microtcp_flow * f;
+
+
+	if ( !socket ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	if ( socket->watch )
+		microtcp_loop_del(socket->watch->loop, socket);
+
+	if ( (f = socket->flow) ) {
+
+		if ( f->listener ) {
+
+			pthread_mutex_lock(&f->listener->lock);
+			_flow_remove(f->listener, f);
+			pthread_mutex_unlock(&f->listener->lock);
+		}
+
+		_flow_free(f);  // frees 'rxb' as well
+		socket->rxb = NULL;
+	}
+	else if ( socket->sd >= 0 )
+		close(socket->sd);
+
+	_uring_free(socket);
+
+	free(socket->recvbuf);
+	free(socket->sndbuf);
+	free(socket->sendq);
+	free(socket->wheel);
+	_batch_free(socket->txb);
+	_batch_free(socket->rxb);
+	free(socket->gro_buf);
+
+	socket->recvbuf = NULL;
+	socket->sndbuf  = NULL;
+	socket->sendq   = NULL;
+	socket->wheel   = NULL;
+	socket->txb     = NULL;
+	socket->gro_buf = NULL;
+	socket->flow    = NULL;
+	socket->sd      = -1;
+	socket->state   = CLOSED;
+
+
+	return EXIT_SUCCESS;
+}
+
+
+/**
+ * @brief Makes the threads blocked in (and the later calls of) microtcp_listener_accept()
+ * fail, while the thread of the listener keeps serving the accepted connections.
+ */
+static void _listener_drain(struct microtcp_listener * l)
+{
+	pthread_mutex_lock(&l->lock);
+	l->draining = 1;
+	pthread_cond_broadcast(&l->acceptable);
+	pthread_mutex_unlock(&l->lock);
+}
+
+/**
+ * @return the idx-th (modulo their number) CPU that the process may run on, or -1
+ */
+static int _shard_cpu(int idx)
+{
+	cpu_set_t set;
+	int cpu;
+	int n;
+
+
+	if ( sched_getaffinity(0, sizeof(set), &set) || !(n = CPU_COUNT(&set)) )
+		return -1;
+
+	idx %= n;
+
+	for ( cpu = 0; cpu < CPU_SETSIZE; ++cpu )
+		if ( CPU_ISSET(cpu, &set) && !idx-- )
+			return cpu;
+
+	return -1;
+}
+
+static void * _shard_main(void * arg)
+{
+	struct microtcp_shard * sh = (struct microtcp_shard *) arg;
+	struct microtcp_server * srv = sh->server;
+	microtcp_sock_t sock;
+	cpu_set_t set;
+
+
+	if ( sh->cpu >= 0 ) {
+
+		CPU_ZERO(&set);
+		CPU_SET(sh->cpu, &set);
+
+		if ( pthread_setaffinity_np(pthread_self(), sizeof(set), &set) ) {
+
+			LOG_DEBUG("shard %d could not be pinned to CPU %d\n", sh->idx, sh->cpu);
+			sh->cpu = -1;
+		}
+	}
+
+	/* created after the pinning, the thread of the listener shares the CPU of the shard */
+	if ( !(sh->listener = _listen(srv->domain, srv->address, srv->address_len, 0, 1)) )
+		sh->err = errno;
+
+	pthread_mutex_lock(&srv->lock);
+	++srv->nstarted;
+	pthread_cond_signal(&srv->started);
+	pthread_mutex_unlock(&srv->lock);
+
+	if ( !sh->listener )
+		return NULL;
+
+	while ( !microtcp_listener_accept(sh->listener, &sock, NULL, NULL) ) {
+
+		srv->handler(&sock, sh->idx, srv->arg);
+		microtcp_close(&sock);
+		++sh->served;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Stops the shards that got started: no shard closes its socket before every
+ * shard is done, a shrinking SO_REUSEPORT group would steer the remaining flows
+ * to the wrong sockets. The shards have to be past their start up.
+ */
+static void _server_stop(struct microtcp_server * srv, int nthreads)
+{
+	int i;
+
+
+	for ( i = 0; i < nthreads; ++i )
+		if ( srv->shards[i].listener )
+			_listener_drain(srv->shards[i].listener);
+
+	for ( i = 0; i < nthreads; ++i )
+		pthread_join(srv->shards[i].thread, NULL);
+
+	for ( i = 0; i < nthreads; ++i )
+		if ( srv->shards[i].listener ) {
+
+			LOG_DEBUG("shard %d (CPU %d) served %lu connections\n", i, srv->shards[i].cpu,
+					(unsigned long) srv->shards[i].served);
+			microtcp_listener_close(srv->shards[i].listener);
 		}
+
+	pthread_mutex_destroy(&srv->lock);
+	pthread_cond_destroy(&srv->started);
+	free(srv->shards);
+	free(srv);
+}
+
+microtcp_server_t * microtcp_server_start(int domain, const struct sockaddr * __restrict__ address,
+					socklen_t address_len, int nshards, microtcp_handler_t handler, void * arg)
+{
+	struct microtcp_server * srv;
+	int err = 0;
+	int i;
+	int j;
+
+
+	if ( !address || !handler ) {
+
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ( (nshards <= 0) && ((nshards = sysconf(_SC_NPROCESSORS_ONLN)) <= 0) )
+		nshards = 1;
+
+	if ( !(srv = (struct microtcp_server *) calloc(1UL, sizeof(*srv)))
+		|| !(srv->shards = (struct microtcp_shard *) calloc(nshards, sizeof(*srv->shards))) ) {
+
+		free(srv);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	srv->domain      = domain;
+	srv->address     = address;
+	srv->address_len = address_len;
+	srv->handler     = handler;
+	srv->arg         = arg;
+	srv->nshards     = nshards;
+
+	pthread_mutex_init(&srv->lock, NULL);
+	pthread_cond_init(&srv->started, NULL);
+
+	for ( i = 0; i < nshards; ++i ) {
+
+		srv->shards[i].server = srv;
+		srv->shards[i].idx    = i;
+		srv->shards[i].cpu    = _shard_cpu(i);
+
+		if ( (err = pthread_create(&srv->shards[i].thread, NULL, _shard_main, &srv->shards[i])) )
+			break;
+	}
+
+	/* every socket has to be in the SO_REUSEPORT group before the first peer arrives,
+	 * a growing group would steer established flows to other shards as well */
+	pthread_mutex_lock(&srv->lock);
+	while ( srv->nstarted < i )
+		pthread_cond_wait(&srv->started, &srv->lock);
+	pthread_mutex_unlock(&srv->lock);
+
+	for ( j = 0; !err && (j < i); ++j )
+		err = srv->shards[j].err;
+
+	if ( err ) {
+
+		_server_stop(srv, i);
+		errno = err;
+
+		return NULL;
+	}
+
+	srv->address = NULL;
+
+
+	return srv;
+}
+
+int microtcp_server_stop(microtcp_server_t * server)
+{
+	if ( !server ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
 	}
 
-	_timeout(sockfd, TIOUT_DISABLE);
+	_server_stop(server, server->nshards);
 
 
 	return EXIT_SUCCESS;
 }
 
-ssize_t microtcp_recv(microtcp_sock_t * __restrict__ socket, void * __restrict__ buffer, size_t length, int flags)
+
+static struct microtcp_watch * _watch_add(struct microtcp_loop * loop, int fd)
 {
-	uint8_t tbuff[MICROTCP_MSS + MICROTCP_HEADER_SIZE];
-	microtcp_header_t tcph;
+	struct microtcp_watch * w;
+	struct epoll_event ev;
 
-	int64_t total_bytes_read;
-	int64_t bytes_read;
 
-	int sockfd;
-	int frag;
+	if ( !(w = (struct microtcp_watch *) calloc(1UL, sizeof(*w))) ) {
 
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	ev.events   = EPOLLIN;
+	ev.data.ptr = w;
+
+	if ( epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0 ) {
+
+		free(w);
+		return NULL;
+	}
+
+	w->loop = loop;
+	w->fd   = fd;
+	w->io   = 1;  // whatever arrived before the registration
+	w->next = loop->watches;
+	loop->watches = w;
+
+	return w;
+}
+
+static void _watch_del(struct microtcp_loop * loop, struct microtcp_watch * w)
+{
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+
+	w->removed    = 1;
+	loop->removed = 1;
+}
+
+/**
+ * @brief Reports a socket to its callback: data to read (or the end of the stream),
+ * room in the send buffer, the end of the connection (once).
+ * 
+ * @return whether the callback ran
+ */
+static int _watch_dispatch(struct microtcp_watch * w, uint64_t now)
+{
+	microtcp_sock_t * sock = w->sock;
+	uint32_t ev = 0U;
+
+
+	if ( w->io || (tw_next(sock->wheel) <= now) ) {
+
+		w->io = 0;
+
+		if ( (sock->state != CLOSED) && _pump(sock) )
+			sock->state = INVALID;
+	}
+
+	if ( (sock->state == CLOSED) || (sock->state == INVALID) ) {
+
+		if ( !w->closed ) {
+
+			w->closed = 1;
+			ev |= MICROTCP_EV_CLOSED;
+		}
+	}
+	else if ( (sock->state == ESTABLISHED) && !sock->fin_pending && _sndbuf_room(sock) )
+		ev |= MICROTCP_EV_WRITABLE;
+
+	if ( _recv_avail(sock) || sock->fin_rcvd )
+		ev |= MICROTCP_EV_READABLE;
+
+	ev &= w->events | MICROTCP_EV_CLOSED;
+
+	if ( !ev )
+		return 0;
+
+	w->cb(w->loop, sock, ev, w->arg);
+
+	return 1;
+}
+
+microtcp_loop_t * microtcp_loop_new(void)
+{
+	struct microtcp_loop * loop;
+
+
+	if ( !(loop = (struct microtcp_loop *) calloc(1UL, sizeof(*loop))) ) {
+
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if ( (loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ) {
+
+		free(loop);
+		return NULL;
+	}
+
+
+	return loop;
+}
+
+int microtcp_loop_add(microtcp_loop_t * __restrict__ loop, microtcp_sock_t * __restrict__ socket, uint32_t events,
+					microtcp_event_cb_t cb, void * arg)
+{
+	struct microtcp_watch * w;
+	int fd;
 
-	if ( !socket ) {
+
+	if ( !loop || !socket || !cb || socket->watch || (socket->state < ESTABLISHED) || (socket->state == CLOSED) ) {
 
 		errno = EINVAL;
 		return -(EXIT_FAILURE);
 	}
 
-	if ( (socket->state == INVALID) || (socket->state >= CLOSING_BY_PEER) ) {
+	/* the listener signals the eventfd of a connection, a plain socket is polled directly
+	 * (the ring of the io_uring backend, readable while completions are queued) */
+	fd = ( socket->flow ) ? socket->flow->evfd : ( socket->uring ) ? _uring_fd(socket) : socket->sd;
+
+	if ( !(w = _watch_add(loop, fd)) )
+		return -(EXIT_FAILURE);
+
+	w->sock   = socket;
+	w->events = events;
+	w->cb     = cb;
+	w->arg    = arg;
+
+	socket->watch    = w;
+	socket->nonblock = 1;
+
+
+	return EXIT_SUCCESS;
+}
+
+int microtcp_loop_mod(microtcp_loop_t * __restrict__ loop, microtcp_sock_t * __restrict__ socket, uint32_t events)
+{
+	if ( !loop || !socket || !socket->watch || (socket->watch->loop != loop) ) {
 
 		errno = EINVAL;
 		return -(EXIT_FAILURE);
 	}
 
+	socket->watch->events = events;
 
-	total_bytes_read = 0L;
-	sockfd = socket->sd;
 
-rflag0:
-	check( total_bytes_read = recv(sockfd, tbuff, length, 0) );
-	memcpy(&tcph, tbuff, MICROTCP_HEADER_SIZE);
-	print_tcp_header(socket,&tcph);
+	return EXIT_SUCCESS;
+}
+
+int microtcp_loop_del(microtcp_loop_t * __restrict__ loop, microtcp_sock_t * __restrict__ socket)
+{
+	if ( !loop || !socket || !socket->watch || (socket->watch->loop != loop) ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	_watch_del(loop, socket->watch);
+	socket->watch->sock = NULL;
+	socket->watch = NULL;
+
 
-	_ntoh_recvd_tcph(tcph);
+	return EXIT_SUCCESS;
+}
+
+int microtcp_loop_add_listener(microtcp_loop_t * __restrict__ loop, microtcp_listener_t * __restrict__ listener,
+					microtcp_accept_cb_t cb, void * arg)
+{
+	struct microtcp_watch * w;
+
+
+	if ( !loop || !listener || !cb ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	if ( !(w = _watch_add(loop, listener->aq_evfd)) )
+		return -(EXIT_FAILURE);
+
+	w->listener  = listener;
+	w->accept_cb = cb;
+	w->arg       = arg;
+
+	pthread_mutex_lock(&listener->lock);
+	listener->nonblock = 1;
+	pthread_mutex_unlock(&listener->lock);
+
+
+	return EXIT_SUCCESS;
+}
+
+int microtcp_loop_del_listener(microtcp_loop_t * __restrict__ loop, microtcp_listener_t * __restrict__ listener)
+{
+	struct microtcp_watch * w;
+
+
+	for ( w = ( loop && listener ) ? loop->watches : NULL; w; w = w->next )
+		if ( !w->removed && (w->listener == listener) ) {
+
+			_watch_del(loop, w);
+			w->listener = NULL;
+
+			pthread_mutex_lock(&listener->lock);
+			listener->nonblock = 0;
+			pthread_mutex_unlock(&listener->lock);
 
-	// Fast Retransmit
-	if ( tcph.seq_number > socket->ack_number ) {
+			return EXIT_SUCCESS;
+		}
+
+	errno = EINVAL;
+	return -(EXIT_FAILURE);
+}
+
+int microtcp_poll(microtcp_loop_t * loop, int timeout)
+{
+	struct microtcp_watch ** pw;
+	struct microtcp_watch * w;
+	uint64_t next = TW_NEVER;
+	uint64_t now;
+	uint64_t wait;
+	int dispatched = 0;
+	int ret;
+	int i;
 
-		LOG_DEBUG("Reordering\n");  // packet that was read is actually discarded!
-		_preapre_send_tcph(socket, &tcph, CTRL_ACK, NULL, 0U);
-		check( send(sockfd, &tcph, MICROTCP_HEADER_SIZE, 0) );
 
-		/** TODO: Packet reordeing could also be performed here,
-		 * thus achieving better performance.
-		 */
+	if ( !loop ) {
 
-		goto rflag0;
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
 	}
-	else if ( tcph.control & CTRL_FIN ) {  // termination
 
-		microtcp_shutdown(socket, SHUTDOWN_SERVER);
-		return -1L;
+	/* the closest timer of the sockets bounds the wait. Callbacks that just ran may
+	 * have left work that is due right away (events are level-triggered), as do
+	 * new watches */
+	for ( w = loop->watches; w; w = w->next )
+		if ( !w->removed ) {
+
+			if ( w->sock )
+				next = MIN2(next, tw_next(w->sock->wheel));
+
+			loop->busy |= w->io;
+		}
+
+	now = US_TO_TICKS(_now_us());
+
+	if ( loop->busy )
+		timeout = 0;
+	else if ( next != TW_NEVER ) {
+
+		wait = ( next > now ) ? ((next - now) * MICROTCP_TIMER_TICK_US + 999UL) / 1000UL : 0UL;
+
+		if ( (timeout < 0) || (wait < (uint64_t)(timeout)) )
+			timeout = (int)(wait);
 	}
-	else if ( tcph.seq_number < socket->ack_number )  // skip duplicate packets (during TIMEOUT)
-		goto rflag0;
 
-	if ( !tcph.data_len )  // zero length packet
-		return 0L;
+	if ( (ret = epoll_wait(loop->epfd, loop->evs, MICROTCP_LOOP_EVENTS, timeout)) < 0 ) {
+
+		if ( errno != EINTR )
+			return -(EXIT_FAILURE);
+
+		ret = 0;
+	}
 
-	memcpy(buffer, tbuff + MICROTCP_HEADER_SIZE, tcph.data_len);
+	for ( i = 0; i < ret; ++i )
+		((struct microtcp_watch *)(loop->evs[i].data.ptr))->io = 1;
 
-	total_bytes_read -= MICROTCP_HEADER_SIZE;
-	socket->ack_number += tcph.data_len;
-	tcph.ack_number = socket->ack_number;
-	tcph.seq_number = socket->seq_number;
-	frag = tcph.control & FRAGMENT;
+	now = US_TO_TICKS(_now_us());
 
-	_preapre_send_tcph(socket, &tcph, CTRL_ACK, NULL, 0U);
-	check( send(sockfd, &tcph, MICROTCP_HEADER_SIZE, 0) );
+	/* watches added by the callbacks go to the head, they are handled the next time */
+	for ( w = loop->watches; w; w = w->next ) {
 
-	if ( !frag )  // no fragmentation case
-		return total_bytes_read;
+		if ( w->removed )
+			continue;
 
-	// fragmentation case
-	tbuff[total_bytes_read - 1L];
-	bytes_read = total_bytes_read;
+		if ( w->sock )
+			dispatched += _watch_dispatch(w, now);
+		else if ( w->io ) {  // accept until EAGAIN, the eventfd stays readable until then
 
-	do {
+			w->io = 0;
+			w->accept_cb(loop, w->listener, w->arg);
+			++dispatched;
+		}
+	}
 
-		tbuff[bytes_read - 1L] = 0;
+	if ( loop->removed ) {
 
-		check( bytes_read = recv(sockfd, tbuff, MICROTCP_MSS + MICROTCP_HEADER_SIZE, 0) );
-		memcpy(&tcph, tbuff, MICROTCP_HEADER_SIZE);
-		_ntoh_recvd_tcph(tcph);
-		memcpy(buffer + total_bytes_read, tbuff + MICROTCP_HEADER_SIZE, tcph.data_len);
+		for ( pw = &loop->watches; (w = *pw); )
+			if ( w->removed ) {
 
-		total_bytes_read += bytes_read - MICROTCP_HEADER_SIZE;
-		socket->ack_number += tcph.data_len;
-		tcph.seq_number = socket->seq_number;
-		tcph.ack_number = socket->ack_number;
-		frag = tcph.control & FRAGMENT;
+				*pw = w->next;
+				free(w);
+			}
+			else
+				pw = &w->next;
 
-		_preapre_send_tcph(socket, &tcph, CTRL_ACK, NULL, 0U);
-		check( send(sockfd, &tcph, MICROTCP_HEADER_SIZE, 0) );
+		loop->removed = 0;
+	}
 
-	} while ( !frag );
+	loop->busy = ( dispatched > 0 );
 
 
-	return total_bytes_read;
+	return dispatched;
 }
 
+int microtcp_loop_free(microtcp_loop_t * loop)
+{
+	struct microtcp_watch * w;
+
+
+	if ( !loop ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	while ( (w = loop->watches) ) {
+
+		loop->watches = w->next;
+
+		if ( w->sock && !w->removed )
+			w->sock->watch = NULL;
+
+		free(w);
+	}
+
+	close(loop->epfd);
+	free(loop);
+
+
+	return EXIT_SUCCESS;
+}
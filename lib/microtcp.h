@@ -26,6 +26,8 @@
 #include <netinet/ip.h>
 #include <stdint.h>
 
+#include "../utils/timer_wheel.h"
+
 
 /** DEFINES **/
 #define FRAGMENT ( 1U << 5 )
@@ -35,6 +37,55 @@
 #define CTRL_SYN ( 1U << 1 )
 #define CTRL_RST ( 1U << 2 )
 #define CTRL_ACK ( 1U << 3 )
+#define CTRL_PSH ( 1U << 4 )  /* the segment empties the send buffer, acknowledged without delay */
+
+/*
+ * Options offered in the 'future_use0' field of the SYN and SYN-ACK segments
+ */
+#define MICROTCP_OPT_SACK ( 1U << 0 )
+#define MICROTCP_OPT_WSCALE ( 1U << 1 )  /* window scaling, the shift of each side is sent in 'future_use1' of its SYN */
+
+/*
+ * Options of microtcp_setsockopt()
+ */
+#define MICROTCP_SO_RTO_MIN 1          /* lower bound of the RTO in us (uint32_t) */
+#define MICROTCP_SO_RTO_MAX 2          /* upper bound of the RTO in us (uint32_t) */
+#define MICROTCP_SO_ZEROCOPY 3         /* send with MSG_ZEROCOPY, 0 or 1 (uint32_t) */
+#define MICROTCP_SO_NONBLOCK 4         /* send/recv/shutdown fail with EAGAIN instead of blocking, 0 or 1 (uint32_t) */
+#define MICROTCP_SO_IO_URING 5         /* datagram I/O through io_uring instead of sendmmsg()/recvmmsg(), 0 or 1 (uint32_t) */
+#define MICROTCP_SO_GSO 6              /* send bursts of segments as UDP_SEGMENT super-datagrams, receive with UDP_GRO, 0 or 1 (uint32_t) */
+#define MICROTCP_SO_CONG 7             /* congestion control algorithm, MICROTCP_CC_* (uint32_t) */
+#define MICROTCP_SO_PACING 8           /* spread the segments of a window at the pacing rate of the congestion control,
+                                          MICROTCP_PACING_* (uint32_t) */
+#define MICROTCP_SO_RCVBUF 9           /* size of the receive buffer, the largest window advertised, in bytes (rounded up to
+                                          a power of 2), before microtcp_connect() or microtcp_accept() (uint32_t) */
+#define MICROTCP_SO_SNDBUF 10          /* size of the send buffer, the data that microtcp_send() holds until it is
+                                          acknowledged, in bytes (rounded up to a power of 2), while it is empty (uint32_t) */
+#define MICROTCP_SO_NODELAY 11         /* send partial segments right away instead of coalescing the small writes while
+                                          data is in flight (Nagle), 0 or 1 (uint32_t) */
+
+/*
+ * Congestion control algorithms (MICROTCP_SO_CONG)
+ */
+#define MICROTCP_CC_RENO 0             /* slow start, then one MSS per RTT, halved on loss (default) */
+#define MICROTCP_CC_CUBIC 1            /* cwnd grows as a cubic function of the time since the last loss (RFC 9438) */
+#define MICROTCP_CC_BBR 2              /* cwnd and pacing rate from a model of the bottleneck bandwidth and the min RTT,
+                                          losses are not taken as congestion */
+
+/*
+ * Pacing of the segments (MICROTCP_SO_PACING)
+ */
+#define MICROTCP_PACING_OFF 0          /* the window goes out back-to-back (default) */
+#define MICROTCP_PACING_TIMER 1        /* the sender holds the segments back on its timers */
+#define MICROTCP_PACING_TXTIME 2       /* every datagram carries its departure time (SO_TXTIME), the fq qdisc of the
+                                          route holds it back. Plain sockets without MICROTCP_SO_GSO only */
+
+/*
+ * Events of the sockets of a microtcp_loop_t (level-triggered, as in epoll)
+ */
+#define MICROTCP_EV_READABLE ( 1U << 0 )  /* microtcp_recv() returns data, or 0 at the end of the stream */
+#define MICROTCP_EV_WRITABLE ( 1U << 1 )  /* the send buffer has room, microtcp_send() takes data */
+#define MICROTCP_EV_CLOSED   ( 1U << 2 )  /* the connection is over (always reported, once) */
 
 #define SHUTDOWN_CLIENT 0
 #define SHUTDOWN_SERVER 1
@@ -42,12 +93,36 @@
 /*
  * Several useful constants
  */
-#define MICROTCP_ACK_TIMEOUT_US 200000L
+#define MICROTCP_ACK_TIMEOUT_US 200000L     /* initial RTO, until the first RTT sample */
+#define MICROTCP_RTO_MIN_US 1000L
+#define MICROTCP_RTO_MAX_US 60000000L
+#define MICROTCP_TIMER_TICK_US 100L         /* resolution of the retransmission timers */
+#define MICROTCP_TIME_WAIT_US (2 * MICROTCP_ACK_TIMEOUT_US)
+#define MICROTCP_FIN_RETRIES 6
+#define MICROTCP_SYN_RETRIES 6
 #define MICROTCP_MSS 1400U
-#define MICROTCP_RECVBUF_LEN 8192
+#define MICROTCP_DELACK_US 500                  /* delayed ACK timer, below the RTO floor (MICROTCP_RTO_MIN_US) */
+#define MICROTCP_DELACK_SEGS 2                  /* in-order segments per ACK */
+#define MICROTCP_RECVBUF_LEN 8192               /* default receive buffer (MICROTCP_SO_RCVBUF), the one of the connections of a listener */
+#define MICROTCP_RCVBUF_MAX ( 1U << 30 )        /* largest receive buffer */
+#define MICROTCP_SNDBUF_LEN 65536              /* default send buffer (MICROTCP_SO_SNDBUF) */
+#define MICROTCP_SNDBUF_MAX ( 1U << 30 )        /* largest send buffer */
+#define MICROTCP_WSCALE_MAX 14                  /* largest window scale shift, as in RFC 7323 */
 #define MICROTCP_WIN_SIZE MICROTCP_RECVBUF_LEN
 #define MICROTCP_INIT_CWND (3 * MICROTCP_MSS)
-#define MICROTCP_INIT_SSTHRESH MICROTCP_WIN_SIZE
+#define MICROTCP_INIT_SSTHRESH ( (size_t)(UINT16_MAX) << MICROTCP_WSCALE_MAX )  /* the largest window, slow start runs until the first loss */
+#define MICROTCP_SENDQ_INIT_LEN 64
+#define MICROTCP_BATCH_LEN 32               /* datagrams per sendmmsg()/recvmmsg() */
+#define MICROTCP_URING_BUFS 256             /* receive buffers of the io_uring backend (a power of 2) */
+#define MICROTCP_GRO_BATCH 8                /* coalesced datagrams (of up to 64 KB) per recvmmsg() with MICROTCP_SO_GSO */
+#define MICROTCP_ZEROCOPY_MIN_LEN 131072L   /* smallest microtcp_send() whose segments use MSG_ZEROCOPY */
+#define MICROTCP_LISTEN_BACKLOG 128         /* default backlog of microtcp_listen() */
+#define MICROTCP_LISTEN_BUCKETS 256         /* initial size of the flow table of a listener (power of 2) */
+#define MICROTCP_SYN_RCVD_TIMEOUT_US 3000000L  /* half-open flows older than this are dropped when the backlog is full */
+#define MICROTCP_LISTEN_RCVBUF ( 4 << 20 )  /* SO_RCVBUF of the socket of a listener */
+#define MICROTCP_LOOP_EVENTS 64             /* epoll events handled per epoll_wait() of a loop */
+#define MICROTCP_POOL_CHUNK 256            /* segment slots carved from the heap at once by the pool of all batches */
+#define MICROTCP_CC_PRIV_LEN 24             /* 64-bit words of private state of a congestion control algorithm */
 
 /**
  * Possible states of the microTCP socket
@@ -60,15 +135,87 @@ typedef enum
   INVALID,
   LISTEN,
   ESTABLISHED,
-  SLOW_START,
-  CONG_AVOID,
   CLOSING_BY_PEER,
   CLOSING_BY_HOST,
+  TIME_WAIT,
   CLOSED,
 } mircotcp_state_t;
 
 /** TODO: handle better 'INVALID' state (set only upon error) */
 
+/**
+ * Phases of the congestion control of an established connection
+ */
+typedef enum
+{
+  SLOW_START,
+  CONG_AVOID,
+} microtcp_cc_state_t;
+
+
+/**
+ * A segment of the send window. The payload is never copied, 'payld'
+ * points into the send buffer, where it stays until it is acknowledged.
+ */
+typedef struct
+{
+  uint32_t seq_number;           /**< Sequence number of the first payload byte */
+  uint32_t data_len;             /**< Payload length in bytes */
+  uint16_t control;              /**< Control bits the segment is sent with (e.g. FRAGMENT) */
+  uint8_t sacked;                /**< Set when the peer reported the segment in a SACK block */
+  uint8_t retrans;               /**< Set once the segment is retransmitted (Karn's rule) */
+  uint8_t tx_app_limited;        /**< The socket was application limited at the last transmission */
+  uint64_t sent_us;              /**< Time (monotonic, us) of the last transmission */
+  uint64_t tx_delivered;         /**< 'delivered' of the socket at the last transmission */
+  uint64_t tx_delivered_us;      /**< 'delivered_us' of the socket at the last transmission */
+  uint64_t tx_first_sent_us;     /**< 'first_sent_us' of the socket at the last transmission */
+  tw_timer_t rtx;                /**< Retransmission deadline of the segment */
+  const uint8_t * payld;         /**< Payload of the segment */
+} microtcp_segment_t;
+
+
+/**
+ * A delivery rate sample: the bytes that the peer received over an interval that
+ * ends with an ACK, measured from the send and ACK times of the segments (as in
+ * draft-cheng-iccrg-delivery-rate-estimation). It is taken on every ACK that
+ * acknowledges new data, right before the on_ack hook of the congestion control.
+ */
+typedef struct
+{
+  uint64_t prior_delivered;      /**< 'delivered' of the socket when the newest acknowledged segment was sent */
+  uint64_t prior_us;             /**< 'delivered_us' of the socket at the same time */
+  uint64_t send_elapsed;         /**< Time the sender took to send the segments of the interval (us) */
+  uint64_t delivered;            /**< Bytes delivered over the interval (0 if there is no sample) */
+  uint64_t interval_us;          /**< Length of the interval, the longer of the send and the ACK phase */
+  uint32_t rtt;                  /**< RTT of the newest acknowledged segment in us, 0 if it was retransmitted */
+  uint8_t app_limited;           /**< The sender ran out of data in the interval, the rate may be too low */
+} microtcp_rate_sample_t;
+
+/**
+ * Occupancy of the pool of segment slots (a header and an MSS, cache-line aligned)
+ * that backs the datagram batches of every socket and listener of the process.
+ */
+typedef struct
+{
+  uint64_t slot_len;             /**< Bytes per slot */
+  uint64_t slots;                /**< Slots carved so far, the pool never shrinks */
+  uint64_t in_use;               /**< Slots out of the shared depot: owned by batches or cached by threads */
+  uint64_t high_water;           /**< Most slots out of the depot at once */
+  uint64_t chunks;               /**< Heap allocations of MICROTCP_POOL_CHUNK slots */
+} microtcp_pool_stats_t;
+
+
+struct microtcp_batch;  /* datagrams of a sendmmsg()/recvmmsg() call, see microtcp.c */
+struct microtcp_flow;   /* a connection of a listener, see microtcp.c */
+struct microtcp_watch;  /* a socket or listener registered in a loop, see microtcp.c */
+struct microtcp_cc;     /* a congestion control algorithm, see microtcp.c */
+
+/**
+ * A bound UDP socket that serves many connections. Incoming datagrams are
+ * demultiplexed by the address of the peer, connections are handed out by
+ * microtcp_listener_accept() once their 3-way handshake completes.
+ */
+typedef struct microtcp_listener microtcp_listener_t;
 
 /**
  * This is the microTCP socket structure. It holds all the necessary
@@ -77,33 +224,122 @@ typedef enum
  * NOTE: Fill free to insert additional fields.
  */
 
-/** TODO: fuck 'recvbuf', it's useless. Let's use the kernel's
- * (UDP) built-in buffer.
- */
 typedef struct
 {
   int sd;                        /**< The underline UDP socket descriptor */
+  struct microtcp_flow * flow;   /**< For the connections of a listener: 'sd' is shared, the datagrams
+                                     of the connection are demultiplexed by the listener */
   mircotcp_state_t state;        /**< The state of the microTCP socket */
+  uint32_t opts;                 /**< Options (MICROTCP_OPT_*) enabled on the socket. After the 3-way
+                                     handshake only the ones that both peers offered remain */
   size_t init_win_size;          /**< The window size negotiated at the 3-way handshake */
   size_t curr_win_size;          /**< The current window size */
 
+  size_t recvbuf_len;            /**< Size of 'recvbuf', a power of 2 (MICROTCP_SO_RCVBUF) */
   uint8_t * recvbuf;             /**< The *receive* buffer of the TCP
                                      connection. It is allocated during the connection establishment and
                                      is freed at the shutdown of the connection. This buffer is used
-                                     to retrieve the data from the network. */
-  size_t buf_fill_level;         /**< Amount of data in the buffer */
+                                     to retrieve the data from the network. It is a ring that reassembles
+                                     out-of-order segments. */
+  uint8_t * recvmap;             /**< Bitmap of the 'recvbuf' bytes that hold data */
+  size_t recv_head;              /**< Index in 'recvbuf' of the next byte to be delivered */
+  uint32_t recv_seq;             /**< Sequence number of the next byte to be delivered */
+  uint32_t recv_high;            /**< Right edge of the data held in 'recvbuf', where the SACK scan stops */
+  size_t buf_fill_level;         /**< Amount of in-order data in the buffer that is not delivered yet */
   size_t cwnd;
   size_t ssthresh;
+  microtcp_cc_state_t cc_state;  /**< Phase of the congestion control */
+  const struct microtcp_cc * cc; /**< Congestion control algorithm (MICROTCP_SO_CONG) */
+  uint64_t cc_priv[MICROTCP_CC_PRIV_LEN];  /**< Private state of 'cc' */
+  uint64_t delivered;            /**< Bytes that reached the peer (cumulatively or selectively acknowledged) */
+  uint64_t delivered_us;         /**< Time 'delivered' last grew (monotonic, us) */
+  uint64_t first_sent_us;        /**< Send time of the first segment of the current delivery interval */
+  uint64_t app_limited;          /**< 'delivered' up to which the rate samples are application limited (0 if none) */
+  microtcp_rate_sample_t rs;     /**< The rate sample of the last ACK */
+
+  uint32_t srtt;                 /**< Smoothed RTT in us (0 until the first sample) */
+  uint32_t rttvar;               /**< RTT variation in us */
+  uint32_t rto;                  /**< Current retransmission timeout in us (including backoff) */
+  uint32_t rto_min;              /**< Lower bound of 'rto' */
+  uint32_t rto_max;              /**< Upper bound of 'rto' */
+
+  tw_wheel_t * wheel;            /**< Timers of the connection (retransmissions, FIN, TIME_WAIT) */
+  tw_timer_t ctl_timer;          /**< FIN retransmission and TIME_WAIT timer */
+  uint32_t ctl_retries;          /**< Expirations of 'ctl_timer' so far */
   
-  uint16_t sendbuflen;
-  
-  size_t seq_number;             /**< Keep the state of the sequence number */
-  size_t ack_number;             /**< Keep the state of the ack number */
+  uint32_t sendbuflen;           /**< The receive window of the peer in bytes, from its latest ACK */
+  uint32_t rcv_wnd;              /**< The receive window advertised in our latest segment, in bytes */
+  uint8_t snd_wscale;            /**< Shift of the window field of the peer (MICROTCP_OPT_WSCALE) */
+  uint8_t rcv_wscale;            /**< Shift of the window field of ours */
+  tw_timer_t delack_timer;       /**< Acknowledges the in-order segments that are still unacknowledged */
+  uint32_t delack_segs;          /**< In-order segments received since our last ACK */
+  uint64_t acks_sent;            /**< Segments without data that acknowledged data of the peer */
+  uint64_t acks_delayed;         /**< Of them, the ones sent by 'delack_timer' */
+  tw_timer_t persist_timer;      /**< Zero-window probes, while the window of the peer holds back the next
+                                     segment and nothing is in flight to bring an update */
+  uint32_t probes;               /**< Zero-window probes since the window of the peer last opened */
+  uint64_t zwp_sent;             /**< Zero-window probes sent */
+  uint32_t dupacks;              /**< Consecutive duplicate ACKs */
+  uint8_t in_recovery;           /**< A fast recovery is in progress, until 'recover' is acknowledged */
+  uint32_t recover;              /**< 'seq_number' when the last recovery (or timeout) started, the duplicate
+                                     ACKs of the data sent before it do not start another recovery */
+  uint64_t fast_retrans;         /**< Segments retransmitted by fast retransmit and on partial ACKs */
+
+  microtcp_segment_t * sendq;    /**< Ring of unacknowledged segments, ordered by sequence number */
+  size_t sendq_cap;              /**< Capacity of 'sendq' (in segments) */
+  size_t sendq_head;             /**< Index of the oldest unacknowledged segment */
+  size_t sendq_len;              /**< Number of segments in 'sendq' */
+  size_t sendq_sent;             /**< Number of segments of 'sendq' that are on the wire */
+  uint32_t snd_una;              /**< Oldest unacknowledged sequence number */
+  uint8_t * sndbuf;              /**< The send buffer, a ring that holds the bytes from 'snd_una' to 'snd_end'
+                                     (the byte of sequence number 'seq' at 'seq' modulo 'sndbuf_len'). The
+                                     segments are cut from it, microtcp_send() returns once its data is copied */
+  size_t sndbuf_len;             /**< Size of 'sndbuf', a power of 2 (MICROTCP_SO_SNDBUF) */
+  uint32_t snd_end;              /**< Sequence number right after the last byte of 'sndbuf' */
+  uint8_t fin_pending;           /**< microtcp_shutdown() of a non-blocking socket, the FIN follows the data */
+  uint8_t nodelay;               /**< MICROTCP_SO_NODELAY is enabled */
+
+  struct microtcp_batch * txb;   /**< Datagrams queued for the next sendmmsg() */
+  struct microtcp_batch * rxb;   /**< Datagrams of the last recvmmsg() (consumed one at a time) */
+  struct microtcp_uring * uring; /**< The io_uring backend (MICROTCP_SO_IO_URING), NULL if the datagrams
+                                     go through sendmmsg()/recvmmsg() */
+  uint64_t tx_batches;           /**< sendmmsg() calls (io_uring: submissions of sends) */
+  uint64_t tx_batched;           /**< Datagrams sent by them (average batch: tx_batched / tx_batches), a
+                                     super-datagram counts as the segments it carries */
+  uint64_t rx_batches;           /**< recvmmsg() calls that returned datagrams (io_uring: reaps that did) */
+  uint64_t rx_batched;           /**< Datagrams received by them, a coalesced datagram counts as its segments */
+  uint32_t tx_batch_max;         /**< Largest batch sent */
+  uint32_t rx_batch_max;         /**< Largest batch received */
+
+  uint8_t zerocopy;              /**< MICROTCP_SO_ZEROCOPY is enabled */
+  int tx_flags;                  /**< Flags of sendmmsg() (MSG_ZEROCOPY after a large microtcp_send()) */
+  uint64_t zc_sent;              /**< Datagrams sent with MSG_ZEROCOPY */
+  uint64_t zc_done;              /**< Of them, the ones whose completion was reported */
+  uint64_t zc_copied;            /**< Of the completed ones, the ones the kernel copied anyway (e.g. loopback) */
+
+  uint8_t gso;                   /**< MICROTCP_SO_GSO is enabled */
+  uint8_t * gro_buf;             /**< Receive buffers of the coalesced datagrams (MICROTCP_GRO_BATCH) */
+  uint64_t gso_sent;             /**< Super-datagrams sent with UDP_SEGMENT */
+  uint64_t gro_rcvd;             /**< Coalesced datagrams received (of more than one segment) */
+
+  uint8_t pacing;                /**< MICROTCP_SO_PACING, one of MICROTCP_PACING_* */
+  uint64_t pace_next_us;         /**< Departure time of the next segment (monotonic, us) */
+  tw_timer_t pace_timer;         /**< Wakes the sender up when the next segment is due (MICROTCP_PACING_TIMER) */
+  uint64_t paced;                /**< Segments that had to wait for their departure time */
+
+  uint8_t nonblock;              /**< MICROTCP_SO_NONBLOCK is enabled */
+  uint8_t fin_rcvd;              /**< The FIN of the peer is covered by 'ack_number' (end of the stream) */
+  struct microtcp_watch * watch; /**< The registration of the socket in a microtcp_loop_t */
+
+  uint32_t seq_number;           /**< Keep the state of the sequence number (next byte to be queued), wraps mod 2^32 */
+  uint32_t ack_number;           /**< Keep the state of the ack number, wraps mod 2^32 */
   uint64_t packets_send;
   uint64_t packets_received;
   uint64_t packets_lost;
+  uint64_t packets_corrupted;    /**< Segments dropped because of a wrong checksum */
   uint64_t bytes_send;
   uint64_t bytes_received;
+  uint64_t bytes_direct;         /**< Of them, the bytes copied straight into the buffer of microtcp_recv() */
   uint64_t bytes_lost;
 
 } microtcp_sock_t;
@@ -118,11 +354,11 @@ typedef struct
   uint32_t seq_number;          /**< Sequence number */
   uint32_t ack_number;          /**< ACK number */
   uint16_t control;             /**< Control bits (e.g. SYN, ACK, FIN) */
-  uint16_t window;              /**< Window size in bytes */
+  uint16_t window;              /**< Window size in bytes, in units of 2^shift after a SYN with MICROTCP_OPT_WSCALE */
   uint32_t data_len;            /**< Data length in bytes (EXCLUDING header) */
-  uint32_t future_use0;         /**< 32-bits for future use */
-  uint32_t future_use1;         /**< 32-bits for future use */
-  uint32_t future_use2;         /**< 32-bits for future use */
+  uint32_t future_use0;         /**< SYN: offered options (MICROTCP_OPT_*), ACK: left edge of SACK block #1 */
+  uint32_t future_use1;         /**< SYN: window scale shift (MICROTCP_OPT_WSCALE), ACK: right edge of SACK block #1 */
+  uint32_t future_use2;         /**< ACK: SACK block #2, gap after block #1 (16 MSB) and length (16 LSB) */
   uint32_t checksum;            /**< CRC-32 checksum, see crc32() in utils folder */
 } microtcp_header_t;
 
@@ -147,6 +383,206 @@ int microtcp_connect(microtcp_sock_t * __restrict__ socket, const struct sockadd
 int microtcp_accept(microtcp_sock_t * __restrict__ socket, struct sockaddr * __restrict__ address,
                  socklen_t address_len);
 
+/**
+ * @brief Sets an option of a microTCP socket, in the spirit of setsockopt().
+ * 
+ * @param socket a valid microTCP socket object
+ * @param optname one of MICROTCP_SO_*
+ * @param optval the new value of the option
+ * @param optlen the size of 'optval'
+ * @return 0 on success or -1 on failure (errno is set to EINVAL, or to the reason io_uring
+ * is not usable for MICROTCP_SO_IO_URING, in which case the socket keeps using plain sockets)
+ */
+int microtcp_setsockopt(microtcp_sock_t * __restrict__ socket, int optname, const void * __restrict__ optval,
+                 socklen_t optlen);
+
+/**
+ * @brief Creates a listener bound to 'address'. A thread of the listener receives the
+ * datagrams of all its connections and carries out the 3-way handshake of new ones.
+ * 
+ * @param domain AF_INET or AF_INET6
+ * @param address the address to bind to
+ * @param address_len the length of 'address'
+ * @param backlog maximum number of connections that are half-open or not accepted
+ * yet (MICROTCP_LISTEN_BACKLOG if not positive)
+ * @return the listener, or NULL on failure (errno is set)
+ */
+microtcp_listener_t * microtcp_listen(int domain, const struct sockaddr * __restrict__ address, socklen_t address_len,
+                 int backlog);
+
+/**
+ * @brief Blocks until a connection of the listener is established. The connection
+ * shares the UDP socket of the listener, it has to be released with microtcp_close()
+ * (never close() its 'sd'). Different connections may be served by different threads.
+ * 
+ * @param listener a listener of microtcp_listen()
+ * @param socket filled with the new connection
+ * @param address if not NULL, filled with the address of the peer
+ * @param address_len in: size of 'address', out: length of the address of the peer
+ * @return 0 on success or -1 on failure (e.g. the listener got closed)
+ */
+int microtcp_listener_accept(microtcp_listener_t * __restrict__ listener, microtcp_sock_t * __restrict__ socket,
+                 struct sockaddr * __restrict__ address, socklen_t * __restrict__ address_len);
+
+/**
+ * @brief Stops the listener and releases it along with the connections that were not
+ * accepted. The accepted connections have to be closed before.
+ * 
+ * @param listener a listener of microtcp_listen()
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_listener_close(microtcp_listener_t * listener);
+
+/**
+ * @brief Serves a connection of a sharded server. It runs on the thread of the shard
+ * that the peer got steered to, the connection is closed once it returns.
+ * 
+ * @param socket an established connection
+ * @param shard the index of the shard
+ * @param arg the argument of microtcp_server_start()
+ */
+typedef void (*microtcp_handler_t) (microtcp_sock_t * socket, int shard, void * arg);
+
+/**
+ * A server sharded by CPU. Every shard is a thread pinned to a CPU with a listener of
+ * its own on a SO_REUSEPORT socket of the same port, the kernel hashes each peer to
+ * one of the sockets. The state of a connection never leaves the CPU of its shard.
+ */
+typedef struct microtcp_server microtcp_server_t;
+
+/**
+ * @brief Starts a sharded server bound to 'address'. A shard serves its connections
+ * one after the other, the ones that arrive meanwhile wait in its accept queue.
+ * 
+ * @param domain AF_INET or AF_INET6
+ * @param address the address to bind to
+ * @param address_len the length of 'address'
+ * @param nshards the number of shards (one per online CPU if not positive)
+ * @param handler called for every accepted connection
+ * @param arg passed to 'handler'
+ * @return the server, or NULL on failure (errno is set)
+ */
+microtcp_server_t * microtcp_server_start(int domain, const struct sockaddr * __restrict__ address,
+                 socklen_t address_len, int nshards, microtcp_handler_t handler, void * arg);
+
+/**
+ * @brief Stops accepting, waits for the connections in service and releases the server.
+ * 
+ * @param server a server of microtcp_server_start()
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_server_stop(microtcp_server_t * server);
+
+/**
+ * An event loop on epoll that runs many non-blocking connections on one thread. The
+ * loop handles the datagrams, retransmissions and ACKs of its sockets in microtcp_poll()
+ * and reports their readiness to callbacks, which call microtcp_recv(), microtcp_send()
+ * and microtcp_shutdown() without blocking. A loop must only be used by one thread.
+ */
+typedef struct microtcp_loop microtcp_loop_t;
+
+/**
+ * @brief Reports the MICROTCP_EV_* 'events' of a socket of the loop. The callback may
+ * remove or close any socket of the loop, including this one.
+ */
+typedef void (*microtcp_event_cb_t) (microtcp_loop_t * loop, microtcp_sock_t * socket, uint32_t events, void * arg);
+
+/**
+ * @brief Reports that connections are waiting in the accept queue of a listener of the
+ * loop. Its microtcp_listener_accept() calls fail with EAGAIN once the queue is empty.
+ */
+typedef void (*microtcp_accept_cb_t) (microtcp_loop_t * loop, microtcp_listener_t * listener, void * arg);
+
+/**
+ * @brief Creates an event loop.
+ * 
+ * @return the loop, or NULL on failure (errno is set)
+ */
+microtcp_loop_t * microtcp_loop_new(void);
+
+/**
+ * @brief Registers an established connection (of microtcp_connect() or microtcp_listener_accept())
+ * and makes it non-blocking (MICROTCP_SO_NONBLOCK): microtcp_send() copies what fits in the
+ * send buffer (MICROTCP_EV_WRITABLE reports room), microtcp_recv() returns the data that is
+ * buffered, up to 'length'. The socket must not move while it is registered.
+ * 
+ * @param loop a loop of microtcp_loop_new()
+ * @param socket the connection
+ * @param events the MICROTCP_EV_* to report (MICROTCP_EV_CLOSED is always reported)
+ * @param cb the callback of the socket
+ * @param arg passed to 'cb'
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_loop_add(microtcp_loop_t * __restrict__ loop, microtcp_sock_t * __restrict__ socket, uint32_t events,
+                 microtcp_event_cb_t cb, void * arg);
+
+/**
+ * @brief Changes the events reported for a socket of the loop. As in epoll, a socket
+ * that stays readable or writable is reported at every microtcp_poll().
+ * 
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_loop_mod(microtcp_loop_t * __restrict__ loop, microtcp_sock_t * __restrict__ socket, uint32_t events);
+
+/**
+ * @brief Removes a socket from the loop, it stays non-blocking. microtcp_close() does
+ * it as well.
+ * 
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_loop_del(microtcp_loop_t * __restrict__ loop, microtcp_sock_t * __restrict__ socket);
+
+/**
+ * @brief Registers a listener, 'cb' runs whenever connections are ready to be accepted.
+ * microtcp_listener_accept() no longer blocks.
+ * 
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_loop_add_listener(microtcp_loop_t * __restrict__ loop, microtcp_listener_t * __restrict__ listener,
+                 microtcp_accept_cb_t cb, void * arg);
+
+/**
+ * @brief Removes a listener from the loop, microtcp_listener_accept() blocks again.
+ * 
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_loop_del_listener(microtcp_loop_t * __restrict__ loop, microtcp_listener_t * __restrict__ listener);
+
+/**
+ * @brief Runs the loop once: waits up to 'timeout' ms (or the next retransmission
+ * timer) for datagrams, lets the sockets that got datagrams or whose timers expired
+ * make progress and runs the callbacks of the ready ones.
+ * 
+ * @param loop a loop of microtcp_loop_new()
+ * @param timeout in ms, -1 to wait for an event, 0 to return at once
+ * @return the number of callbacks that ran, or -1 on failure
+ */
+int microtcp_poll(microtcp_loop_t * loop, int timeout);
+
+/**
+ * @brief Releases a loop, its sockets and listeners stay open (and non-blocking).
+ * 
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_loop_free(microtcp_loop_t * loop);
+
+/**
+ * @brief Reports the occupancy of the segment pool.
+ * 
+ * @param stats where the statistics are stored
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_pool_stats(microtcp_pool_stats_t * stats);
+
+/**
+ * @brief Releases the resources of a socket (after microtcp_shutdown()) and closes the
+ * UDP socket unless it belongs to a listener.
+ * 
+ * @param socket a microTCP socket object
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_close(microtcp_sock_t * socket);
+
 /**
  * @brief 
  * 
@@ -159,26 +595,35 @@ int microtcp_accept(microtcp_sock_t * __restrict__ socket, struct sockaddr * __r
 int microtcp_shutdown(microtcp_sock_t *socket, int how);
 
 /**
- * @brief 
+ * @brief Copies 'buffer' into the send buffer of the socket and puts on the wire what
+ * MIN(cwnd, peer window) allows. The call returns as soon as the data is copied, it blocks
+ * only while the buffer is full. The rest is transmitted (and retransmitted) by the later
+ * calls on the socket, microtcp_shutdown() waits for it to be acknowledged. A non-blocking
+ * socket copies what fits. The segments of large buffers go out with MSG_ZEROCOPY if
+ * MICROTCP_SO_ZEROCOPY is enabled.
  * 
- * @param socket 
- * @param buffer 
- * @param length 
+ * @param socket a valid microTCP socket object
+ * @param buffer the data to be sent, it may be reused once the call returns
+ * @param length size of 'buffer'
  * @param flags NOT SUPPORTED
- * @return ssize_t 
+ * @return the number of bytes sent (less than 'length' only for a non-blocking socket),
+ * else -1
  */
 ssize_t microtcp_send(microtcp_sock_t * __restrict__ socket, const void * __restrict__ buffer, size_t length,
                int flags);
 
 /**
  * @brief The receive calls normally return any data available, up to the requested amount rather
- * than waiting for receipt of the full amount requested.
+ * than waiting for receipt of the full amount requested. The data is a byte stream, a segment
+ * that does not fit in 'buffer' is returned by the next calls. A blocking call waits for the
+ * first byte, then takes whatever the datagrams already received add.
  * 
  * @param socket a valid microTCP socket object
- * @param buffer 
- * @param length 
+ * @param buffer where the data is stored
+ * @param length size of 'buffer', never overrun
  * @param flags NOT SUPPORTED
- * @return if successfull, it returns the number of bytes read, else -1
+ * @return if successfull, it returns the number of bytes read, else -1 (also at the end of
+ * the stream of a blocking socket, 0 for a non-blocking one)
  */
 ssize_t microtcp_recv(microtcp_sock_t * __restrict__ socket, void * __restrict__ buffer, size_t length, int flags);
 
@@ -18,14 +18,21 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE  /* ppoll() */
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <ifaddrs.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <poll.h>
 #include <time.h>
 #include <stddef.h>
 #include <sys/types.h>
@@ -37,6 +44,127 @@
 
 #define CHUNK_SIZE 4096
 
+/* Per shard counters of the sharded server, each on a cache line of its own */
+struct shard_stats
+{
+  uint64_t bytes;
+  uint64_t connections;
+  struct timespec first;
+  struct timespec last;
+} __attribute__((aligned (64)));
+
+struct sharded_server
+{
+  struct shard_stats *stats;
+  sem_t done;
+};
+
+/* The connections of the event loop modes */
+struct loop_state
+{
+  const uint8_t *data;
+  size_t len;
+  int done;
+  uint64_t bytes;
+  struct timespec first;
+  struct timespec last;
+};
+
+struct loop_conn
+{
+  microtcp_sock_t sock;
+  struct loop_state *st;
+  size_t off;
+  int closing;
+};
+
+/* Options of the single connection of server_microtcp() and client_microtcp() */
+struct conn_options
+{
+  int use_uring;
+  int use_gso;
+  uint32_t congestion;           /* MICROTCP_CC_* */
+  uint32_t pacing;               /* MICROTCP_PACING_* */
+  double loss;                   /* Drop rate of the relay of the client, none if 0 */
+  double rate;                   /* Bottleneck of the relay in bytes per second, none if 0 */
+  unsigned int queue;            /* Datagrams that the queue of the bottleneck holds */
+  uint64_t delay;                /* One-way propagation delay of the relay in us, none if 0 */
+  uint32_t rcvbuf;               /* Receive and send buffers of microTCP and size of the messages, the defaults if 0 */
+  int isn_wrap;                  /* The sequence numbers start at ISN_WRAP */
+};
+
+#define ISN_WRAP 0xffff0000U       /* 64 KB below 2^32, the sequence numbers wrap early in a transfer */
+
+#define RELAY_QUEUE_MAX 4096
+#define RELAY_LINE_LEN 8192
+#define RELAY_RCVBUF (8 << 20)     /* capped by net.core.rmem_max */
+#define RELAY_RTO_MIN 200000       /* us, with a propagation delay */
+#define RELAY_DGRAM_LEN 2048
+
+/* A datagram in the queue of the bottleneck or on the delay line of a relay */
+struct relay_dgram
+{
+  uint64_t departure;            /* us */
+  struct sockaddr_in to;
+  size_t len;
+  uint8_t buf[RELAY_DGRAM_LEN];
+};
+
+/*
+ * A UDP relay on the loopback between the client and the server, an emulated
+ * path: it drops a random fraction of the datagrams in both directions, and the
+ * datagrams of the client may go through a bottleneck, a link of 'rate' bytes per
+ * second behind a drop-tail queue of 'queue' datagrams. Both directions may be
+ * delayed by 'delay' on a line that holds RELAY_LINE_LEN datagrams.
+ */
+struct relay
+{
+  pthread_t thread;
+  int sd;
+  struct sockaddr_in server;
+  double loss;
+  double rate;
+  unsigned int queue;
+  uint64_t delay;
+  struct relay_dgram *line;
+  unsigned int line_head;
+  unsigned int line_len;
+  unsigned int seed;
+  volatile int stop;
+  uint64_t forwarded;
+  uint64_t dropped;
+  struct relay_dgram *q;
+  unsigned int q_head;
+  unsigned int q_len;
+  uint64_t link_free;            /* the bottleneck is done with the queued datagrams (us) */
+  uint64_t overflows;            /* datagrams dropped by the full queue */
+  uint64_t queued;               /* datagrams that went through the bottleneck */
+  uint64_t qdelay_sum;           /* their time in the queue (us) */
+  uint64_t qdelay_max;
+};
+
+struct client_thread
+{
+  pthread_t thread;
+  const char *serverip;
+  uint16_t server_port;
+  const uint8_t *data;
+  size_t len;
+  int ret;
+};
+
+static inline double
+elapsed_seconds (struct timespec start, struct timespec end)
+{
+  return end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+static inline int
+timespec_before (struct timespec a, struct timespec b)
+{
+  return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
 static inline void
 print_statistics (ssize_t received, struct timespec start, struct timespec end)
 {
@@ -48,6 +176,172 @@ print_statistics (ssize_t received, struct timespec start, struct timespec end)
   printf ("Throughput achieved: %f MB/s\n", megabytes / elapsed);
 }
 
+static inline void
+print_batch_statistics (const microtcp_sock_t *sock)
+{
+  printf ("Send batches: %" PRIu64 ", avg %.2f, max %" PRIu32 " datagrams\n",
+          sock->tx_batches,
+          sock->tx_batches ? (double) sock->tx_batched / sock->tx_batches : 0.0,
+          sock->tx_batch_max);
+  printf ("Receive batches: %" PRIu64 ", avg %.2f, max %" PRIu32 " datagrams\n",
+          sock->rx_batches,
+          sock->rx_batches ? (double) sock->rx_batched / sock->rx_batches : 0.0,
+          sock->rx_batch_max);
+}
+
+/* The congestion control of the sender at the end of the transfer */
+static inline void
+print_congestion_statistics (const microtcp_sock_t *sock)
+{
+  printf ("Congestion window: %zu bytes, ssthresh %zu bytes\n",
+          sock->cwnd, sock->ssthresh);
+  printf ("Segments lost: %" PRIu64 " (%" PRIu64 " bytes), RTO %" PRIu32 " us\n",
+          sock->packets_lost, sock->bytes_lost, sock->rto);
+  printf ("Fast retransmits: %" PRIu64 ", zero-window probes: %" PRIu64 "\n",
+          sock->fast_retrans, sock->zwp_sent);
+  if (sock->pacing)
+    printf ("Pacing: %s, %" PRIu64 " segments waited for their departure time\n",
+            sock->pacing == MICROTCP_PACING_TXTIME ? "SO_TXTIME" : "timers",
+            sock->paced);
+}
+
+/* The ACKs of the receiver, the delayed ones make fewer of them */
+static inline void
+print_ack_statistics (const microtcp_sock_t *sock)
+{
+  printf ("ACKs: %" PRIu64 " sent, %" PRIu64 " by the delayed ACK timer, "
+          "%.2f segments received per ACK\n",
+          sock->acks_sent, sock->acks_delayed,
+          sock->acks_sent ? (double) sock->packets_received / sock->acks_sent : 0.0);
+}
+
+/* The payload that skipped the receive buffer of microTCP */
+static inline void
+print_recv_statistics (const microtcp_sock_t *sock)
+{
+  printf ("Received in place: %" PRIu64 " of %" PRIu64 " bytes (%.1f%%)\n",
+          sock->bytes_direct, sock->bytes_received,
+          sock->bytes_received ? 100.0 * sock->bytes_direct / sock->bytes_received : 0.0);
+}
+
+/* The segment slots that the batches of all the connections of the process share */
+static inline void
+print_pool_statistics (void)
+{
+  microtcp_pool_stats_t pool;
+
+  if (microtcp_pool_stats (&pool))
+    return;
+  printf ("Segment pool: %" PRIu64 " slots of %" PRIu64 " bytes in %" PRIu64
+          " chunks, %" PRIu64 " in use, high-water %" PRIu64 "\n",
+          pool.slots, pool.slot_len, pool.chunks, pool.in_use, pool.high_water);
+}
+
+/* User plus system CPU time of the process, in seconds */
+static double
+cpu_seconds (void)
+{
+  struct rusage ru;
+
+  getrusage (RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+      + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+}
+
+/* The cost of the datagram I/O backend of a connection that moved 'bytes' */
+static inline void
+print_backend_statistics (const microtcp_sock_t *sock, uint64_t bytes,
+                          double elapsed, double cpu)
+{
+  printf ("Datagram I/O: %s\n",
+          sock->uring ? "io_uring" : "sendmmsg()/recvmmsg()");
+  printf ("Datagrams: %" PRIu64 " sent, %" PRIu64 " received, %.0f per second\n",
+          sock->tx_batched, sock->rx_batched,
+          (sock->tx_batched + sock->rx_batched) / elapsed);
+  printf ("CPU time: %f seconds, %f seconds per GB\n",
+          cpu, bytes ? cpu / (bytes / 1e9) : 0.0);
+  if (sock->gso || sock->gso_sent || sock->gro_rcvd)
+    printf ("Super-datagrams: %" PRIu64 " sent (UDP_SEGMENT), %" PRIu64 " received (UDP_GRO)\n",
+            sock->gso_sent, sock->gro_rcvd);
+}
+
+/* The connection goes on without the option if the kernel does not support it */
+static void
+enable_option (microtcp_sock_t *sock, int optname, const char *fallback)
+{
+  uint32_t on = 1;
+
+  if (microtcp_setsockopt (sock, optname, &on, sizeof(on)) < 0)
+    perror (fallback);
+}
+
+static void
+enable_options (microtcp_sock_t *sock, const struct conn_options *opts)
+{
+  if (opts->use_uring)
+    enable_option (sock, MICROTCP_SO_IO_URING, "io_uring, using sockets instead");
+  if (opts->use_gso)
+    enable_option (sock, MICROTCP_SO_GSO, "UDP GSO/GRO, sending datagram by datagram");
+  if (microtcp_setsockopt (sock, MICROTCP_SO_CONG, &opts->congestion,
+                           sizeof(opts->congestion)) < 0)
+    perror ("Congestion control, using Reno instead");
+  if (opts->pacing
+      && microtcp_setsockopt (sock, MICROTCP_SO_PACING, &opts->pacing,
+                              sizeof(opts->pacing)) < 0)
+    perror ("Pacing, sending the window back-to-back");
+}
+
+/*
+ * The window scale follows the receive buffer, both are set before the handshake.
+ * The send buffer holds the window in flight, it gets the same size.
+ */
+static void
+set_socket_buffers (microtcp_sock_t *sock, const struct conn_options *opts)
+{
+  if (opts->rcvbuf
+      && microtcp_setsockopt (sock, MICROTCP_SO_RCVBUF, &opts->rcvbuf,
+                              sizeof(opts->rcvbuf)) < 0)
+    perror ("Receive buffer, using the default instead");
+  if (opts->rcvbuf
+      && microtcp_setsockopt (sock, MICROTCP_SO_SNDBUF, &opts->rcvbuf,
+                              sizeof(opts->rcvbuf)) < 0)
+    perror ("Send buffer, using the default instead");
+}
+
+/*
+ * The RTT of a path with a propagation delay hardly varies, an RTO that follows
+ * it that closely fires on any scheduling hiccup of the loopback. It is kept at
+ * the 200 ms floor of the TCP of Linux instead of the 1 ms one of microTCP.
+ */
+static void
+set_path_rto (microtcp_sock_t *sock, const struct conn_options *opts)
+{
+  uint32_t rto_min = RELAY_RTO_MIN;
+
+  if (opts->delay
+      && microtcp_setsockopt (sock, MICROTCP_SO_RTO_MIN, &rto_min,
+                              sizeof(rto_min)) < 0)
+    perror ("Minimum RTO of the delayed path");
+}
+
+/*
+ * Picks the initial sequence number in place of microtcp_socket(), before the
+ * handshake sends it, so that the wrap of the sequence space is exercised.
+ */
+static void
+set_isn (microtcp_sock_t *sock, const struct conn_options *opts)
+{
+  if (opts->isn_wrap)
+    sock->seq_number = ISN_WRAP;
+}
+
+/* Messages as large as the receive buffer keep a window of it in flight */
+static inline size_t
+message_size (const struct conn_options *opts)
+{
+  return opts->rcvbuf ? opts->rcvbuf : CHUNK_SIZE;
+}
+
 int
 server_tcp (uint16_t listen_port, const char *file)
 {
@@ -157,9 +451,298 @@ server_tcp (uint16_t listen_port, const char *file)
 }
 
 int
-server_microtcp (uint16_t listen_port, const char *file)
+server_microtcp (uint16_t listen_port, const char *file,
+                 const struct conn_options *opts)
+{
+  uint8_t *buffer;
+  FILE *fp;
+  microtcp_sock_t sock;
+  ssize_t received;
+  ssize_t written;
+  ssize_t total_bytes = 0;
+
+  struct sockaddr_in sin;
+  struct sockaddr_in client_addr;
+  struct timespec start_time;
+  struct timespec end_time;
+  double cpu;
+
+  /* Allocate memory for the application receive buffer */
+  buffer = (uint8_t *) malloc (message_size (opts));
+  if (!buffer) {
+    perror ("Allocate application receive buffer");
+    return -EXIT_FAILURE;
+  }
+
+  /* Open the file for writing the data from the network */
+  fp = fopen (file, "w");
+  if (!fp) {
+    perror ("Open file for writing");
+    free (buffer);
+    return -EXIT_FAILURE;
+  }
+
+  sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  if (sock.sd < 0) {
+    perror ("Opening microTCP socket");
+    free (buffer);
+    fclose (fp);
+    return -EXIT_FAILURE;
+  }
+
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (listen_port);
+  /* Bind to all available network interfaces */
+  sin.sin_addr.s_addr = INADDR_ANY;
+
+  if (microtcp_bind (&sock, (struct sockaddr *) &sin,
+                     sizeof(struct sockaddr_in)) == -1) {
+    perror ("microTCP bind");
+    free (buffer);
+    fclose (fp);
+    return -EXIT_FAILURE;
+  }
+
+  set_socket_buffers (&sock, opts);
+  set_isn (&sock, opts);
+
+  /* Accept a connection from the client */
+  if (microtcp_accept (&sock, (struct sockaddr *) &client_addr,
+                       sizeof(struct sockaddr_in)) != 0) {
+    perror ("microTCP accept");
+    free (buffer);
+    fclose (fp);
+    return -EXIT_FAILURE;
+  }
+
+  enable_options (&sock, opts);
+
+  /* The peer's FIN makes microtcp_recv() close the connection and return -1 */
+  clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
+  cpu = cpu_seconds ();
+  while ((received = microtcp_recv (&sock, buffer, message_size (opts), 0)) > 0) {
+    written = fwrite (buffer, sizeof(uint8_t), received, fp);
+    total_bytes += received;
+    if ((ssize_t) (written * sizeof(uint8_t)) != received) {
+      printf ("Failed to write to the file the"
+              " amount of data received from the network.\n");
+      microtcp_shutdown (&sock, SHUTDOWN_CLIENT);
+      microtcp_close (&sock);
+      free (buffer);
+      fclose (fp);
+      return -EXIT_FAILURE;
+    }
+  }
+  clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
+  cpu = cpu_seconds () - cpu;
+  print_statistics (total_bytes, start_time, end_time);
+  print_batch_statistics (&sock);
+  print_backend_statistics (&sock, total_bytes,
+                            elapsed_seconds (start_time, end_time), cpu);
+  print_ack_statistics (&sock);
+  print_recv_statistics (&sock);
+  print_pool_statistics ();
+
+  microtcp_close (&sock);
+  fclose (fp);
+  free (buffer);
+
+  return 0;
+}
+
+/* Runs on the thread of the shard, nothing here is shared with the other shards */
+static void
+serve_connection (microtcp_sock_t *sock, int shard, void *arg)
+{
+  struct sharded_server *srv = (struct sharded_server *) arg;
+  struct shard_stats *stats = &srv->stats[shard];
+  uint8_t buffer[CHUNK_SIZE];
+  ssize_t received;
+  struct timespec start_time;
+
+  clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
+  if (!stats->connections)
+    stats->first = start_time;
+
+  while ((received = microtcp_recv (sock, buffer, CHUNK_SIZE, 0)) > 0)
+    stats->bytes += received;
+
+  clock_gettime (CLOCK_MONOTONIC_RAW, &stats->last);
+  stats->connections++;
+  sem_post (&srv->done);
+}
+
+/*
+ * Serves 'clients' connections with a sharded server of 'shards' threads and
+ * reports the aggregate throughput. The data of the clients is discarded.
+ */
+int
+server_microtcp_sharded (uint16_t listen_port, int shards, int clients)
+{
+  struct sharded_server srv;
+  microtcp_server_t *server;
+  struct sockaddr_in sin;
+  struct timespec start_time;
+  struct timespec end_time;
+  uint64_t total_bytes = 0;
+  int started = 0;
+  int i;
+
+  if (shards <= 0)
+    shards = sysconf (_SC_NPROCESSORS_ONLN);
+
+  srv.stats = (struct shard_stats *) aligned_alloc (
+      64, shards * sizeof(struct shard_stats));
+  if (!srv.stats) {
+    perror ("Allocate shard statistics");
+    return -EXIT_FAILURE;
+  }
+  memset (srv.stats, 0, shards * sizeof(struct shard_stats));
+  sem_init (&srv.done, 0, 0);
+
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (listen_port);
+  /* Bind to all available network interfaces */
+  sin.sin_addr.s_addr = INADDR_ANY;
+
+  server = microtcp_server_start (AF_INET, (struct sockaddr *) &sin,
+                                  sizeof(struct sockaddr_in), shards,
+                                  serve_connection, &srv);
+  if (!server) {
+    perror ("microTCP sharded server");
+    sem_destroy (&srv.done);
+    free (srv.stats);
+    return -EXIT_FAILURE;
+  }
+
+  printf ("Serving %d clients with %d shards...\n", clients, shards);
+  for (i = 0; i < clients; i++)
+    sem_wait (&srv.done);
+
+  microtcp_server_stop (server);
+
+  for (i = 0; i < shards; i++) {
+    if (!srv.stats[i].connections)
+      continue;
+    printf ("Shard %d: %" PRIu64 " connections, %f MB\n", i,
+            srv.stats[i].connections, srv.stats[i].bytes / (1024.0 * 1024.0));
+    if (!started || timespec_before (srv.stats[i].first, start_time))
+      start_time = srv.stats[i].first;
+    if (!started || timespec_before (end_time, srv.stats[i].last))
+      end_time = srv.stats[i].last;
+    started = 1;
+    total_bytes += srv.stats[i].bytes;
+  }
+  print_statistics (total_bytes, start_time, end_time);
+  print_pool_statistics ();
+
+  sem_destroy (&srv.done);
+  free (srv.stats);
+  return 0;
+}
+
+static void
+loop_server_event (microtcp_loop_t *loop, microtcp_sock_t *sock,
+                   uint32_t events, void *arg)
+{
+  struct loop_conn *conn = (struct loop_conn *) arg;
+  struct loop_state *st = conn->st;
+  uint8_t buffer[CHUNK_SIZE];
+  ssize_t received;
+
+  if (events & MICROTCP_EV_READABLE) {
+    while ((received = microtcp_recv (sock, buffer, CHUNK_SIZE, 0)) > 0)
+      st->bytes += received;
+    /* The end of the stream, the FIN of the peer is being answered */
+    if (!received)
+      microtcp_loop_mod (loop, sock, 0);
+  }
+
+  if (events & MICROTCP_EV_CLOSED) {
+    clock_gettime (CLOCK_MONOTONIC_RAW, &st->last);
+    microtcp_close (sock);
+    free (conn);
+    st->done++;
+  }
+}
+
+static void
+loop_server_accept (microtcp_loop_t *loop, microtcp_listener_t *listener,
+                    void *arg)
+{
+  struct loop_state *st = (struct loop_state *) arg;
+  struct loop_conn *conn;
+
+  for (;;) {
+    conn = (struct loop_conn *) calloc (1, sizeof(*conn));
+    if (!conn)
+      return;
+    if (microtcp_listener_accept (listener, &conn->sock, NULL, NULL)) {
+      if (errno != EAGAIN)
+        perror ("microTCP accept");
+      free (conn);
+      return;
+    }
+    if (!st->bytes && !st->done)
+      clock_gettime (CLOCK_MONOTONIC_RAW, &st->first);
+    conn->st = st;
+    if (microtcp_loop_add (loop, &conn->sock, MICROTCP_EV_READABLE,
+                           loop_server_event, conn)) {
+      perror ("Add the connection to the loop");
+      microtcp_close (&conn->sock);
+      free (conn);
+      st->done++;
+    }
+  }
+}
+
+/*
+ * Serves 'clients' concurrent connections from a single thread with an event
+ * loop and reports the aggregate throughput. The data of the clients is discarded.
+ */
+int
+server_microtcp_loop (uint16_t listen_port, int clients)
 {
-  /*TODO: Write your code here */
+  struct loop_state st;
+  microtcp_listener_t *listener;
+  microtcp_loop_t *loop;
+  struct sockaddr_in sin;
+
+  memset (&st, 0, sizeof(st));
+
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (listen_port);
+  /* Bind to all available network interfaces */
+  sin.sin_addr.s_addr = INADDR_ANY;
+
+  listener = microtcp_listen (AF_INET, (struct sockaddr *) &sin,
+                              sizeof(struct sockaddr_in), clients);
+  loop = microtcp_loop_new ();
+  if (!listener || !loop
+      || microtcp_loop_add_listener (loop, listener, loop_server_accept, &st)) {
+    perror ("microTCP event loop server");
+    if (loop)
+      microtcp_loop_free (loop);
+    if (listener)
+      microtcp_listener_close (listener);
+    return -EXIT_FAILURE;
+  }
+
+  printf ("Serving %d clients with an event loop...\n", clients);
+  while (st.done < clients)
+    if (microtcp_poll (loop, -1) < 0) {
+      perror ("microTCP poll");
+      break;
+    }
+
+  print_statistics (st.bytes, st.first, st.last);
+  print_pool_statistics ();
+
+  microtcp_loop_free (loop);
+  microtcp_listener_close (listener);
   return 0;
 }
 
@@ -245,13 +828,556 @@ client_tcp (const char *serverip, uint16_t server_port, const char *file)
   return 0;
 }
 
+static inline uint64_t
+now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* A datagram leaves for 'to', 'delay' later if the path has a propagation delay */
+static void
+relay_transmit (struct relay *relay, const uint8_t *buf, size_t len,
+                const struct sockaddr_in *to)
+{
+  struct relay_dgram *d;
+
+  if (!relay->delay) {
+    sendto (relay->sd, buf, len, 0, (const struct sockaddr *) to, sizeof(*to));
+    return;
+  }
+
+  if (relay->line_len == RELAY_LINE_LEN || len > RELAY_DGRAM_LEN) {
+    relay->overflows++;
+    return;
+  }
+
+  d = &relay->line[(relay->line_head + relay->line_len++) % RELAY_LINE_LEN];
+  d->departure = now_us () + relay->delay;
+  d->to = *to;
+  d->len = len;
+  memcpy (d->buf, buf, len);
+}
+
+/* A datagram of the client enters the queue of the bottleneck, unless it is full */
+static void
+relay_enqueue (struct relay *relay, const uint8_t *buf, size_t len)
+{
+  struct relay_dgram *d;
+  uint64_t now = now_us ();
+  uint64_t start;
+
+  if (relay->q_len == relay->queue || len > RELAY_DGRAM_LEN) {
+    relay->overflows++;
+    return;
+  }
+
+  start = relay->link_free > now ? relay->link_free : now;
+  relay->link_free = start + (uint64_t) (len / relay->rate * 1e6);
+  relay->queued++;
+  relay->qdelay_sum += start - now;
+  if (start - now > relay->qdelay_max)
+    relay->qdelay_max = start - now;
+
+  d = &relay->q[(relay->q_head + relay->q_len++) % relay->queue];
+  d->departure = relay->link_free;
+  d->len = len;
+  memcpy (d->buf, buf, len);
+}
+
+static void *
+relay_thread (void *arg)
+{
+  struct relay *relay = (struct relay *) arg;
+  struct sockaddr_in client;
+  struct sockaddr_in from;
+  socklen_t from_len;
+  struct pollfd pfd;
+  struct timespec ts;
+  struct relay_dgram *d;
+  uint8_t buf[65536];
+  uint64_t wait;
+  uint64_t now;
+  ssize_t len;
+
+  memset (&client, 0, sizeof(client));
+  pfd.fd = relay->sd;
+  pfd.events = POLLIN;
+  while (!relay->stop) {
+    /* The bottleneck passes on the datagrams that are through */
+    now = now_us ();
+    while (relay->q_len && relay->q[relay->q_head].departure <= now) {
+      d = &relay->q[relay->q_head];
+      relay_transmit (relay, d->buf, d->len, &relay->server);
+      relay->q_head = (relay->q_head + 1) % relay->queue;
+      relay->q_len--;
+    }
+
+    /* and the delay line the datagrams that reached the other end */
+    while (relay->line_len && relay->line[relay->line_head].departure <= now) {
+      d = &relay->line[relay->line_head];
+      sendto (relay->sd, d->buf, d->len, 0, (struct sockaddr *) &d->to,
+              sizeof(d->to));
+      relay->line_head = (relay->line_head + 1) % RELAY_LINE_LEN;
+      relay->line_len--;
+    }
+
+    wait = relay->q_len ? relay->q[relay->q_head].departure - now : 100000;
+    if (relay->line_len && relay->line[relay->line_head].departure - now < wait)
+      wait = relay->line[relay->line_head].departure - now;
+    ts.tv_sec = wait / 1000000;
+    ts.tv_nsec = (wait % 1000000) * 1000;
+    if (ppoll (&pfd, 1, &ts, NULL) <= 0)
+      continue;
+
+    from_len = sizeof(from);
+    len = recvfrom (relay->sd, buf, sizeof(buf), 0, (struct sockaddr *) &from,
+                    &from_len);
+    if (len < 0)
+      continue;
+
+    if (rand_r (&relay->seed) < relay->loss * ((double) RAND_MAX + 1.0)) {
+      relay->dropped++;
+      continue;
+    }
+    relay->forwarded++;
+
+    /* Anything that is not from the server comes from the client */
+    if (from.sin_port == relay->server.sin_port
+        && from.sin_addr.s_addr == relay->server.sin_addr.s_addr) {
+      if (client.sin_family == AF_INET)
+        relay_transmit (relay, buf, len, &client);
+    }
+    else {
+      client = from;
+      if (relay->rate > 0)
+        relay_enqueue (relay, buf, len);
+      else
+        relay_transmit (relay, buf, len, &relay->server);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Starts a relay to 'server' on an ephemeral port of the loopback and points
+ * 'server' to it
+ */
+static int
+relay_start (struct relay *relay, struct sockaddr_in *server,
+             const struct conn_options *opts)
+{
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  int rcvbuf = RELAY_RCVBUF;
+
+  memset (relay, 0, sizeof(*relay));
+  relay->server = *server;
+  relay->loss = opts->loss;
+  relay->rate = opts->rate;
+  relay->queue = opts->queue;
+  relay->delay = opts->delay;
+  relay->seed = time (NULL);
+
+  if ((relay->rate > 0
+       && !(relay->q = (struct relay_dgram *) malloc (relay->queue * sizeof(*relay->q))))
+      || (relay->delay
+          && !(relay->line = (struct relay_dgram *) malloc (RELAY_LINE_LEN * sizeof(*relay->line))))) {
+    free (relay->q);
+    return -1;
+  }
+
+  relay->sd = socket (AF_INET, SOCK_DGRAM, 0);
+  if (relay->sd < 0) {
+    free (relay->q);
+    free (relay->line);
+    return -1;
+  }
+  /* A window in flight arrives at once, only the queue of the bottleneck may drop it */
+  setsockopt (relay->sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+  memset (&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (bind (relay->sd, (struct sockaddr *) &sin, sizeof(sin)) < 0
+      || getsockname (relay->sd, (struct sockaddr *) &sin, &len) < 0
+      || pthread_create (&relay->thread, NULL, relay_thread, relay)) {
+    close (relay->sd);
+    free (relay->q);
+    free (relay->line);
+    return -1;
+  }
+
+  *server = sin;
+  return 0;
+}
+
+static void
+relay_stop (struct relay *relay)
+{
+  uint64_t total;
+
+  relay->stop = 1;
+  pthread_join (relay->thread, NULL);
+  close (relay->sd);
+  total = relay->forwarded + relay->dropped;
+  printf ("Relay: %" PRIu64 " datagrams forwarded, %" PRIu64 " dropped (%.2f%%)\n",
+          relay->forwarded, relay->dropped,
+          total ? 100.0 * relay->dropped / total : 0.0);
+  if (relay->rate > 0 || relay->delay) {
+    total = relay->queued + relay->overflows;
+    printf ("Bottleneck: %" PRIu64 " datagrams overflowed the queue (%.2f%%), "
+            "queueing delay %.1f us on average, %" PRIu64 " us at most\n",
+            relay->overflows, total ? 100.0 * relay->overflows / total : 0.0,
+            relay->queued ? (double) relay->qdelay_sum / relay->queued : 0.0,
+            relay->qdelay_max);
+  }
+  free (relay->q);
+  free (relay->line);
+}
+
 int
-client_microtcp (const char *serverip, uint16_t server_port, const char *file)
+client_microtcp (const char *serverip, uint16_t server_port, const char *file,
+                 const struct conn_options *opts)
 {
-  /*TODO: Write your code here */
+  uint8_t *buffer;
+  microtcp_sock_t sock;
+  FILE *fp;
+  size_t read_items = 0;
+  ssize_t data_sent;
+  uint64_t total_bytes = 0;
+  struct timespec start_time;
+  struct timespec end_time;
+  struct relay relay;
+  double cpu;
+
+  /* Allocate memory for the application send buffer */
+  buffer = (uint8_t *) malloc (message_size (opts));
+  if (!buffer) {
+    perror ("Allocate application send buffer");
+    return -EXIT_FAILURE;
+  }
+
+  /* Open the file for reading the data that will be sent */
+  fp = fopen (file, "r");
+  if (!fp) {
+    perror ("Open file for reading");
+    free (buffer);
+    return -EXIT_FAILURE;
+  }
+
+  sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  if (sock.sd < 0) {
+    perror ("Opening microTCP socket");
+    free (buffer);
+    fclose (fp);
+    return -EXIT_FAILURE;
+  }
+
+  struct sockaddr_in sin;
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  /*Port that server listens at */
+  sin.sin_port = htons (server_port);
+  /* The server's IP*/
+  sin.sin_addr.s_addr = inet_addr (serverip);
+
+  if ((opts->loss > 0 || opts->rate > 0 || opts->delay) && relay_start (&relay, &sin, opts) < 0) {
+    perror ("Start the relay of the emulated path");
+    exit (EXIT_FAILURE);
+  }
+
+  set_socket_buffers (&sock, opts);
+  set_isn (&sock, opts);
+
+  if (microtcp_connect (&sock, (struct sockaddr *) &sin,
+                        sizeof(struct sockaddr_in)) != 0) {
+    perror ("microTCP connect");
+    exit (EXIT_FAILURE);
+  }
+
+  enable_options (&sock, opts);
+  set_path_rto (&sock, opts);
+
+  printf ("Starting sending data...\n");
+  clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
+  cpu = cpu_seconds ();
+  /* Start sending the data */
+  while (!feof (fp)) {
+    read_items = fread (buffer, sizeof(uint8_t), message_size (opts), fp);
+    if (read_items < 1) {
+      if (feof (fp))
+        break;
+      perror ("Failed read from file");
+      microtcp_shutdown (&sock, SHUTDOWN_CLIENT);
+      free (buffer);
+      fclose (fp);
+      return -EXIT_FAILURE;
+    }
+
+    data_sent = microtcp_send (&sock, buffer, read_items * sizeof(uint8_t), 0);
+    if (data_sent != (ssize_t) (read_items * sizeof(uint8_t))) {
+      printf ("Failed to send the"
+              " amount of data read from the file.\n");
+      microtcp_shutdown (&sock, SHUTDOWN_CLIENT);
+      free (buffer);
+      fclose (fp);
+      return -EXIT_FAILURE;
+    }
+    total_bytes += data_sent;
+  }
+
+  printf ("Data sent. Terminating...\n");
+  microtcp_shutdown (&sock, SHUTDOWN_CLIENT);
+  clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
+  cpu = cpu_seconds () - cpu;
+  print_batch_statistics (&sock);
+  print_backend_statistics (&sock, total_bytes,
+                            elapsed_seconds (start_time, end_time), cpu);
+  print_congestion_statistics (&sock);
+  print_pool_statistics ();
+  if (opts->loss > 0 || opts->rate > 0 || opts->delay)
+    relay_stop (&relay);
+  microtcp_close (&sock);
+  free (buffer);
+  fclose (fp);
   return 0;
 }
 
+/* Reads a whole file in memory */
+static uint8_t *
+load_file (const char *file, size_t *len)
+{
+  uint8_t *data;
+  FILE *fp;
+  long size;
+
+  fp = fopen (file, "r");
+  if (!fp)
+    return NULL;
+  fseek (fp, 0, SEEK_END);
+  size = ftell (fp);
+  rewind (fp);
+
+  data = (uint8_t *) malloc (size > 0 ? size : 1);
+  if (data && fread (data, 1, size, fp) != (size_t) size) {
+    free (data);
+    data = NULL;
+  }
+  fclose (fp);
+  *len = size;
+  return data;
+}
+
+static void *
+client_microtcp_thread (void *arg)
+{
+  struct client_thread *ct = (struct client_thread *) arg;
+  microtcp_sock_t sock;
+  struct sockaddr_in sin;
+  size_t chunk = 0;
+  size_t off;
+
+  ct->ret = -EXIT_FAILURE;
+
+  sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  if (sock.sd < 0) {
+    perror ("Opening microTCP socket");
+    return NULL;
+  }
+
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (ct->server_port);
+  sin.sin_addr.s_addr = inet_addr (ct->serverip);
+
+  if (microtcp_connect (&sock, (struct sockaddr *) &sin,
+                        sizeof(struct sockaddr_in)) != 0) {
+    perror ("microTCP connect");
+    microtcp_close (&sock);
+    return NULL;
+  }
+
+  /* In CHUNK_SIZE messages, as the receiver reads them */
+  for (off = 0; off < ct->len; off += chunk) {
+    chunk = ct->len - off < CHUNK_SIZE ? ct->len - off : CHUNK_SIZE;
+    if (microtcp_send (&sock, ct->data + off, chunk, 0) != (ssize_t) chunk) {
+      printf ("Failed to send the whole file.\n");
+      break;
+    }
+  }
+  if (off >= ct->len)
+    ct->ret = 0;
+
+  microtcp_shutdown (&sock, SHUTDOWN_CLIENT);
+  microtcp_close (&sock);
+  return NULL;
+}
+
+/*
+ * Sends the file over 'clients' concurrent connections, one thread each,
+ * and reports the aggregate throughput.
+ */
+int
+client_microtcp_multi (const char *serverip, uint16_t server_port,
+                       const char *file, int clients)
+{
+  struct client_thread *threads;
+  struct timespec start_time;
+  struct timespec end_time;
+  uint8_t *data;
+  size_t len;
+  int ret = 0;
+  int i;
+
+  /* Every client sends the same copy of the file */
+  data = load_file (file, &len);
+  threads = (struct client_thread *) calloc (clients, sizeof(*threads));
+  if (!data || !threads) {
+    perror ("Read the file");
+    free (data);
+    free (threads);
+    return -EXIT_FAILURE;
+  }
+
+  printf ("Starting %d clients...\n", clients);
+  clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
+  for (i = 0; i < clients; i++) {
+    threads[i].serverip = serverip;
+    threads[i].server_port = server_port;
+    threads[i].data = data;
+    threads[i].len = len;
+    if (pthread_create (&threads[i].thread, NULL, client_microtcp_thread,
+                        &threads[i])) {
+      perror ("Start client thread");
+      clients = i;
+      ret = -EXIT_FAILURE;
+      break;
+    }
+  }
+
+  for (i = 0; i < clients; i++) {
+    pthread_join (threads[i].thread, NULL);
+    if (threads[i].ret)
+      ret = -EXIT_FAILURE;
+  }
+  clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
+
+  printf ("Data sent. Terminating...\n");
+  print_statistics ((ssize_t) len * clients, start_time, end_time);
+  print_pool_statistics ();
+
+  free (threads);
+  free (data);
+  return ret;
+}
+
+static void
+loop_client_event (microtcp_loop_t *loop, microtcp_sock_t *sock,
+                   uint32_t events, void *arg)
+{
+  struct loop_conn *conn = (struct loop_conn *) arg;
+  struct loop_state *st = conn->st;
+  size_t chunk;
+  ssize_t sent;
+
+  /* The send buffer has room, the next chunk (or what fits of it) goes in */
+  if ((events & MICROTCP_EV_WRITABLE) && conn->off < st->len) {
+    chunk = st->len - conn->off < CHUNK_SIZE ? st->len - conn->off : CHUNK_SIZE;
+    if ((sent = microtcp_send (sock, st->data + conn->off, chunk, 0)) > 0)
+      conn->off += sent;
+    else if (errno != EAGAIN)
+      perror ("microTCP send");
+  }
+  else if ((events & MICROTCP_EV_WRITABLE) && !conn->closing) {
+    conn->closing = 1;
+    microtcp_loop_mod (loop, sock, 0);
+    if (microtcp_shutdown (sock, SHUTDOWN_CLIENT) && errno != EINPROGRESS)
+      perror ("microTCP shutdown");
+  }
+
+  if (events & MICROTCP_EV_CLOSED) {
+    st->bytes += conn->off;
+    microtcp_close (sock);
+    free (conn);
+    st->done++;
+  }
+}
+
+/*
+ * Sends the file over 'clients' concurrent connections, all of them driven
+ * by a single thread with an event loop, and reports the aggregate throughput.
+ */
+int
+client_microtcp_loop (const char *serverip, uint16_t server_port,
+                      const char *file, int clients)
+{
+  struct loop_state st;
+  struct loop_conn *conn;
+  microtcp_loop_t *loop;
+  struct sockaddr_in sin;
+  int ret = 0;
+  int i;
+
+  memset (&st, 0, sizeof(st));
+  st.data = load_file (file, &st.len);
+  loop = microtcp_loop_new ();
+  if (!st.data || !loop) {
+    perror ("Start the event loop");
+    free ((void *) st.data);
+    return -EXIT_FAILURE;
+  }
+
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (server_port);
+  sin.sin_addr.s_addr = inet_addr (serverip);
+
+  printf ("Starting %d clients...\n", clients);
+  clock_gettime (CLOCK_MONOTONIC_RAW, &st.first);
+  for (i = 0; i < clients; i++) {
+    conn = (struct loop_conn *) calloc (1, sizeof(*conn));
+    if (!conn) {
+      clients = i;
+      ret = -EXIT_FAILURE;
+      break;
+    }
+    conn->st = &st;
+    /* The handshake blocks, the transfer is driven by the loop */
+    conn->sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+    if (conn->sock.sd < 0
+        || microtcp_connect (&conn->sock, (struct sockaddr *) &sin,
+                             sizeof(struct sockaddr_in))
+        || microtcp_loop_add (loop, &conn->sock, MICROTCP_EV_WRITABLE,
+                              loop_client_event, conn)) {
+      perror ("microTCP connect");
+      microtcp_close (&conn->sock);
+      free (conn);
+      clients = i;
+      ret = -EXIT_FAILURE;
+      break;
+    }
+  }
+
+  while (st.done < clients)
+    if (microtcp_poll (loop, -1) < 0) {
+      perror ("microTCP poll");
+      ret = -EXIT_FAILURE;
+      break;
+    }
+  clock_gettime (CLOCK_MONOTONIC_RAW, &st.last);
+
+  printf ("Data sent. Terminating...\n");
+  print_statistics (st.bytes, st.first, st.last);
+  print_pool_statistics ();
+
+  microtcp_loop_free (loop);
+  free ((void *) st.data);
+  return ret;
+}
+
 int
 main (int argc, char **argv)
 {
@@ -260,11 +1386,15 @@ main (int argc, char **argv)
   int exit_code = 0;
   char *filestr = NULL;
   char *ipstr = NULL;
+  int shards = -1;
+  int clients = 1;
+  uint8_t use_loop = 0;
+  struct conn_options opts = { 0, 0, MICROTCP_CC_RENO, MICROTCP_PACING_OFF, 0.0, 0.0, 32, 0, 0, 0 };
   uint8_t is_server = 0;
   uint8_t use_microtcp = 0;
 
   /* A very easy way to parse command line arguments */
-  while ((opt = getopt (argc, argv, "hsmf:p:a:")) != -1) {
+  while ((opt = getopt (argc, argv, "hsmeugic:t:l:b:q:d:r:f:p:a:w:n:")) != -1) {
     switch (opt)
       {
       /* If -s is set, program runs on server mode */
@@ -275,6 +1405,57 @@ main (int argc, char **argv)
       case 'm':
         use_microtcp = 1;
         break;
+      case 'e':
+        use_loop = 1;
+        break;
+      case 'u':
+        opts.use_uring = 1;
+        break;
+      case 'g':
+        opts.use_gso = 1;
+        break;
+      case 'i':
+        opts.isn_wrap = 1;
+        break;
+      case 'c':
+        if (!strcmp (optarg, "cubic"))
+          opts.congestion = MICROTCP_CC_CUBIC;
+        else if (!strcmp (optarg, "bbr"))
+          opts.congestion = MICROTCP_CC_BBR;
+        else if (strcmp (optarg, "reno")) {
+          printf ("Unknown congestion control %s\n", optarg);
+          exit (EXIT_FAILURE);
+        }
+        break;
+      case 't':
+        if (!strcmp (optarg, "timer"))
+          opts.pacing = MICROTCP_PACING_TIMER;
+        else if (!strcmp (optarg, "txtime"))
+          opts.pacing = MICROTCP_PACING_TXTIME;
+        else {
+          printf ("Unknown pacing %s\n", optarg);
+          exit (EXIT_FAILURE);
+        }
+        break;
+      case 'l':
+        opts.loss = atof (optarg);
+        break;
+      case 'b':
+        opts.rate = atof (optarg) * 1024 * 1024;
+        break;
+      case 'q':
+        opts.queue = atoi (optarg);
+        if (opts.queue < 1 || opts.queue > RELAY_QUEUE_MAX) {
+          printf ("The queue holds 1 to %d datagrams\n", RELAY_QUEUE_MAX);
+          exit (EXIT_FAILURE);
+        }
+        break;
+      case 'd':
+        opts.delay = atof (optarg) * 1000;
+        break;
+      case 'r':
+        opts.rcvbuf = atoi (optarg);
+        break;
       case 'f':
         filestr = strdup (optarg);
         /* A few checks will be nice here...*/
@@ -287,10 +1468,16 @@ main (int argc, char **argv)
       case 'a':
         ipstr = strdup (optarg);
         break;
+      case 'w':
+        shards = atoi (optarg);
+        break;
+      case 'n':
+        clients = atoi (optarg);
+        break;
 
       default:
         printf (
-            "Usage: bandwidth_test [-s] [-m] -p port -f file"
+            "Usage: bandwidth_test [-s] [-m] [-e] [-u] [-g] [-i] [-c reno|cubic|bbr] [-t timer|txtime] [-l loss] [-b MB/s] [-q datagrams] [-d ms] [-r bytes] [-w shards] [-n clients] -p port -f file\n"
             "Options:\n"
             "   -s                  If set, the program runs as server. Otherwise as client.\n"
             "   -m                  If set, the program uses the microTCP implementation. Otherwise the normal TCP.\n"
@@ -298,6 +1485,35 @@ main (int argc, char **argv)
             "                       If not, is the source file at the client side that will be sent to the server.\n"
             "   -p <int>            The listening port of the server\n"
             "   -a <string>         The IP address of the server. This option is ignored if the tool runs in server mode.\n"
+            "   -w <int>            With -s -m, serve with a sharded server of this many threads pinned to\n"
+            "                       CPUs (0 for one per CPU). The received data are counted and discarded.\n"
+            "   -n <int>            The number of concurrent clients. The client opens them (with -m),\n"
+            "                       the sharded and event loop servers exit after serving them.\n"
+            "   -e                  With -m, serve or drive all the connections from a single thread\n"
+            "                       with an event loop. The received data are counted and discarded.\n"
+            "   -u                  With -m, a single connection does its datagram I/O through io_uring\n"
+            "                       (sockets if unavailable). The datagram rate and CPU time per GB\n"
+            "                       are reported for either backend.\n"
+            "   -g                  With -m, a single connection sends bursts of segments as UDP GSO\n"
+            "                       super-datagrams and receives GRO-coalesced ones.\n"
+            "   -i                  With -m, a single connection starts its sequence numbers 64 KB\n"
+            "                       below 2^32 on both sides, so that they wrap early in the transfer.\n"
+            "   -c <string>         With -m, the congestion control of a single connection, reno\n"
+            "                       (default), cubic or bbr.\n"
+            "   -t <string>         With -m, a single connection paces its segments, on its timers\n"
+            "                       (timer) or with departure times for the fq qdisc (txtime).\n"
+            "   -l <float>          With -m, the client connects through a relay that drops this\n"
+            "                       fraction (0-1) of the datagrams in both directions at random.\n"
+            "   -b <float>          With -m, the datagrams of the client go through a bottleneck of\n"
+            "                       this many MB/s in the relay. Its queue overflows and queueing\n"
+            "                       delay are reported.\n"
+            "   -q <int>            The datagrams that the queue of the bottleneck holds (default 32).\n"
+            "   -d <float>          With -m, the relay delays the datagrams of both directions by this\n"
+            "                       many ms, a path with a bandwidth-delay product to fill. The RTO of\n"
+            "                       the client is kept above 200 ms.\n"
+            "   -r <int>            With -m, the receive buffer of microTCP in bytes, the largest window\n"
+            "                       (scaled beyond 64 KB), the send buffer and the size of the messages.\n"
+            "                       Give the same to both sides.\n"
             "   -h                  prints this help\n");
         exit (EXIT_FAILURE);
       }
@@ -312,16 +1528,28 @@ main (int argc, char **argv)
    */
   if (is_server) {
 
-    if (use_microtcp) {
-      exit_code = server_microtcp (port, filestr);
+    if (use_microtcp && use_loop) {
+      exit_code = server_microtcp_loop (port, clients);
+    }
+    else if (use_microtcp && shards >= 0) {
+      exit_code = server_microtcp_sharded (port, shards, clients);
+    }
+    else if (use_microtcp) {
+      exit_code = server_microtcp (port, filestr, &opts);
     }
     else {
       exit_code = server_tcp (port, filestr);
     }
   }
   else {
-    if (use_microtcp) {
-      exit_code = client_microtcp (ipstr, port, filestr);
+    if (use_microtcp && use_loop) {
+      exit_code = client_microtcp_loop (ipstr, port, filestr, clients);
+    }
+    else if (use_microtcp && clients > 1) {
+      exit_code = client_microtcp_multi (ipstr, port, filestr, clients);
+    }
+    else if (use_microtcp) {
+      exit_code = client_microtcp (ipstr, port, filestr, &opts);
     }
     else {
       exit_code = client_tcp (ipstr, port, filestr);
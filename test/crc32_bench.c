@@ -0,0 +1,243 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmark of the CRC-32 implementations of utils/crc32.h.
+ * Every implementation is first checked against the byte-at-a-time one
+ * over all the lengths up to 4 KB at every alignment, then its throughput
+ * is measured for a segment sized buffer (MSS) and a large one.
+ * The copying variants (update_crc32_copy*()) are measured against a
+ * memcpy() followed by update_crc32(), which is what they replace.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "../utils/crc32.h"
+
+#define CHECK_LEN 4096
+#define SEGMENT_LEN 1400
+#define LARGE_LEN (1 << 20)
+#define BENCH_BYTES (1ULL << 29)   /* bytes processed per measurement */
+
+struct crc32_variant
+{
+  const char *name;
+  crc32_fn_t fn;
+};
+
+struct crc32_copy_variant
+{
+  const char *name;
+  crc32_copy_fn_t fn;
+};
+
+static uint8_t *copy_dst;
+
+/* the two passes that update_crc32_copy() fuses */
+static uint32_t
+memcpy_then_crc32 (uint32_t crc, uint8_t *dst, const uint8_t *data, uint32_t len)
+{
+  memcpy (dst, data, len);
+  return update_crc32 (crc, data, len);
+}
+
+static double
+bench (crc32_fn_t fn, const uint8_t *buf, uint32_t len)
+{
+  struct timespec start_time;
+  struct timespec end_time;
+  uint64_t rounds = BENCH_BYTES / len;
+  uint64_t i;
+  volatile uint32_t sink;
+  uint32_t crc = 0xffffffff;
+  double elapsed;
+
+  clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
+  for (i = 0; i < rounds; i++)
+    crc = fn (crc, buf, len);
+  clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
+  sink = crc;
+  (void) sink;
+
+  elapsed = end_time.tv_sec - start_time.tv_sec
+      + (end_time.tv_nsec - start_time.tv_nsec) * 1e-9;
+  return (rounds * len) / elapsed / 1e9;
+}
+
+static double
+bench_copy (crc32_copy_fn_t fn, const uint8_t *buf, uint32_t len)
+{
+  struct timespec start_time;
+  struct timespec end_time;
+  uint64_t rounds = BENCH_BYTES / len;
+  uint64_t i;
+  volatile uint32_t sink;
+  uint32_t crc = 0xffffffff;
+  double elapsed;
+
+  clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
+  for (i = 0; i < rounds; i++)
+    crc = fn (crc, copy_dst, buf, len);
+  clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
+  sink = crc;
+  (void) sink;
+
+  elapsed = end_time.tv_sec - start_time.tv_sec
+      + (end_time.tv_nsec - start_time.tv_nsec) * 1e-9;
+  return (rounds * len) / elapsed / 1e9;
+}
+
+static int
+verify_copy (crc32_copy_fn_t fn, const uint8_t *buf)
+{
+  uint32_t len;
+  uint32_t off;
+
+  for (off = 0; off < 16; off++)
+    for (len = 0; len <= CHECK_LEN; len++) {
+      memset (copy_dst, 0, len + 1);
+      if (fn (0xffffffff, copy_dst + 1, buf + off, len)
+          != update_crc32_bytewise (0xffffffff, buf + off, len)
+          || memcmp (copy_dst + 1, buf + off, len)) {
+        printf ("mismatch at offset %u, length %u\n", off, len);
+        return -1;
+      }
+    }
+
+  return 0;
+}
+
+static int
+verify (crc32_fn_t fn, const uint8_t *buf)
+{
+  uint32_t len;
+  uint32_t off;
+
+  for (off = 0; off < 16; off++)
+    for (len = 0; len <= CHECK_LEN; len++)
+      if (fn (0xffffffff, buf + off, len)
+          != update_crc32_bytewise (0xffffffff, buf + off, len)) {
+        printf ("mismatch at offset %u, length %u\n", off, len);
+        return -1;
+      }
+
+  return 0;
+}
+
+int
+main (void)
+{
+  struct crc32_variant variants[8];
+  struct crc32_copy_variant copy_variants[8];
+  size_t n = 0;
+  size_t i;
+  uint8_t *buf;
+  int ret = EXIT_SUCCESS;
+
+  buf = (uint8_t *) malloc (LARGE_LEN + 16);
+  copy_dst = (uint8_t *) malloc (LARGE_LEN + 16);
+  if (!buf || !copy_dst) {
+    perror ("Allocate benchmark buffer");
+    free (buf);
+    return EXIT_FAILURE;
+  }
+
+  srand (time (NULL));
+  for (i = 0; i < LARGE_LEN + 16; i++)
+    buf[i] = rand ();
+
+  variants[n].name = "bytewise";
+  variants[n++].fn = update_crc32_bytewise;
+  variants[n].name = "slicing-by-8";
+  variants[n++].fn = update_crc32_slice8;
+  variants[n].name = "slicing-by-16";
+  variants[n++].fn = update_crc32_slice16;
+#ifdef CRC32_HAVE_PCLMUL
+  if (crc32_cpu_has_pclmul ()) {
+    variants[n].name = "pclmulqdq";
+    variants[n++].fn = update_crc32_pclmul;
+  }
+#endif
+#ifdef CRC32_HAVE_ARMV8
+  if (crc32_cpu_has_armv8 ()) {
+    variants[n].name = "armv8-crc";
+    variants[n++].fn = update_crc32_armv8;
+  }
+#endif
+  variants[n].name = "update_crc32 (dispatched)";
+  variants[n++].fn = update_crc32;
+
+  /* the well known check value of CRC-32 */
+  if (crc32 ((const uint8_t *) "123456789", 9) != 0xCBF43926) {
+    printf ("crc32(\"123456789\") != 0xCBF43926\n");
+    ret = EXIT_FAILURE;
+  }
+
+  printf ("%-30s %12s %12s\n", "implementation", "1400 B GB/s", "1 MB GB/s");
+  for (i = 0; i < n; i++) {
+    if (verify (variants[i].fn, buf)) {
+      printf ("%-30s FAILED\n", variants[i].name);
+      ret = EXIT_FAILURE;
+      continue;
+    }
+    printf ("%-30s %12.2f %12.2f\n", variants[i].name,
+            bench (variants[i].fn, buf + 1, SEGMENT_LEN),
+            bench (variants[i].fn, buf, LARGE_LEN));
+  }
+
+  n = 0;
+  copy_variants[n].name = "memcpy + update_crc32";
+  copy_variants[n++].fn = memcpy_then_crc32;
+  copy_variants[n].name = "copy slicing-by-16";
+  copy_variants[n++].fn = update_crc32_copy_slice16;
+#ifdef CRC32_HAVE_PCLMUL
+  if (crc32_cpu_has_pclmul ()) {
+    copy_variants[n].name = "copy pclmulqdq";
+    copy_variants[n++].fn = update_crc32_copy_pclmul;
+  }
+#endif
+#ifdef CRC32_HAVE_ARMV8
+  if (crc32_cpu_has_armv8 ()) {
+    copy_variants[n].name = "copy armv8-crc";
+    copy_variants[n++].fn = update_crc32_copy_armv8;
+  }
+#endif
+  copy_variants[n].name = "update_crc32_copy (dispatched)";
+  copy_variants[n++].fn = update_crc32_copy;
+
+  printf ("\n%-30s %12s %12s\n", "copy + CRC", "1400 B GB/s", "1 MB GB/s");
+  for (i = 0; i < n; i++) {
+    if (verify_copy (copy_variants[i].fn, buf)) {
+      printf ("%-30s FAILED\n", copy_variants[i].name);
+      ret = EXIT_FAILURE;
+      continue;
+    }
+    printf ("%-30s %12.2f %12.2f\n", copy_variants[i].name,
+            bench_copy (copy_variants[i].fn, buf + 1, SEGMENT_LEN),
+            bench_copy (copy_variants[i].fn, buf, LARGE_LEN));
+  }
+
+  free (copy_dst);
+  free (buf);
+  return ret;
+}
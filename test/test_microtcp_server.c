@@ -76,19 +76,19 @@ int main(int argc, char ** argv) {
     memset(buff, 0, 1500UL);
 
 
-    check( ret = microtcp_recv(&ssock, buff, 3000UL, 0) );
+    check( ret = microtcp_recv(&ssock, buff, sizeof(buff) - 1UL, 0) );
     printf("ret = %ld\n", ret);
     LOG_DEBUG("recv()ed payload [%ld] ---> %s\n", ret, buff);
     memset(buff, 0, ret);
 
     usleep(220000U);
-    check( ret = microtcp_recv(&ssock, buff, 1500UL, 0) );
+    check( ret = microtcp_recv(&ssock, buff, sizeof(buff) - 1UL, 0) );
     printf("ret = %ld\n", ret);
     LOG_DEBUG("recv()ed payload [%ld] ---> %s\n", ret, buff);
     memset(buff, 0, ret);
 
     // [FIN, ACK]
-    check( ret = microtcp_recv(&ssock, buff, 1500UL, 0) );
+    check( ret = microtcp_recv(&ssock, buff, sizeof(buff) - 1UL, 0) );
     printf("ret = %ld\n", ret);
     LOG_DEBUG("recv()ed payload [%ld] ---> %s\n", ret, buff);
     memset(buff, 0, ret);
@@ -54,7 +54,11 @@ main (int argc, char **argv)
   int                   opt;
   int                   ret;
   int                   port;
-  int                   mean_inter;
+  int                   mean_inter = 0;
+  long                  messages = -1;
+  long                  sent = 0;
+  uint32_t              nodelay = 0;
+  int                   msg_len = BUF_LEN;
   microtcp_sock_t       sock;
   struct sockaddr_in    sin;
   struct sockaddr       client_addr;
@@ -62,13 +66,14 @@ main (int argc, char **argv)
   struct sockaddr_in    *addr_in;
   char                  ip_addr[INET_ADDRSTRLEN];
   char                  buffer[BUF_LEN];
+  double                elapsed;
 
   /* Create the random generator */
   std::random_device rd;
   std::mt19937 gen(rd());
 
   /* A very easy way to parse command line arguments */
-  while ((opt = getopt (argc, argv, "hp:i:")) != -1) {
+  while ((opt = getopt (argc, argv, "hp:i:n:s:D")) != -1) {
     switch (opt)
       {
       case 'p':
@@ -82,17 +87,35 @@ main (int argc, char **argv)
          */
         mean_inter = atoi (optarg);
         break;
+      case 'n':
+        /* Stop after that many messages instead of waiting for Ctrl+C */
+        messages = atol (optarg);
+        break;
+      case 's':
+        /* Size of the messages, up to BUF_LEN */
+        msg_len = atoi (optarg);
+        if (msg_len <= 0 || msg_len > BUF_LEN)
+          msg_len = BUF_LEN;
+        break;
+      case 'D':
+        /* Every message goes out at once, no coalescing of the small writes */
+        nodelay = 1;
+        break;
       default:
         printf (
-            "Usage: bandwidth_test -p port -i packet inter-arrival ms"
+            "Usage: traffic_generator -p port -i packet inter-arrival ms [-n messages] [-s bytes] [-D]\n"
             "Options:\n"
-            "   -p <int>            the port to wait for a peer"
-            "   -i <int>            the mean inter-arrival time in milliseconds of the poisson distribution"
+            "   -p <int>            the port to wait for a peer\n"
+            "   -i <int>            the mean inter-arrival time in milliseconds of the poisson distribution,\n"
+            "                       0 sends back-to-back\n"
+            "   -n <int>            the number of messages to send, until Ctrl+C if not given\n"
+            "   -s <int>            the size of the messages in bytes (default and largest 2048)\n"
+            "   -D                  disable the coalescing of the messages (MICROTCP_SO_NODELAY)\n"
             "   -h                  prints this help\n");
         exit (EXIT_FAILURE);
       }
   }
-  std::poisson_distribution<int> dpoisson(mean_inter);
+  std::poisson_distribution<int> dpoisson(mean_inter > 0 ? mean_inter : 1);
   LOG_INFO("Creating traffic generator on port %d", port);
   LOG_INFO("Poisson distribution inter-arrivals with mean %u ms", mean_inter);
 
@@ -132,20 +155,44 @@ main (int argc, char **argv)
     return -EXIT_FAILURE;
   }
 
+  if (nodelay
+      && microtcp_setsockopt(&sock, MICROTCP_SO_NODELAY, &nodelay, sizeof(nodelay)) < 0)
+    LOG_ERROR("Failed to disable the coalescing");
+
   addr_in = (struct sockaddr_in *) &client_addr;
   inet_ntop(AF_INET, &(addr_in->sin_addr), ip_addr, INET_ADDRSTRLEN);
   LOG_INFO("Peer %s connected.", ip_addr);
   std::this_thread::sleep_for (std::chrono::seconds(1));
   LOG_INFO("Start generating traffic...");
 
-  while(stop_traffic == false) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(dpoisson(gen)));
-    microtcp_send(&sock, buffer, BUF_LEN, 0);
+  /*
+   * microtcp_send() returns once the message is in the send buffer, the
+   * rate of the loop is limited by the path, not by a round trip per message
+   */
+  auto start = std::chrono::steady_clock::now();
+  while(stop_traffic == false && sent != messages) {
+    if (mean_inter > 0)
+      std::this_thread::sleep_for(std::chrono::milliseconds(dpoisson(gen)));
+    if (microtcp_send(&sock, buffer, msg_len, 0) != msg_len) {
+      LOG_ERROR("Failed to send a message");
+      break;
+    }
+    sent++;
   }
 
+  /* Up to the last message, the send buffer holds back at most its size */
+  elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
   LOG_INFO("Going to terminate microtcp connection...");
 
-  /* SHUT_RDWR can be omitted internally */
-  microtcp_shutdown(&sock, SHUT_RDWR);
+  /* The data still in the send buffer goes first */
+  microtcp_shutdown(&sock, SHUTDOWN_CLIENT);
+
+  printf("Messages sent: %ld of %d bytes\n", sent, msg_len);
+  printf("Transfer time: %f seconds\n", elapsed);
+  printf("Messages per second: %f\n", sent / elapsed);
+  printf("Segments sent: %lu (%s)\n", (unsigned long) sock.packets_send,
+         nodelay ? "no delay" : "coalesced");
+  printf("Throughput achieved: %f MB/s\n", sent * msg_len / elapsed / 1024 / 1024);
 
 }
@@ -21,9 +21,117 @@
 #ifndef UTILS_CRC32_H_
 #define UTILS_CRC32_H_
 
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_HAVE_PCLMUL 1
+#endif
+
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32_HAVE_ARMV8 1
+#endif
+
+/*
+ * CRC-32 (polynomial 0x104C11DB7, reflected) with several implementations of
+ * the same function. update_crc32() picks the fastest one the CPU supports on
+ * its first call:
+ *  - x86 with PCLMULQDQ: carry-less multiplication folding, 64 bytes per round
+ *  - ARMv8 with the CRC extension: the crc32x/crc32b instructions
+ *  - otherwise: slicing-by-16, 16 bytes per round through 16 lookup tables
+ * Every implementation yields the same result as the byte-at-a-time one.
+ * update_crc32_copy() also copies the data in the same pass, so verifying a
+ * payload while moving it costs a single read of it.
+ */
+
+static const uint32_t crc32_lut[256] =
+  { 0x00000000L, 0x77073096L, 0xEE0E612CL, 0x990951BAL, 0x076DC419L,
+      0x706AF48FL, 0xE963A535L, 0x9E6495A3L, 0x0EDB8832L, 0x79DCB8A4L,
+      0xE0D5E91EL, 0x97D2D988L, 0x09B64C2BL, 0x7EB17CBDL, 0xE7B82D07L,
+      0x90BF1D91L, 0x1DB71064L, 0x6AB020F2L, 0xF3B97148L, 0x84BE41DEL,
+      0x1ADAD47DL, 0x6DDDE4EBL, 0xF4D4B551L, 0x83D385C7L, 0x136C9856L,
+      0x646BA8C0L, 0xFD62F97AL, 0x8A65C9ECL, 0x14015C4FL, 0x63066CD9L,
+      0xFA0F3D63L, 0x8D080DF5L, 0x3B6E20C8L, 0x4C69105EL, 0xD56041E4L,
+      0xA2677172L, 0x3C03E4D1L, 0x4B04D447L, 0xD20D85FDL, 0xA50AB56BL,
+      0x35B5A8FAL, 0x42B2986CL, 0xDBBBC9D6L, 0xACBCF940L, 0x32D86CE3L,
+      0x45DF5C75L, 0xDCD60DCFL, 0xABD13D59L, 0x26D930ACL, 0x51DE003AL,
+      0xC8D75180L, 0xBFD06116L, 0x21B4F4B5L, 0x56B3C423L, 0xCFBA9599L,
+      0xB8BDA50FL, 0x2802B89EL, 0x5F058808L, 0xC60CD9B2L, 0xB10BE924L,
+      0x2F6F7C87L, 0x58684C11L, 0xC1611DABL, 0xB6662D3DL, 0x76DC4190L,
+      0x01DB7106L, 0x98D220BCL, 0xEFD5102AL, 0x71B18589L, 0x06B6B51FL,
+      0x9FBFE4A5L, 0xE8B8D433L, 0x7807C9A2L, 0x0F00F934L, 0x9609A88EL,
+      0xE10E9818L, 0x7F6A0DBBL, 0x086D3D2DL, 0x91646C97L, 0xE6635C01L,
+      0x6B6B51F4L, 0x1C6C6162L, 0x856530D8L, 0xF262004EL, 0x6C0695EDL,
+      0x1B01A57BL, 0x8208F4C1L, 0xF50FC457L, 0x65B0D9C6L, 0x12B7E950L,
+      0x8BBEB8EAL, 0xFCB9887CL, 0x62DD1DDFL, 0x15DA2D49L, 0x8CD37CF3L,
+      0xFBD44C65L, 0x4DB26158L, 0x3AB551CEL, 0xA3BC0074L, 0xD4BB30E2L,
+      0x4ADFA541L, 0x3DD895D7L, 0xA4D1C46DL, 0xD3D6F4FBL, 0x4369E96AL,
+      0x346ED9FCL, 0xAD678846L, 0xDA60B8D0L, 0x44042D73L, 0x33031DE5L,
+      0xAA0A4C5FL, 0xDD0D7CC9L, 0x5005713CL, 0x270241AAL, 0xBE0B1010L,
+      0xC90C2086L, 0x5768B525L, 0x206F85B3L, 0xB966D409L, 0xCE61E49FL,
+      0x5EDEF90EL, 0x29D9C998L, 0xB0D09822L, 0xC7D7A8B4L, 0x59B33D17L,
+      0x2EB40D81L, 0xB7BD5C3BL, 0xC0BA6CADL, 0xEDB88320L, 0x9ABFB3B6L,
+      0x03B6E20CL, 0x74B1D29AL, 0xEAD54739L, 0x9DD277AFL, 0x04DB2615L,
+      0x73DC1683L, 0xE3630B12L, 0x94643B84L, 0x0D6D6A3EL, 0x7A6A5AA8L,
+      0xE40ECF0BL, 0x9309FF9DL, 0x0A00AE27L, 0x7D079EB1L, 0xF00F9344L,
+      0x8708A3D2L, 0x1E01F268L, 0x6906C2FEL, 0xF762575DL, 0x806567CBL,
+      0x196C3671L, 0x6E6B06E7L, 0xFED41B76L, 0x89D32BE0L, 0x10DA7A5AL,
+      0x67DD4ACCL, 0xF9B9DF6FL, 0x8EBEEFF9L, 0x17B7BE43L, 0x60B08ED5L,
+      0xD6D6A3E8L, 0xA1D1937EL, 0x38D8C2C4L, 0x4FDFF252L, 0xD1BB67F1L,
+      0xA6BC5767L, 0x3FB506DDL, 0x48B2364BL, 0xD80D2BDAL, 0xAF0A1B4CL,
+      0x36034AF6L, 0x41047A60L, 0xDF60EFC3L, 0xA867DF55L, 0x316E8EEFL,
+      0x4669BE79L, 0xCB61B38CL, 0xBC66831AL, 0x256FD2A0L, 0x5268E236L,
+      0xCC0C7795L, 0xBB0B4703L, 0x220216B9L, 0x5505262FL, 0xC5BA3BBEL,
+      0xB2BD0B28L, 0x2BB45A92L, 0x5CB36A04L, 0xC2D7FFA7L, 0xB5D0CF31L,
+      0x2CD99E8BL, 0x5BDEAE1DL, 0x9B64C2B0L, 0xEC63F226L, 0x756AA39CL,
+      0x026D930AL, 0x9C0906A9L, 0xEB0E363FL, 0x72076785L, 0x05005713L,
+      0x95BF4A82L, 0xE2B87A14L, 0x7BB12BAEL, 0x0CB61B38L, 0x92D28E9BL,
+      0xE5D5BE0DL, 0x7CDCEFB7L, 0x0BDBDF21L, 0x86D3D2D4L, 0xF1D4E242L,
+      0x68DDB3F8L, 0x1FDA836EL, 0x81BE16CDL, 0xF6B9265BL, 0x6FB077E1L,
+      0x18B74777L, 0x88085AE6L, 0xFF0F6A70L, 0x66063BCAL, 0x11010B5CL,
+      0x8F659EFFL, 0xF862AE69L, 0x616BFFD3L, 0x166CCF45L, 0xA00AE278L,
+      0xD70DD2EEL, 0x4E048354L, 0x3903B3C2L, 0xA7672661L, 0xD06016F7L,
+      0x4969474DL, 0x3E6E77DBL, 0xAED16A4AL, 0xD9D65ADCL, 0x40DF0B66L,
+      0x37D83BF0L, 0xA9BCAE53L, 0xDEBB9EC5L, 0x47B2CF7FL, 0x30B5FFE9L,
+      0xBDBDF21CL, 0xCABAC28AL, 0x53B39330L, 0x24B4A3A6L, 0xBAD03605L,
+      0xCDD70693L, 0x54DE5729L, 0x23D967BFL, 0xB3667A2EL, 0xC4614AB8L,
+      0x5D681B02L, 0x2A6F2B94L, 0xB40BBE37L, 0xC30C8EA1L, 0x5A05DF1BL,
+      0x2D02EF8DL };
+
+typedef uint32_t (*crc32_fn_t) (uint32_t, const uint8_t *, uint32_t);
+typedef uint32_t (*crc32_copy_fn_t) (uint32_t, uint8_t *, const uint8_t *, uint32_t);
+
+/* crc32_slice_lut[k][i] is the CRC of byte 'i' followed by 'k' zero bytes */
+static uint32_t crc32_slice_lut[16][256];
+static int crc32_slice_ready;
+static crc32_fn_t crc32_impl;
+static crc32_copy_fn_t crc32_copy_impl;
+
+static inline void
+crc32_init_slice_lut (void)
+{
+  uint32_t i, k;
+
+  if (__atomic_load_n (&crc32_slice_ready, __ATOMIC_ACQUIRE))
+    return;
+
+  for (i = 0; i < 256; i++) {
+    crc32_slice_lut[0][i] = crc32_lut[i];
+    for (k = 1; k < 16; k++)
+      crc32_slice_lut[k][i] = (crc32_slice_lut[k - 1][i] >> 8)
+          ^ crc32_lut[crc32_slice_lut[k - 1][i] & 0xff];
+  }
+
+  __atomic_store_n (&crc32_slice_ready, 1, __ATOMIC_RELEASE);
+}
+
 /**
- * CRC-32 calculation using lookup tables, supporting progressive CRC calculation
- * polynomial: 0x104C11DB7
+ * CRC-32 calculation using a lookup table, one byte at a time, supporting
+ * progressive CRC calculation
  *
  * @param crc the initial feed
  * @param data the buffer containing the data
@@ -31,62 +139,8 @@
  * @return the CRC-32 result
  */
 static inline uint32_t
-update_crc32 (uint32_t crc, const uint8_t * data, uint32_t len)
+update_crc32_bytewise (uint32_t crc, const uint8_t * data, uint32_t len)
 {
-  static const uint32_t crc32_lut[256] =
-    { 0x00000000L, 0x77073096L, 0xEE0E612CL, 0x990951BAL, 0x076DC419L,
-        0x706AF48FL, 0xE963A535L, 0x9E6495A3L, 0x0EDB8832L, 0x79DCB8A4L,
-        0xE0D5E91EL, 0x97D2D988L, 0x09B64C2BL, 0x7EB17CBDL, 0xE7B82D07L,
-        0x90BF1D91L, 0x1DB71064L, 0x6AB020F2L, 0xF3B97148L, 0x84BE41DEL,
-        0x1ADAD47DL, 0x6DDDE4EBL, 0xF4D4B551L, 0x83D385C7L, 0x136C9856L,
-        0x646BA8C0L, 0xFD62F97AL, 0x8A65C9ECL, 0x14015C4FL, 0x63066CD9L,
-        0xFA0F3D63L, 0x8D080DF5L, 0x3B6E20C8L, 0x4C69105EL, 0xD56041E4L,
-        0xA2677172L, 0x3C03E4D1L, 0x4B04D447L, 0xD20D85FDL, 0xA50AB56BL,
-        0x35B5A8FAL, 0x42B2986CL, 0xDBBBC9D6L, 0xACBCF940L, 0x32D86CE3L,
-        0x45DF5C75L, 0xDCD60DCFL, 0xABD13D59L, 0x26D930ACL, 0x51DE003AL,
-        0xC8D75180L, 0xBFD06116L, 0x21B4F4B5L, 0x56B3C423L, 0xCFBA9599L,
-        0xB8BDA50FL, 0x2802B89EL, 0x5F058808L, 0xC60CD9B2L, 0xB10BE924L,
-        0x2F6F7C87L, 0x58684C11L, 0xC1611DABL, 0xB6662D3DL, 0x76DC4190L,
-        0x01DB7106L, 0x98D220BCL, 0xEFD5102AL, 0x71B18589L, 0x06B6B51FL,
-        0x9FBFE4A5L, 0xE8B8D433L, 0x7807C9A2L, 0x0F00F934L, 0x9609A88EL,
-        0xE10E9818L, 0x7F6A0DBBL, 0x086D3D2DL, 0x91646C97L, 0xE6635C01L,
-        0x6B6B51F4L, 0x1C6C6162L, 0x856530D8L, 0xF262004EL, 0x6C0695EDL,
-        0x1B01A57BL, 0x8208F4C1L, 0xF50FC457L, 0x65B0D9C6L, 0x12B7E950L,
-        0x8BBEB8EAL, 0xFCB9887CL, 0x62DD1DDFL, 0x15DA2D49L, 0x8CD37CF3L,
-        0xFBD44C65L, 0x4DB26158L, 0x3AB551CEL, 0xA3BC0074L, 0xD4BB30E2L,
-        0x4ADFA541L, 0x3DD895D7L, 0xA4D1C46DL, 0xD3D6F4FBL, 0x4369E96AL,
-        0x346ED9FCL, 0xAD678846L, 0xDA60B8D0L, 0x44042D73L, 0x33031DE5L,
-        0xAA0A4C5FL, 0xDD0D7CC9L, 0x5005713CL, 0x270241AAL, 0xBE0B1010L,
-        0xC90C2086L, 0x5768B525L, 0x206F85B3L, 0xB966D409L, 0xCE61E49FL,
-        0x5EDEF90EL, 0x29D9C998L, 0xB0D09822L, 0xC7D7A8B4L, 0x59B33D17L,
-        0x2EB40D81L, 0xB7BD5C3BL, 0xC0BA6CADL, 0xEDB88320L, 0x9ABFB3B6L,
-        0x03B6E20CL, 0x74B1D29AL, 0xEAD54739L, 0x9DD277AFL, 0x04DB2615L,
-        0x73DC1683L, 0xE3630B12L, 0x94643B84L, 0x0D6D6A3EL, 0x7A6A5AA8L,
-        0xE40ECF0BL, 0x9309FF9DL, 0x0A00AE27L, 0x7D079EB1L, 0xF00F9344L,
-        0x8708A3D2L, 0x1E01F268L, 0x6906C2FEL, 0xF762575DL, 0x806567CBL,
-        0x196C3671L, 0x6E6B06E7L, 0xFED41B76L, 0x89D32BE0L, 0x10DA7A5AL,
-        0x67DD4ACCL, 0xF9B9DF6FL, 0x8EBEEFF9L, 0x17B7BE43L, 0x60B08ED5L,
-        0xD6D6A3E8L, 0xA1D1937EL, 0x38D8C2C4L, 0x4FDFF252L, 0xD1BB67F1L,
-        0xA6BC5767L, 0x3FB506DDL, 0x48B2364BL, 0xD80D2BDAL, 0xAF0A1B4CL,
-        0x36034AF6L, 0x41047A60L, 0xDF60EFC3L, 0xA867DF55L, 0x316E8EEFL,
-        0x4669BE79L, 0xCB61B38CL, 0xBC66831AL, 0x256FD2A0L, 0x5268E236L,
-        0xCC0C7795L, 0xBB0B4703L, 0x220216B9L, 0x5505262FL, 0xC5BA3BBEL,
-        0xB2BD0B28L, 0x2BB45A92L, 0x5CB36A04L, 0xC2D7FFA7L, 0xB5D0CF31L,
-        0x2CD99E8BL, 0x5BDEAE1DL, 0x9B64C2B0L, 0xEC63F226L, 0x756AA39CL,
-        0x026D930AL, 0x9C0906A9L, 0xEB0E363FL, 0x72076785L, 0x05005713L,
-        0x95BF4A82L, 0xE2B87A14L, 0x7BB12BAEL, 0x0CB61B38L, 0x92D28E9BL,
-        0xE5D5BE0DL, 0x7CDCEFB7L, 0x0BDBDF21L, 0x86D3D2D4L, 0xF1D4E242L,
-        0x68DDB3F8L, 0x1FDA836EL, 0x81BE16CDL, 0xF6B9265BL, 0x6FB077E1L,
-        0x18B74777L, 0x88085AE6L, 0xFF0F6A70L, 0x66063BCAL, 0x11010B5CL,
-        0x8F659EFFL, 0xF862AE69L, 0x616BFFD3L, 0x166CCF45L, 0xA00AE278L,
-        0xD70DD2EEL, 0x4E048354L, 0x3903B3C2L, 0xA7672661L, 0xD06016F7L,
-        0x4969474DL, 0x3E6E77DBL, 0xAED16A4AL, 0xD9D65ADCL, 0x40DF0B66L,
-        0x37D83BF0L, 0xA9BCAE53L, 0xDEBB9EC5L, 0x47B2CF7FL, 0x30B5FFE9L,
-        0xBDBDF21CL, 0xCABAC28AL, 0x53B39330L, 0x24B4A3A6L, 0xBAD03605L,
-        0xCDD70693L, 0x54DE5729L, 0x23D967BFL, 0xB3667A2EL, 0xC4614AB8L,
-        0x5D681B02L, 0x2A6F2B94L, 0xB40BBE37L, 0xC30C8EA1L, 0x5A05DF1BL,
-        0x2D02EF8DL };
-
   register uint32_t i;
   for (i = 0; i < len; i++)
     crc = (crc >> 8) ^ crc32_lut[(crc ^ data[i]) & 0xff];
@@ -94,6 +148,345 @@ update_crc32 (uint32_t crc, const uint8_t * data, uint32_t len)
   return crc;
 }
 
+/*
+ * The kernels below take an optional 'dst': when it is not NULL every byte
+ * is also copied there, out of the registers it is already loaded in
+ */
+static inline __attribute__ ((always_inline)) uint32_t
+_crc32_bytewise (uint32_t crc, uint8_t * dst, const uint8_t * data, uint32_t len)
+{
+  uint32_t i;
+
+  for (i = 0; i < len; i++) {
+    if (dst)
+      dst[i] = data[i];
+    crc = (crc >> 8) ^ crc32_lut[(crc ^ data[i]) & 0xff];
+  }
+
+  return crc;
+}
+
+/**
+ * Slicing-by-8: 8 bytes per round, 8 independent table lookups
+ */
+static inline uint32_t
+update_crc32_slice8 (uint32_t crc, const uint8_t * data, uint32_t len)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  const uint32_t (*t)[256] = (const uint32_t (*)[256]) crc32_slice_lut;
+  uint32_t w0, w1;
+
+  crc32_init_slice_lut ();
+  for (; len >= 8; data += 8, len -= 8) {
+    memcpy (&w0, data, 4);
+    memcpy (&w1, data + 4, 4);
+    w0 ^= crc;
+    crc = t[7][w0 & 0xff] ^ t[6][(w0 >> 8) & 0xff]
+        ^ t[5][(w0 >> 16) & 0xff] ^ t[4][w0 >> 24]
+        ^ t[3][w1 & 0xff] ^ t[2][(w1 >> 8) & 0xff]
+        ^ t[1][(w1 >> 16) & 0xff] ^ t[0][w1 >> 24];
+  }
+#endif
+  return update_crc32_bytewise (crc, data, len);
+}
+
+static inline __attribute__ ((always_inline)) uint32_t
+_crc32_slice16 (uint32_t crc, uint8_t * dst, const uint8_t * data, uint32_t len)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  const uint32_t (*t)[256] = (const uint32_t (*)[256]) crc32_slice_lut;
+  uint32_t w[4];
+
+  crc32_init_slice_lut ();
+  for (; len >= 16; data += 16, len -= 16) {
+    memcpy (w, data, 16);
+    if (dst) {
+      memcpy (dst, w, 16);
+      dst += 16;
+    }
+    w[0] ^= crc;
+    crc = t[15][w[0] & 0xff] ^ t[14][(w[0] >> 8) & 0xff]
+        ^ t[13][(w[0] >> 16) & 0xff] ^ t[12][w[0] >> 24]
+        ^ t[11][w[1] & 0xff] ^ t[10][(w[1] >> 8) & 0xff]
+        ^ t[9][(w[1] >> 16) & 0xff] ^ t[8][w[1] >> 24]
+        ^ t[7][w[2] & 0xff] ^ t[6][(w[2] >> 8) & 0xff]
+        ^ t[5][(w[2] >> 16) & 0xff] ^ t[4][w[2] >> 24]
+        ^ t[3][w[3] & 0xff] ^ t[2][(w[3] >> 8) & 0xff]
+        ^ t[1][(w[3] >> 16) & 0xff] ^ t[0][w[3] >> 24];
+  }
+#endif
+  return _crc32_bytewise (crc, dst, data, len);
+}
+
+/**
+ * Slicing-by-16: 16 bytes per round, 16 independent table lookups
+ */
+static inline uint32_t
+update_crc32_slice16 (uint32_t crc, const uint8_t * data, uint32_t len)
+{
+  return _crc32_slice16 (crc, NULL, data, len);
+}
+
+static inline uint32_t
+update_crc32_copy_slice16 (uint32_t crc, uint8_t * dst, const uint8_t * data, uint32_t len)
+{
+  return _crc32_slice16 (crc, dst, data, len);
+}
+
+#ifdef CRC32_HAVE_PCLMUL
+__attribute__ ((target ("pclmul,sse4.1"), always_inline))
+static inline uint32_t
+_crc32_pclmul (uint32_t crc, uint8_t * dst, const uint8_t * data, uint32_t len)
+{
+  /* x^(4*128+32) mod P, x^(4*128-32) mod P, x^(128+32), x^(128-32), x^64, P, mu */
+  const __m128i k1k2 = _mm_set_epi64x (0x01c6e41596, 0x0154442bd4);
+  const __m128i k3k4 = _mm_set_epi64x (0x00ccaa009e, 0x01751997d0);
+  const __m128i k5k0 = _mm_set_epi64x (0, 0x0163cd6124);
+  const __m128i poly = _mm_set_epi64x (0x01f7011641, 0x01db710641);
+  const __m128i mask32 = _mm_setr_epi32 (~0, 0, ~0, 0);
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+  __m128i y1, y2, y3, y4;
+
+  if (len < 64)
+    return _crc32_slice16 (crc, dst, data, len);
+
+  x1 = _mm_loadu_si128 ((const __m128i *) (data + 0x00));
+  x2 = _mm_loadu_si128 ((const __m128i *) (data + 0x10));
+  x3 = _mm_loadu_si128 ((const __m128i *) (data + 0x20));
+  x4 = _mm_loadu_si128 ((const __m128i *) (data + 0x30));
+  if (dst) {
+    _mm_storeu_si128 ((__m128i *) (dst + 0x00), x1);
+    _mm_storeu_si128 ((__m128i *) (dst + 0x10), x2);
+    _mm_storeu_si128 ((__m128i *) (dst + 0x20), x3);
+    _mm_storeu_si128 ((__m128i *) (dst + 0x30), x4);
+    dst += 64;
+  }
+  x1 = _mm_xor_si128 (x1, _mm_cvtsi32_si128 ((int) crc));
+  data += 64;
+  len -= 64;
+
+  for (; len >= 64; data += 64, len -= 64) {
+    y1 = _mm_loadu_si128 ((const __m128i *) (data + 0x00));
+    y2 = _mm_loadu_si128 ((const __m128i *) (data + 0x10));
+    y3 = _mm_loadu_si128 ((const __m128i *) (data + 0x20));
+    y4 = _mm_loadu_si128 ((const __m128i *) (data + 0x30));
+    if (dst) {
+      _mm_storeu_si128 ((__m128i *) (dst + 0x00), y1);
+      _mm_storeu_si128 ((__m128i *) (dst + 0x10), y2);
+      _mm_storeu_si128 ((__m128i *) (dst + 0x20), y3);
+      _mm_storeu_si128 ((__m128i *) (dst + 0x30), y4);
+      dst += 64;
+    }
+    x5 = _mm_clmulepi64_si128 (x1, k1k2, 0x00);
+    x6 = _mm_clmulepi64_si128 (x2, k1k2, 0x00);
+    x7 = _mm_clmulepi64_si128 (x3, k1k2, 0x00);
+    x8 = _mm_clmulepi64_si128 (x4, k1k2, 0x00);
+    x1 = _mm_clmulepi64_si128 (x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128 (x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128 (x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128 (x4, k1k2, 0x11);
+    x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x5), y1);
+    x2 = _mm_xor_si128 (_mm_xor_si128 (x2, x6), y2);
+    x3 = _mm_xor_si128 (_mm_xor_si128 (x3, x7), y3);
+    x4 = _mm_xor_si128 (_mm_xor_si128 (x4, x8), y4);
+  }
+
+  /* fold the four lanes into one */
+  x5 = _mm_clmulepi64_si128 (x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, k3k4, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x2), x5);
+  x5 = _mm_clmulepi64_si128 (x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, k3k4, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x3), x5);
+  x5 = _mm_clmulepi64_si128 (x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, k3k4, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x4), x5);
+
+  for (; len >= 16; data += 16, len -= 16) {
+    y1 = _mm_loadu_si128 ((const __m128i *) data);
+    if (dst) {
+      _mm_storeu_si128 ((__m128i *) dst, y1);
+      dst += 16;
+    }
+    x5 = _mm_clmulepi64_si128 (x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128 (x1, k3k4, 0x11);
+    x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x5), y1);
+  }
+
+  /* 128 -> 64 bits */
+  x2 = _mm_clmulepi64_si128 (x1, k3k4, 0x10);
+  x1 = _mm_xor_si128 (_mm_srli_si128 (x1, 8), x2);
+  x2 = _mm_srli_si128 (x1, 4);
+  x1 = _mm_and_si128 (x1, mask32);
+  x1 = _mm_clmulepi64_si128 (x1, k5k0, 0x00);
+  x1 = _mm_xor_si128 (x1, x2);
+
+  /* Barrett reduction to 32 bits */
+  x0 = _mm_and_si128 (x1, mask32);
+  x0 = _mm_clmulepi64_si128 (x0, poly, 0x10);
+  x0 = _mm_and_si128 (x0, mask32);
+  x0 = _mm_clmulepi64_si128 (x0, poly, 0x00);
+  x1 = _mm_xor_si128 (x1, x0);
+
+  crc = (uint32_t) _mm_extract_epi32 (x1, 1);
+  return _crc32_slice16 (crc, dst, data, len);
+}
+
+/**
+ * Folding with carry-less multiplication (Intel, "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction"). Four 128-bit lanes are
+ * folded 64 bytes at a time, then into one lane, reduced to 64 bits and
+ * finally to 32 bits with Barrett reduction. Less than 64 bytes and the tail
+ * go through slicing-by-16.
+ */
+__attribute__ ((target ("pclmul,sse4.1")))
+static inline uint32_t
+update_crc32_pclmul (uint32_t crc, const uint8_t * data, uint32_t len)
+{
+  return _crc32_pclmul (crc, NULL, data, len);
+}
+
+__attribute__ ((target ("pclmul,sse4.1")))
+static inline uint32_t
+update_crc32_copy_pclmul (uint32_t crc, uint8_t * dst, const uint8_t * data, uint32_t len)
+{
+  return _crc32_pclmul (crc, dst, data, len);
+}
+
+static inline int
+crc32_cpu_has_pclmul (void)
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("pclmul") && __builtin_cpu_supports ("sse4.1");
+}
+#endif
+
+#ifdef CRC32_HAVE_ARMV8
+__attribute__ ((target ("+crc"), always_inline))
+static inline uint32_t
+_crc32_armv8 (uint32_t crc, uint8_t * dst, const uint8_t * data, uint32_t len)
+{
+  uint64_t w;
+
+  for (; len >= 8; data += 8, len -= 8) {
+    memcpy (&w, data, 8);
+    if (dst) {
+      memcpy (dst, &w, 8);
+      dst += 8;
+    }
+    crc = __crc32d (crc, w);
+  }
+  for (; len; data++, len--) {
+    if (dst)
+      *dst++ = *data;
+    crc = __crc32b (crc, *data);
+  }
+
+  return crc;
+}
+
+/**
+ * The CRC extension of ARMv8 computes this very polynomial, 8 bytes per
+ * instruction
+ */
+__attribute__ ((target ("+crc")))
+static inline uint32_t
+update_crc32_armv8 (uint32_t crc, const uint8_t * data, uint32_t len)
+{
+  return _crc32_armv8 (crc, NULL, data, len);
+}
+
+__attribute__ ((target ("+crc")))
+static inline uint32_t
+update_crc32_copy_armv8 (uint32_t crc, uint8_t * dst, const uint8_t * data, uint32_t len)
+{
+  return _crc32_armv8 (crc, dst, data, len);
+}
+
+static inline int
+crc32_cpu_has_armv8 (void)
+{
+  return (getauxval (AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+/**
+ * @return the fastest implementation the CPU supports
+ */
+static inline crc32_fn_t
+crc32_resolve (void)
+{
+  crc32_init_slice_lut ();
+#ifdef CRC32_HAVE_PCLMUL
+  if (crc32_cpu_has_pclmul ())
+    return update_crc32_pclmul;
+#endif
+#ifdef CRC32_HAVE_ARMV8
+  if (crc32_cpu_has_armv8 ())
+    return update_crc32_armv8;
+#endif
+  return update_crc32_slice16;
+}
+
+static inline crc32_copy_fn_t
+crc32_copy_resolve (void)
+{
+  crc32_init_slice_lut ();
+#ifdef CRC32_HAVE_PCLMUL
+  if (crc32_cpu_has_pclmul ())
+    return update_crc32_copy_pclmul;
+#endif
+#ifdef CRC32_HAVE_ARMV8
+  if (crc32_cpu_has_armv8 ())
+    return update_crc32_copy_armv8;
+#endif
+  return update_crc32_copy_slice16;
+}
+
+/**
+ * CRC-32 calculation, supporting progressive CRC calculation
+ * polynomial: 0x104C11DB7
+ *
+ * @param crc the initial feed
+ * @param data the buffer containing the data
+ * @param len the length of the buffer
+ * @return the CRC-32 result
+ */
+static inline uint32_t
+update_crc32 (uint32_t crc, const uint8_t * data, uint32_t len)
+{
+  crc32_fn_t fn = __atomic_load_n (&crc32_impl, __ATOMIC_RELAXED);
+
+  if (__builtin_expect (!fn, 0)) {
+    fn = crc32_resolve ();
+    __atomic_store_n (&crc32_impl, fn, __ATOMIC_RELAXED);
+  }
+
+  return fn (crc, data, len);
+}
+
+/**
+ * Same as update_crc32(), copying 'data' to 'dst' in the same pass
+ *
+ * @param crc the initial feed
+ * @param dst the buffer to copy 'data' to (must not overlap with it)
+ * @param data the buffer containing the data
+ * @param len the length of the buffer
+ * @return the CRC-32 result
+ */
+static inline uint32_t
+update_crc32_copy (uint32_t crc, uint8_t * dst, const uint8_t * data, uint32_t len)
+{
+  crc32_copy_fn_t fn = __atomic_load_n (&crc32_copy_impl, __ATOMIC_RELAXED);
+
+  if (__builtin_expect (!fn, 0)) {
+    fn = crc32_copy_resolve ();
+    __atomic_store_n (&crc32_copy_impl, fn, __ATOMIC_RELAXED);
+  }
+
+  return fn (crc, dst, data, len);
+}
+
 /**
  * Calculates the CRC-32 of the buffer buf.
  * @param buf The buffer containing the data
@@ -107,4 +500,17 @@ crc32 (const uint8_t * buf, uint32_t len)
   return crc;
 }
 
+/**
+ * Copies 'src' to 'dst' and calculates the CRC-32 of it in a single pass.
+ * @param dst the destination buffer
+ * @param src the buffer containing the data
+ * @param len the size of the buffers
+ * @return the CRC-32 of the buffer
+ */
+static inline uint32_t
+crc32_copy (uint8_t * dst, const uint8_t * src, uint32_t len)
+{
+  return update_crc32_copy (0xffffffff, dst, src, len) ^ 0xffffffff;
+}
+
 #endif /* UTILS_CRC32_H_ */
@@ -67,6 +67,9 @@ void strctrl(uint16_t cbits){
 	if ( cbits & CTRL_ACK )
 		printf("[\033[94mACK\033[0m]");
 
+	if ( cbits & CTRL_PSH )
+		printf("[\033[94mPSH\033[0m]");
+
     if ( cbits & FRAGMENT )
 		printf("[\033[94mFRG\033[0m]");
 
@@ -82,8 +85,6 @@ void strctrl(uint16_t cbits){
 void print_tcp_header(microtcp_sock_t * sock, microtcp_header_t * tcph){
 
 
-	/** TODO: future_use{0, 1, 2} */
-
     int refack = ntohl(tcph->ack_number) - ackbase;
 
     printf("\n\033[1mTCP-header\033[31m#%u\033[0m\n", ++packetno);
@@ -93,6 +94,9 @@ void print_tcp_header(microtcp_sock_t * sock, microtcp_header_t * tcph){
 	strctrl(ntohs(tcph->control));
     printf("  - \033[4mwind\033[0m = %u\n", ntohs(tcph->window));
     printf("  - \033[4mdata\033[0m = %u\n", ntohl(tcph->data_len));
+    printf("  - \033[4mfu0 \033[0m = %u\n", ntohl(tcph->future_use0));
+    printf("  - \033[4mfu1 \033[0m = %u\n", ntohl(tcph->future_use1));
+    printf("  - \033[4mfu2 \033[0m = %u\n", ntohl(tcph->future_use2));
     printf("  - \033[4mcsum\033[0m = %u\n\n", ntohl(tcph->checksum));
 }
 
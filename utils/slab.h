@@ -0,0 +1,218 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UTILS_SLAB_H_
+#define UTILS_SLAB_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/*
+ * Pool of fixed-size objects, carved from cache-line-aligned chunks that are
+ * kept for the lifetime of the pool. Every thread allocates from and frees to
+ * its own cache without locking. The caches exchange objects with the shared
+ * depot of the pool SLAB_BULK at a time, under its lock, so an object may be
+ * freed by another thread than the one that allocated it.
+ */
+#define SLAB_ALIGN      64U                  /* cache line */
+#define SLAB_BULK       32U                  /* objects moved between a cache and the depot at once */
+#define SLAB_CACHE_MAX  ( 4U * SLAB_BULK )   /* a cache gives SLAB_BULK objects back beyond this */
+#define SLAB_SIZE(size) ( ((size) + SLAB_ALIGN - 1U) & ~((size_t) SLAB_ALIGN - 1U) )
+
+typedef struct slab_obj
+{
+  struct slab_obj *next;
+} slab_obj_t;
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  size_t size;                   /**< Size of an object, a multiple of SLAB_ALIGN */
+  size_t chunk_objs;             /**< Objects carved from a chunk */
+  slab_obj_t *depot;             /**< Free objects that no cache holds */
+  size_t depot_cnt;
+  uint64_t chunks;               /**< Chunks allocated */
+  uint64_t total;                /**< Objects carved from them */
+  uint64_t out;                  /**< Objects out of the depot (in use or in a cache) */
+  uint64_t out_max;              /**< High-water mark of 'out' */
+} slab_t;
+
+/* The cache of a thread, zero-initialized */
+typedef struct
+{
+  slab_obj_t *free;
+  size_t cnt;
+} slab_cache_t;
+
+#define SLAB_INITIALIZER(size, chunk_objs) \
+  { PTHREAD_MUTEX_INITIALIZER, SLAB_SIZE (size), (chunk_objs), NULL, 0, 0, 0, 0, 0 }
+
+
+/* Called with the lock of the pool held */
+static inline int
+_slab_grow (slab_t * s)
+{
+  uint8_t *chunk;
+  size_t i;
+
+  chunk = (uint8_t *) aligned_alloc (SLAB_ALIGN, s->chunk_objs * s->size);
+  if (!chunk)
+    return -1;
+
+  for (i = s->chunk_objs; i-- > 0;) {
+    ((slab_obj_t *) (chunk + i * s->size))->next = s->depot;
+    s->depot = (slab_obj_t *) (chunk + i * s->size);
+  }
+  s->depot_cnt += s->chunk_objs;
+  s->total += s->chunk_objs;
+  s->chunks++;
+  return 0;
+}
+
+/**
+ * Moves SLAB_BULK objects from the depot to the cache, carving a new chunk
+ * if the depot runs short.
+ *
+ * @return 0 on success, -1 if no memory is left
+ */
+static inline int
+slab_refill (slab_t * s, slab_cache_t * c)
+{
+  slab_obj_t *o;
+  size_t n;
+
+  pthread_mutex_lock (&s->lock);
+  if (s->depot_cnt < SLAB_BULK && _slab_grow (s) && !s->depot_cnt) {
+    pthread_mutex_unlock (&s->lock);
+    return -1;
+  }
+
+  for (n = 0; n < SLAB_BULK && s->depot; n++) {
+    o = s->depot;
+    s->depot = o->next;
+    o->next = c->free;
+    c->free = o;
+  }
+  s->depot_cnt -= n;
+  c->cnt += n;
+  s->out += n;
+  if (s->out > s->out_max)
+    s->out_max = s->out;
+  pthread_mutex_unlock (&s->lock);
+  return 0;
+}
+
+/**
+ * Gives up to 'n' objects of the cache back to the depot.
+ */
+static inline void
+slab_flush (slab_t * s, slab_cache_t * c, size_t n)
+{
+  slab_obj_t *head;
+  slab_obj_t *tail;
+  size_t i;
+
+  if (!c->cnt || !n)
+    return;
+
+  /* the run is unlinked from the cache first, the lock covers the splice only */
+  head = tail = c->free;
+  for (i = 1; i < n && tail->next; i++)
+    tail = tail->next;
+  c->free = tail->next;
+  c->cnt -= i;
+
+  pthread_mutex_lock (&s->lock);
+  tail->next = s->depot;
+  s->depot = head;
+  s->depot_cnt += i;
+  s->out -= i;
+  pthread_mutex_unlock (&s->lock);
+}
+
+/**
+ * @return an object of the pool, NULL if no memory is left
+ */
+static inline void *
+slab_alloc (slab_t * s, slab_cache_t * c)
+{
+  slab_obj_t *o;
+
+  if (!c->cnt && slab_refill (s, c))
+    return NULL;
+
+  o = c->free;
+  c->free = o->next;
+  c->cnt--;
+  return o;
+}
+
+static inline void
+slab_free (slab_t * s, slab_cache_t * c, void *obj)
+{
+  slab_obj_t *o = (slab_obj_t *) obj;
+
+  o->next = c->free;
+  c->free = o;
+  if (++c->cnt > SLAB_CACHE_MAX)
+    slab_flush (s, c, SLAB_BULK);
+}
+
+/**
+ * Allocates 'n' objects into 'objs', all of them or none.
+ *
+ * @return 0 on success, -1 if no memory is left
+ */
+static inline int
+slab_alloc_bulk (slab_t * s, slab_cache_t * c, void **objs, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    if (!(objs[i] = slab_alloc (s, c))) {
+      while (i-- > 0)
+        slab_free (s, c, objs[i]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static inline void
+slab_free_bulk (slab_t * s, slab_cache_t * c, void *const *objs, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    slab_free (s, c, objs[i]);
+}
+
+/**
+ * Gives the whole cache back to the depot, e.g. when its thread exits.
+ */
+static inline void
+slab_cache_drain (slab_t * s, slab_cache_t * c)
+{
+  slab_flush (s, c, c->cnt);
+}
+
+#endif /* UTILS_SLAB_H_ */
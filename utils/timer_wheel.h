@@ -0,0 +1,247 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UTILS_TIMER_WHEEL_H_
+#define UTILS_TIMER_WHEEL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Hierarchical timer wheel. Every level has TW_SLOTS slots, a slot of level
+ * 'l' spans TW_SLOTS^l ticks. A timer is placed at the level of the highest
+ * digit (base TW_SLOTS) in which its expiration differs from the current tick,
+ * and is cascaded to the lower levels when the wheel reaches its slot.
+ * Insertion, removal and expiration are O(1). A bitmap of occupied slots per
+ * level gives the next tick with work in O(1), so idle periods are skipped.
+ */
+#define TW_LEVELS  4
+#define TW_BITS    6
+#define TW_SLOTS   ( 1U << TW_BITS )
+#define TW_MASK    ( TW_SLOTS - 1U )
+#define TW_SPAN    ( 1ULL << (TW_BITS * TW_LEVELS) )   /* furthest expiration in ticks */
+#define TW_NEVER   UINT64_MAX
+
+typedef struct tw_timer
+{
+  struct tw_timer *next;
+  struct tw_timer **pprev;       /**< NULL when the timer is not pending */
+  uint64_t expires;              /**< Expiration tick */
+  uint8_t level;
+  uint8_t slot;
+  void (*fn) (struct tw_timer *);
+  void *arg;
+} tw_timer_t;
+
+typedef struct
+{
+  uint64_t now;                  /**< Last processed tick */
+  size_t count;                  /**< Pending timers */
+  uint64_t occupied[TW_LEVELS];
+  tw_timer_t *slots[TW_LEVELS][TW_SLOTS];
+} tw_wheel_t;
+
+
+static inline void
+tw_init (tw_wheel_t * w, uint64_t now)
+{
+  size_t l, s;
+
+  w->now = now;
+  w->count = 0;
+  for (l = 0; l < TW_LEVELS; l++) {
+    w->occupied[l] = 0;
+    for (s = 0; s < TW_SLOTS; s++)
+      w->slots[l][s] = NULL;
+  }
+}
+
+static inline void
+tw_timer_init (tw_timer_t * t, void (*fn) (tw_timer_t *), void *arg)
+{
+  t->next = NULL;
+  t->pprev = NULL;
+  t->expires = 0;
+  t->fn = fn;
+  t->arg = arg;
+}
+
+static inline int
+tw_pending (const tw_timer_t * t)
+{
+  return t->pprev != NULL;
+}
+
+static inline void
+_tw_link (tw_wheel_t * w, tw_timer_t * t)
+{
+  uint64_t diff;
+  uint8_t l = 0;
+
+  /* the level is given by the highest differing digit */
+  diff = t->expires ^ w->now;
+  while (l < TW_LEVELS - 1 && (diff >> (TW_BITS * (l + 1))))
+    l++;
+
+  t->level = l;
+  t->slot = (t->expires >> (TW_BITS * l)) & TW_MASK;
+  t->next = w->slots[l][t->slot];
+  if (t->next)
+    t->next->pprev = &t->next;
+  t->pprev = &w->slots[l][t->slot];
+  w->slots[l][t->slot] = t;
+  w->occupied[l] |= 1ULL << t->slot;
+}
+
+/**
+ * Removes a timer from the wheel. It is safe to call it for timers that
+ * are not pending.
+ */
+static inline void
+tw_del (tw_wheel_t * w, tw_timer_t * t)
+{
+  if (!t->pprev)
+    return;
+
+  *t->pprev = t->next;
+  if (t->next)
+    t->next->pprev = t->pprev;
+  if (!w->slots[t->level][t->slot])
+    w->occupied[t->level] &= ~(1ULL << t->slot);
+
+  t->next = NULL;
+  t->pprev = NULL;
+  w->count--;
+}
+
+/**
+ * (Re)arms a timer to expire at tick 'expires'. Deadlines in the past
+ * expire on the next tick.
+ */
+static inline void
+tw_add (tw_wheel_t * w, tw_timer_t * t, uint64_t expires)
+{
+  tw_del (w, t);
+  if (expires <= w->now)
+    expires = w->now + 1;
+  if (expires - w->now >= TW_SPAN)
+    expires = w->now + TW_SPAN - 1;
+  t->expires = expires;
+  _tw_link (w, t);
+  w->count++;
+}
+
+/**
+ * @return the next tick at which a timer expires or a slot cascades
+ * (TW_NEVER if the wheel is empty). The actual expiration may come later.
+ */
+static inline uint64_t
+tw_next (const tw_wheel_t * w)
+{
+  uint64_t next = TW_NEVER;
+  uint64_t ahead;
+  uint64_t base;
+  uint64_t tick;
+  unsigned digit;
+  size_t l;
+
+  if (!w->count)
+    return TW_NEVER;
+
+  /*
+   * The occupied slots of a level lie ahead of the current digit. Only the
+   * top level wraps around, its slots at or behind the digit belong to the
+   * next revolution.
+   */
+  for (l = 0; l < TW_LEVELS; l++) {
+    if (!w->occupied[l])
+      continue;
+    base = w->now & ~((1ULL << (TW_BITS * (l + 1))) - 1);
+    digit = (w->now >> (TW_BITS * l)) & TW_MASK;
+    ahead = (digit == TW_MASK) ? 0 : w->occupied[l] & (~0ULL << (digit + 1));
+    if (ahead)
+      tick = base + ((uint64_t) __builtin_ctzll (ahead) << (TW_BITS * l));
+    else
+      tick = base + (1ULL << (TW_BITS * (l + 1)))
+          + ((uint64_t) __builtin_ctzll (w->occupied[l]) << (TW_BITS * l));
+    if (tick < next)
+      next = tick;
+  }
+
+  return next;
+}
+
+/**
+ * Runs every timer that expires up to (and including) tick 'to'. The callbacks
+ * may re-arm timers.
+ *
+ * @return the number of expired timers
+ */
+static inline size_t
+tw_advance (tw_wheel_t * w, uint64_t to)
+{
+  tw_timer_t *list;
+  tw_timer_t *t;
+  size_t fired = 0;
+  uint64_t tick;
+  int l;
+
+  while (w->now < to) {
+    tick = tw_next (w);
+    if (tick > to) {
+      w->now = to;
+      break;
+    }
+    w->now = tick;
+
+    /* cascade the slots that the wheel just reached, highest level first */
+    for (l = TW_LEVELS - 1; l > 0; l--) {
+      if (tick & ((1ULL << (TW_BITS * l)) - 1))
+        continue;
+      list = w->slots[l][(tick >> (TW_BITS * l)) & TW_MASK];
+      w->slots[l][(tick >> (TW_BITS * l)) & TW_MASK] = NULL;
+      w->occupied[l] &= ~(1ULL << ((tick >> (TW_BITS * l)) & TW_MASK));
+      while ((t = list)) {
+        list = t->next;
+        _tw_link (w, t);
+      }
+    }
+
+    list = w->slots[0][tick & TW_MASK];
+    w->slots[0][tick & TW_MASK] = NULL;
+    w->occupied[0] &= ~(1ULL << (tick & TW_MASK));
+    if (list)
+      list->pprev = &list;       /* detached, tw_del() from a callback stays valid */
+    while ((t = list)) {
+      list = t->next;
+      if (list)
+        list->pprev = &list;
+      t->next = NULL;
+      t->pprev = NULL;
+      w->count--;
+      fired++;
+      t->fn (t);
+    }
+  }
+
+  return fired;
+}
+
+#endif /* UTILS_TIMER_WHEEL_H_ */
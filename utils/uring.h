@@ -0,0 +1,393 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UTILS_URING_H_
+#define UTILS_URING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+/*
+ * Minimal io_uring on top of the raw system calls (no liburing). The rings are
+ * mapped once, requests and completions then go through shared memory and a
+ * single io_uring_enter() submits any number of queued requests while it
+ * reaps the completions. A provided buffer ring lets a multishot receive pick
+ * a buffer per datagram without a request per datagram.
+ * Not thread-safe, a ring belongs to a single thread at a time.
+ *
+ * URING_AVAILABLE is defined if the kernel headers know multishot recvmsg()
+ * and provided buffer rings (Linux 6.0), the helpers are left out otherwise.
+ * At run time uring_init() fails on kernels without io_uring (or with it
+ * disabled), the callers are expected to fall back to plain sockets.
+ */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)  /* IORING_REGISTER_PBUF_RING (5.19) is an enum */
+#define URING_AVAILABLE 1
+#endif
+#endif
+#endif
+
+#ifdef URING_AVAILABLE
+
+typedef struct
+{
+  int fd;
+  uint32_t *sq_head;
+  uint32_t *sq_tail;
+  uint32_t *sq_array;
+  uint32_t sq_mask;
+  uint32_t sq_entries;
+  uint32_t sq_local;             /**< Tail of the SQEs handed out, published by uring_enter() */
+  struct io_uring_sqe *sqes;
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  void *cq_ring;                 /**< Same as 'sq_ring' with IORING_FEAT_SINGLE_MMAP */
+  size_t sq_ring_sz;
+  size_t cq_ring_sz;
+  size_t sqes_sz;
+} uring_t;
+
+/* A provided buffer ring of 'entries' (a power of 2) buffers of 'buf_len' bytes */
+typedef struct
+{
+  struct io_uring_buf_ring *br;
+  uint8_t *bufs;
+  size_t br_sz;
+  size_t bufs_sz;
+  uint32_t buf_len;
+  uint16_t entries;
+  uint16_t tail;                 /**< Published to the kernel by uring_bufs_publish() */
+  uint16_t bgid;
+} uring_bufs_t;
+
+
+static inline void
+uring_free (uring_t * r)
+{
+  if (r->sqes)
+    munmap (r->sqes, r->sqes_sz);
+  if (r->cq_ring && r->cq_ring != r->sq_ring)
+    munmap (r->cq_ring, r->cq_ring_sz);
+  if (r->sq_ring)
+    munmap (r->sq_ring, r->sq_ring_sz);
+  if (r->fd >= 0)
+    close (r->fd);
+  memset (r, 0, sizeof(*r));
+  r->fd = -1;
+}
+
+/**
+ * Creates a ring of 'entries' SQEs and 'cq_entries' CQEs. The waits of
+ * uring_enter() need IORING_FEAT_EXT_ARG (Linux 5.11).
+ *
+ * @return 0 on success, -1 on failure (errno is set)
+ */
+static inline int
+uring_init (uring_t * r, uint32_t entries, uint32_t cq_entries)
+{
+  struct io_uring_params p;
+  uint8_t *sq;
+  uint8_t *cq;
+  int err;
+
+  memset (r, 0, sizeof(*r));
+  memset (&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = cq_entries;
+
+  r->fd = (int) syscall (__NR_io_uring_setup, entries, &p);
+  if (r->fd < 0)
+    return -1;
+  if (!(p.features & IORING_FEAT_EXT_ARG)) {
+    uring_free (r);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+  r->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_ring_sz > r->sq_ring_sz)
+      r->sq_ring_sz = r->cq_ring_sz;
+    r->cq_ring_sz = r->sq_ring_sz;
+  }
+
+  r->sq_ring = mmap (NULL, r->sq_ring_sz, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED)
+    goto fail_sq;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_ring = r->sq_ring;
+  else {
+    r->cq_ring = mmap (NULL, r->cq_ring_sz, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED)
+      goto fail_cq;
+  }
+  r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = (struct io_uring_sqe *) mmap (NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    goto fail_sqes;
+
+  sq = (uint8_t *) r->sq_ring;
+  cq = (uint8_t *) r->cq_ring;
+  r->sq_head = (uint32_t *) (sq + p.sq_off.head);
+  r->sq_tail = (uint32_t *) (sq + p.sq_off.tail);
+  r->sq_array = (uint32_t *) (sq + p.sq_off.array);
+  r->sq_mask = *(uint32_t *) (sq + p.sq_off.ring_mask);
+  r->sq_entries = p.sq_entries;
+  r->sq_local = *r->sq_tail;
+  r->cq_head = (uint32_t *) (cq + p.cq_off.head);
+  r->cq_tail = (uint32_t *) (cq + p.cq_off.tail);
+  r->cq_mask = *(uint32_t *) (cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  return 0;
+
+fail_sqes:
+  r->sqes = NULL;
+fail_cq:
+  if (r->cq_ring == MAP_FAILED)
+    r->cq_ring = NULL;
+fail_sq:
+  if (r->sq_ring == MAP_FAILED)
+    r->sq_ring = NULL;
+  err = errno;
+  uring_free (r);
+  errno = err;
+  return -1;
+}
+
+/**
+ * @return a zeroed SQE, submitted by the next uring_enter(), or NULL if the
+ * submission queue is full
+ */
+static inline struct io_uring_sqe *
+uring_get_sqe (uring_t * r)
+{
+  struct io_uring_sqe *sqe;
+  uint32_t idx;
+
+  if (r->sq_local - __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+    return NULL;
+
+  idx = r->sq_local++ & r->sq_mask;
+  r->sq_array[idx] = idx;
+  sqe = &r->sqes[idx];
+  memset (sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+/**
+ * Submits the SQEs that the kernel has not consumed yet and runs the pending
+ * completions. If 'wait_nr' is not 0, it waits until that many CQEs are
+ * available or 'timeout' (if not NULL) elapses.
+ *
+ * @return the number of SQEs submitted (0 if the wait timed out or got
+ * interrupted) or -1 on failure (errno is set)
+ */
+static inline int
+uring_enter (uring_t * r, uint32_t wait_nr, const struct __kernel_timespec *timeout)
+{
+  struct io_uring_getevents_arg arg;
+  uint32_t submit;
+  int ret;
+
+  __atomic_store_n (r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+  submit = r->sq_local - __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE);
+
+  memset (&arg, 0, sizeof(arg));
+  arg.ts = (uint64_t) (uintptr_t) timeout;
+
+  ret = (int) syscall (__NR_io_uring_enter, r->fd, submit, wait_nr,
+                       IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+  if (ret < 0 && (errno == ETIME || errno == EINTR))
+    return 0;
+  return ret;
+}
+
+/**
+ * @return the oldest completion, released by uring_cqe_seen(), or NULL if
+ * there is none
+ */
+static inline struct io_uring_cqe *
+uring_cqe_peek (uring_t * r)
+{
+  uint32_t head = *r->cq_head;
+
+  if (head == __atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &r->cqes[head & r->cq_mask];
+}
+
+static inline void
+uring_cqe_seen (uring_t * r)
+{
+  __atomic_store_n (r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+static inline void
+uring_prep_sendmsg (struct io_uring_sqe *sqe, int fd, const struct msghdr *msg,
+                    uint32_t flags, uint64_t user_data)
+{
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) msg;
+  sqe->len = 1;
+  sqe->msg_flags = flags;
+  sqe->user_data = user_data;
+}
+
+/*
+ * 'msg' is a template: every datagram lands in a buffer of group 'bgid' after
+ * a struct io_uring_recvmsg_out and msg_namelen + msg_controllen bytes. The
+ * request stays posted while its CQEs carry IORING_CQE_F_MORE.
+ */
+static inline void
+uring_prep_recvmsg_multishot (struct io_uring_sqe *sqe, int fd, const struct msghdr *msg,
+                              uint16_t bgid, uint64_t user_data)
+{
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) msg;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = bgid;
+  sqe->user_data = user_data;
+}
+
+static inline uint8_t *
+uring_bufs_at (const uring_bufs_t * b, uint16_t bid)
+{
+  return b->bufs + (size_t) bid * b->buf_len;
+}
+
+/**
+ * Hands buffer 'bid' back to the kernel, once uring_bufs_publish() runs.
+ */
+static inline void
+uring_bufs_add (uring_bufs_t * b, uint16_t bid)
+{
+  struct io_uring_buf *buf = &b->br->bufs[b->tail & (b->entries - 1)];
+
+  buf->addr = (uint64_t) (uintptr_t) uring_bufs_at (b, bid);
+  buf->len = b->buf_len;
+  buf->bid = bid;
+  b->tail++;
+}
+
+static inline void
+uring_bufs_publish (uring_bufs_t * b)
+{
+  __atomic_store_n (&b->br->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Releases the buffers, it may follow uring_free() (closing the ring drops
+ * the registration).
+ */
+static inline void
+uring_bufs_free (uring_t * r, uring_bufs_t * b)
+{
+  struct io_uring_buf_reg reg;
+
+  if (b->br && r->fd >= 0) {
+    memset (&reg, 0, sizeof(reg));
+    reg.bgid = b->bgid;
+    syscall (__NR_io_uring_register, r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  }
+  if (b->br)
+    munmap (b->br, b->br_sz);
+  if (b->bufs)
+    munmap (b->bufs, b->bufs_sz);
+  memset (b, 0, sizeof(*b));
+}
+
+/**
+ * Registers a provided buffer ring (Linux 5.19) as group 'bgid', with all
+ * its buffers handed to the kernel.
+ *
+ * @return 0 on success, -1 on failure (errno is set)
+ */
+static inline int
+uring_bufs_init (uring_t * r, uring_bufs_t * b, uint16_t bgid, uint16_t entries, uint32_t buf_len)
+{
+  struct io_uring_buf_reg reg;
+  uint16_t i;
+  int err;
+
+  memset (b, 0, sizeof(*b));
+  b->bgid = bgid;
+  b->entries = entries;
+  b->buf_len = buf_len;
+  b->br_sz = entries * sizeof(struct io_uring_buf);
+  b->bufs_sz = (size_t) entries * buf_len;
+
+  /* page aligned, as the kernel requires for the ring */
+  b->br = (struct io_uring_buf_ring *) mmap (NULL, b->br_sz, PROT_READ | PROT_WRITE,
+                                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (b->br == MAP_FAILED) {
+    b->br = NULL;
+    return -1;
+  }
+  b->bufs = (uint8_t *) mmap (NULL, b->bufs_sz, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (b->bufs == MAP_FAILED) {
+    b->bufs = NULL;
+    goto fail;
+  }
+
+  memset (&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) (uintptr_t) b->br;
+  reg.ring_entries = entries;
+  reg.bgid = bgid;
+  if (syscall (__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    goto fail;
+
+  for (i = 0; i < entries; i++)
+    uring_bufs_add (b, i);
+  uring_bufs_publish (b);
+  return 0;
+
+fail:
+  err = errno;
+  if (b->bufs)
+    munmap (b->bufs, b->bufs_sz);
+  munmap (b->br, b->br_sz);
+  memset (b, 0, sizeof(*b));
+  errno = err;
+  return -1;
+}
+
+#endif /* URING_AVAILABLE */
+
+#endif /* UTILS_URING_H_ */